@@ -49,5 +49,12 @@ def medianTime(name):
 
 lexerTime = medianTime('lexer')
 fibTime = medianTime('fib')
-print 'date          lexer     fib'
-print '{0}  {1:6}s {2:6}s'.format(date.today(), lexerTime, fibTime)
+sendTime = medianTime('send')
+compileTime = medianTime('compile')
+closuresTime = medianTime('closures')
+cyclesTime = medianTime('cycles')
+registersTime = medianTime('registers')
+print 'date          lexer     fib    send compile closures  cycles registers'
+print '{0}  {1:6}s {2:6}s {3:6}s {4:6}s {5:6}s {6:6}s {7:6}s'.format(
+    date.today(), lexerTime, fibTime, sendTime, compileTime, closuresTime,
+    cyclesTime, registersTime)
@@ -58,6 +58,7 @@
       'src/Compiler/Block.h',
       'src/Compiler/Compiler.cpp',
       'src/Compiler/Compiler.h',
+      'src/Compiler/OptimizeScratch.h',
       'src/finch.1',
       'src/IErrorReporter.h',
       'src/IInterpreterHost.h',
@@ -66,15 +67,20 @@
       'src/Interpreter/Fiber.h',
       'src/Interpreter/FileLineReader.cpp',
       'src/Interpreter/FileLineReader.h',
+      'src/Interpreter/Heap.cpp',
+      'src/Interpreter/Heap.h',
+      'src/Interpreter/MessageCache.cpp',
+      'src/Interpreter/MessageCache.h',
       'src/Interpreter/Objects/ArrayObject.h',
       'src/Interpreter/Objects/BlockObject.h',
       'src/Interpreter/Objects/BlockObject.cpp',
       'src/Interpreter/Objects/DynamicObject.cpp',
       'src/Interpreter/Objects/DynamicObject.h',
       'src/Interpreter/Objects/FiberObject.h',
-      'src/Interpreter/Objects/NumberObject.h',
       'src/Interpreter/Objects/Object.cpp',
       'src/Interpreter/Objects/Object.h',
+      'src/Interpreter/Objects/Shape.cpp',
+      'src/Interpreter/Objects/Shape.h',
       'src/Interpreter/Objects/StringObject.h',
       'src/Interpreter/Primitives/ArrayPrimitives.cpp',
       'src/Interpreter/Primitives/ArrayPrimitives.h',
@@ -150,6 +156,10 @@
       'sources': [
         'src/Test/ArrayTests.cpp',
         'src/Test/ArrayTests.h',
+        'src/Test/HeapTests.cpp',
+        'src/Test/HeapTests.h',
+        'src/Test/IdTableTests.cpp',
+        'src/Test/IdTableTests.h',
         'src/Test/LexerTests.cpp',
         'src/Test/LexerTests.h',
         'src/Test/QueueTests.cpp',
@@ -158,6 +168,8 @@
         'src/Test/RefTests.h',
         'src/Test/StackTests.cpp',
         'src/Test/StackTests.h',
+        'src/Test/StringTableTests.cpp',
+        'src/Test/StringTableTests.h',
         'src/Test/StringTests.cpp',
         'src/Test/StringTests.h',
         'src/Test/Test.cpp',
@@ -98,6 +98,7 @@ namespace Finch
         void Clear()
         {
             if (mItems != NULL) delete [] mItems;
+            mItems = NULL;
             mCount = 0;
             mCapacity = 0;
         }
@@ -142,6 +143,27 @@ namespace Finch
             mCount = count;
         }
         
+        // Replaces the contents of the array with `count` copies of the given
+        // value. Unlike assigning a new array, this reuses the existing
+        // storage if it's big enough.
+        void Fill(int count, const T & value)
+        {
+            ASSERT(count >= 0, "Cannot fill to a negative count.");
+            
+            EnsureCapacity(count);
+            for (int i = 0; i < count; i++)
+            {
+                mItems[i] = value;
+            }
+            
+            for (int i = count; i < mCount; i++)
+            {
+                mItems[i] = T();
+            }
+            
+            mCount = count;
+        }
+        
         // Assigns the contents of the given array to this one. Clears this
         // array and refills it with the contents of the other.
         Array & operator=(const Array & other)
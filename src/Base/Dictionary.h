@@ -181,11 +181,12 @@ namespace Finch
         NO_COPY(Dictionary);
     };
 
-    // TODO(bob): Total hack. Copy and pasting Dictionary so that we can use
-    // int keys is lame!
-    // A dictionary mapping non-negative ints to values. Uses a
-    // dynamically-grown hashtable. TValue must have a default constructor as
-    // well as support copying.
+    // A dictionary mapping non-negative ints to values. Most tables (the
+    // fields and methods of a single object) only hold a few items, so up to
+    // INLINE_CAPACITY items are stored directly in the table and found with a
+    // linear scan. Past that, the items are moved to a dynamically-grown
+    // hashtable. TValue must have a default constructor as well as support
+    // copying.
     template <class TValue>
     class IdTable
     {
@@ -193,7 +194,8 @@ namespace Finch
         IdTable()
         :   mTable(NULL),
             mCount(0),
-            mTableSize(0)
+            mTableSize(0),
+            mNumTombstones(0)
         {}
         
         ~IdTable()
@@ -204,28 +206,81 @@ namespace Finch
             }
         }
         
+        // Gets the number of items in the table.
+        int Count() const { return mCount; }
+        
+        // Gets the number of bytes used by the table, including the heap
+        // storage for its items.
+        int MemorySize() const
+        {
+            return static_cast<int>(sizeof(IdTable<TValue>) +
+                                    mTableSize * sizeof(Pair));
+        }
+        
         // Looks up the value associated with the given key. Returns a null
         // reference if the key was not found.
-        bool Find(StringId key, TValue * value)
+        bool Find(StringId key, TValue * value) const
         {
-            int index = FindIndex(key);            
+            int index = FindIndex(key);
             
             if (index == -1) return false;
             
-            *value = mTable[index].value;
+            *value = Items()[index].value;
             return true;
         }
         
+        // Gets the number of slots the items are stored in. Together with
+        // ValueAt(), this can be used to visit every item in the table.
+        int NumItemSlots() const
+        {
+            return (mTable != NULL) ? mTableSize : mCount;
+        }
+        
+        // Gets the value stored in the given slot, or NULL if the slot is
+        // empty. The pointer is only valid until the table is changed.
+        const TValue * ValueAt(int slot) const
+        {
+            ASSERT_RANGE(slot, NumItemSlots());
+            
+            const Pair & item = Items()[slot];
+            return (item.key >= 0) ? &item.value : NULL;
+        }
+        
+        // Inserts every item in the given table into this one.
+        void AddAll(const IdTable<TValue> & other)
+        {
+            const Pair * items = other.Items();
+            for (int i = 0; i < other.NumItemSlots(); i++)
+            {
+                if (items[i].key >= 0)
+                {
+                    Insert(items[i].key, items[i].value);
+                }
+            }
+        }
+        
+        // Looks up the value associated with the given key without copying
+        // it. Returns NULL if the key was not found. The pointer is only valid
+        // until the table is changed.
+        const TValue * Find(StringId key) const
+        {
+            int index = FindIndex(key);
+            if (index == -1) return NULL;
+            
+            return &Items()[index].value;
+        }
+        
         // Does a reverse look-up to find a key with the given value. May be
         // slow. If there are multiple keys with the same value, chooses one
         // arbitrarily. Returns `-1` if not found.
-        StringId FindKeyForValue(const TValue & value)
+        StringId FindKeyForValue(const TValue & value) const
         {
-            for (int i = 0; i < mTableSize; i++)
+            const Pair * items = Items();
+            for (int i = 0; i < NumItemSlots(); i++)
             {
-                if (mTable[i].value == value)
+                if ((items[i].key >= 0) && (items[i].value == value))
                 {
-                    return mTable[i].key;
+                    return items[i].key;
                 }
             }
             
@@ -233,27 +288,80 @@ namespace Finch
             return NO_STRING;
         }
         
-        // Inserts the given value at the given key.
+        // Inserts the given value at the given key. If the key is already
+        // present, its value is replaced.
         void Insert(StringId key, const TValue & value)
         {
-            mCount++;
-            EnsureCapacity();
+            ASSERT(key >= 0, "Cannot insert a negative key.");
             
-            // figure out where to insert it in the table. use open addressing
-            // and basic linear probing
-            int index = static_cast<int>(key & 0x7fffffff) % mTableSize;
+            if (mTable == NULL)
+            {
+                for (int i = 0; i < mCount; i++)
+                {
+                    if (mInline[i].key == key)
+                    {
+                        mInline[i].value = value;
+                        return;
+                    }
+                }
+                
+                if (mCount < INLINE_CAPACITY)
+                {
+                    mInline[mCount].key   = key;
+                    mInline[mCount].value = value;
+                    mCount++;
+                    return;
+                }
+                
+                // too many items to keep inline, so move them to the heap
+                Resize(MIN_CAPACITY);
+            }
             
-            // note that we shouldn't have to worry about an infinite loop here
-            // the previous call will ensure there are open spaces in the table
-            while ((mTable[index].key != NO_STRING) &&
-                   (mTable[index].key != key))
+            // look for the key, remembering the first tombstone along the way
+            // so that its slot can be reused
+            int mask = mTableSize - 1;
+            int index = key & mask;
+            int tombstone = -1;
+            while (mTable[index].key != NO_STRING)
             {
-                index = (index + 1) % mTableSize;
+                if (mTable[index].key == key)
+                {
+                    mTable[index].value = value;
+                    return;
+                }
+                
+                if ((mTable[index].key == TOMBSTONE) && (tombstone == -1))
+                {
+                    tombstone = index;
+                }
+                
+                index = (index + 1) & mask;
+            }
+            
+            if (tombstone != -1)
+            {
+                // reusing a tombstone doesn't change the load
+                index = tombstone;
+                mNumTombstones--;
+            }
+            else if ((mCount + mNumTombstones + 1) * 100 >
+                     mTableSize * MAX_LOAD_PERCENT)
+            {
+                // if most of the load is tombstones, rehashing at the same
+                // size is enough to clear them out
+                int size = mTableSize;
+                if ((mCount + 1) * 100 > size * MAX_LOAD_PERCENT / 2)
+                {
+                    size *= GROW_FACTOR;
+                }
+                
+                Resize(size);
+                index = FindEmptySlot(key);
             }
             
-            // insert it into the table
             mTable[index].key   = key;
             mTable[index].value = value;
+            mCount++;
         }
         
         // Replaces the value at the given key. If the key is not already
@@ -267,7 +375,7 @@ namespace Finch
             if (index == -1) return false;
             
             // replace the value
-            mTable[index].value = value;
+            Items()[index].value = value;
             
             return true;
         }
@@ -281,31 +389,78 @@ namespace Finch
             // not found
             if (index == -1) return false;
             
-            // remove the item
-            mTable[index].key   = NO_STRING;
-            mTable[index].value = TValue();
+            if (mTable == NULL)
+            {
+                // keep the inline items packed at the front
+                mInline[index] = mInline[mCount - 1];
+                mInline[mCount - 1] = Pair();
+            }
+            else
+            {
+                // leave a tombstone so that probe sequences passing through
+                // this slot still reach the items after it
+                mTable[index].key   = TOMBSTONE;
+                mTable[index].value = TValue();
+                mNumTombstones++;
+            }
             
             mCount--;
             return true;
         }
         
-        // Removes all items from the Dictionary.
+        // Removes all items from the table.
         void Clear()
         {
+            if (mTable != NULL)
+            {
+                delete [] mTable;
+                mTable = NULL;
+            }
+            
+            for (int i = 0; i < mCount && i < INLINE_CAPACITY; i++)
+            {
+                mInline[i] = Pair();
+            }
+            
             mCount = 0;
             mTableSize = 0;
-            delete [] mTable;
+            mNumTombstones = 0;
         }
         
     private:
-        // Gets the index of the item with the given key in the table, or -1
-        // if not found.
-        int FindIndex(StringId key)
+        struct Pair
         {
-            // can't find it in an empty table
-            if (mTableSize == 0) return -1;
+            StringId    key;
+            TValue      value;
             
-            int index = static_cast<int>(key & 0x7fffffff) % mTableSize;
+            Pair() : key(NO_STRING) {}
+        };
+        
+        // Gets the array where the items are currently stored.
+        Pair * Items() { return (mTable != NULL) ? mTable : mInline; }
+        const Pair * Items() const
+        {
+            return (mTable != NULL) ? mTable : mInline;
+        }
+        
+        // Gets the index of the item with the given key in Items(), or -1 if
+        // not found.
+        int FindIndex(StringId key) const
+        {
+            if (mTable == NULL)
+            {
+                for (int i = 0; i < mCount; i++)
+                {
+                    if (mInline[i].key == key) return i;
+                }
+                
+                return -1;
+            }
+            
+            // string ids are handed out sequentially, so the low bits are
+            // already well distributed and can be used directly as the hash
+            int mask = mTableSize - 1;
+            int index = key & mask;
             
             while (true)
             {
@@ -316,62 +471,77 @@ namespace Finch
                 if (mTable[index].key == NO_STRING) return -1;
                 
                 // try the next slot
-                index = (index + 1) % mTableSize;
+                index = (index + 1) & mask;
             }
         }
         
-        void EnsureCapacity()
+        // Gets the index of the first empty slot in the probe sequence for the
+        // given key. Assumes the key isn't in the table and that there are no
+        // tombstones.
+        int FindEmptySlot(StringId key) const
         {
-            // only resize if we're too full
-            if (mCount <= mTableSize * MAX_LOAD_PERCENT / 100) return;
-            
-            // figure out the new table size
-            int oldSize = mTableSize;
-            mTableSize = MIN_CAPACITY;
-            if (oldSize >= MIN_CAPACITY)
+            int mask = mTableSize - 1;
+            int index = key & mask;
+            while (mTable[index].key != NO_STRING)
             {
-                mTableSize = oldSize * GROW_FACTOR;
+                index = (index + 1) & mask;
             }
             
-            // create the new hashtable
+            return index;
+        }
+        
+        // Moves the items into a new hashtable with the given number of slots,
+        // which must be a power of two.
+        void Resize(int size)
+        {
+            Pair * oldItems = Items();
+            int numOldItems = NumItemSlots();
             Pair * oldTable = mTable;
-            mTable = new Pair[mTableSize];
             
-            // move the existing items over
-            if (oldTable != NULL)
+            mTable = new Pair[size];
+            mTableSize = size;
+            mNumTombstones = 0;
+            
+            for (int i = 0; i < numOldItems; i++)
             {
-                for (int i = 0; i < oldSize; i++)
+                if (oldItems[i].key >= 0)
                 {
-                    if (oldTable[i].key != NO_STRING)
-                    {
-                        Insert(oldTable[i].key, oldTable[i].value);
-                    }
+                    mTable[FindEmptySlot(oldItems[i].key)] = oldItems[i];
                 }
                 
+                // release the values held by the inline items
+                if (oldTable == NULL) oldItems[i] = Pair();
+            }
+            
+            if (oldTable != NULL)
+            {
                 delete [] oldTable;
             }
         }
         
-        // What percentage of the table should be filled with values before
-        // it is resized.
+        // The number of items stored in the table itself before it switches
+        // to a hashtable.
+        static const int INLINE_CAPACITY = 4;
+        
+        // What percentage of the hashtable can be filled with items and
+        // tombstones before it is resized. Must leave at least one slot empty
+        // so that probing always terminates.
         static const int MAX_LOAD_PERCENT = 75;
         
-        static const int MIN_CAPACITY = 16;
+        // The size of the hashtable when the items are first moved out of the
+        // table. Must be a power of two.
+        static const int MIN_CAPACITY = 8;
         static const int GROW_FACTOR  = 2;
         
-        struct Pair
-        {
-            StringId    key;
-            TValue      value;
-            
-            Pair() : key(NO_STRING) {}
-        };
+        // Key of a slot whose item was removed.
+        static const StringId TOMBSTONE = -2;
         
-        Pair * mTable;
-        int    mCount;     // number of items stored in the table
-        int    mTableSize; // size of the table itself
+        Pair   mInline[INLINE_CAPACITY];
+        Pair * mTable;          // NULL while the items are stored inline
+        int    mCount;          // number of items stored in the table
+        int    mTableSize;      // size of the hashtable
+        int    mNumTombstones;  // number of removed slots in the hashtable
         
         NO_COPY(IdTable);
     };
 }
-
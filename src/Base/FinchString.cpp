@@ -16,6 +16,11 @@ namespace Finch
         hashCode = Fnv1Hash(text);
     }
     
+    String::StringData::~StringData()
+    {
+        delete [] chars;
+    }
+    
     String String::Format(const char* format, ...)
     {
         char result[FormattedStringMax];
@@ -68,9 +68,11 @@ namespace Finch
         static unsigned int Fnv1Hash(const char * text);
         
     private:
-        struct StringData
+        struct StringData : public RefCounted
         {
+            // Takes ownership of the given heap-allocated characters.
             StringData(const char * text);
+            ~StringData();
             
             int          length;
             const char * chars;
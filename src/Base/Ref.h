@@ -6,41 +6,68 @@
 
 namespace Finch
 {
-    // Referenced-linked smart pointer.
+    // Base class for objects that are owned by Ref<T>. The object holds the
+    // count of references to it, so a Ref<T> is just a pointer and copying
+    // one doesn't touch any memory besides the object itself.
+    class RefCounted
+    {
+    public:
+        RefCounted()
+        :   mRefCount(0)
+        {}
+        
+        // Copying an object doesn't copy its references: the copy starts out
+        // without any.
+        RefCounted(const RefCounted &)
+        :   mRefCount(0)
+        {}
+        
+        RefCounted & operator =(const RefCounted &)
+        {
+            return *this;
+        }
+        
+    private:
+        template <class T> friend class Ref;
+        
+        int mRefCount;
+    };
+    
+// GCC can't tell that an object whose count was just decremented may still
+// have other references, so it warns about using objects after deleting them
+// when Ref<T> is inlined.
+#if defined(__GNUC__) && (__GNUC__ >= 12)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuse-after-free"
+#endif
+
+    // Reference-counted smart pointer. T must derive from RefCounted.
     template <class T>
     class Ref
     {
     public:
         // Constructs a new null pointer.
         Ref()
-        :   mObj(NULL),
-            mPrev(this),
-            mNext(this)
+        :   mObj(NULL)
         {}
 
-        // Wraps the given raw pointer in a new smart pointer. This should only
-        // be used once for any given pointer (i.e. you wrap the raw pointer as
-        // soon as its allocated and then only access it through Ref<T> from
-        // that point on.
+        // Wraps the given raw pointer in a new smart pointer. Once an object
+        // has been wrapped, it's owned by the references to it and will be
+        // deleted when the last one goes away.
         explicit Ref(T * obj)
-        :   mObj(obj),
-            mPrev(this),
-            mNext(this)
-        {}
+        :   mObj(obj)
+        {
+            Retain();
+        }
         
         // Copies a reference. Both references will refer to the same object.
         Ref(const Ref<T> & other)
-        :   mObj(NULL),
-            mPrev(this),
-            mNext(this)
+        :   mObj(other.mObj)
         {
-            if (&other != this)
-            {
-                Link(other);
-            }
+            Retain();
         }
         
-        ~Ref() { Clear(); }
+        ~Ref() { Release(); }
 
         T & operator *() const { return *mObj; }
         T * operator ->() const { return mObj; }
@@ -63,11 +90,10 @@ namespace Finch
         // reference to this one.
         Ref<T>& operator =(const Ref<T> & other)
         {
-            if (&other != this)
-            {
-                Clear();
-                Link(other);
-            }
+            // retain first in case they refer to the same object
+            other.Retain();
+            Release();
+            mObj = other.mObj;
             
             return *this;
         }
@@ -75,51 +101,37 @@ namespace Finch
         // Gets whether or not this reference is pointing to null.
         bool IsNull() const { return mObj == NULL; }
         
+        // Gets whether or not this is the only reference to the object.
+        bool IsUnique() const
+        {
+            return (mObj == NULL) || (mObj->mRefCount == 1);
+        }
+        
         // Clears the reference. If this was the last reference to the referred
         // object, it will be deallocated.
         void Clear()
         {
-            if (mNext != this)
-            {
-                // unlink it
-                mPrev->mNext = mNext;
-                mNext->mPrev = mPrev;
-                
-                mPrev = this;
-                mNext = this;
-            }
-            else if (mObj != NULL)
-            {
-                // linked to itself, so it's the last reference
-                delete mObj;
-            }
-            
+            Release();
             mObj = NULL;
         }
         
     private:
-
-        void Link(const Ref<T> & other)
+        void Retain() const
         {
-            // don't bother to share null
-            if (other.mObj != NULL)
-            {
-                mObj = other.mObj;
-                
-                // link it in
-                mPrev = other.mPrev;
-                mNext = &other;
-                
-                other.mPrev = this;
-                mPrev->mNext = this;
-            }
+            if (mObj != NULL) mObj->mRefCount++;
         }
         
-        T * mObj;
+        void Release() const
+        {
+            if ((mObj != NULL) && (--mObj->mRefCount == 0)) delete mObj;
+        }
         
-        mutable const Ref<T> * mPrev;
-        mutable const Ref<T> * mNext;
+        T * mObj;
     };
+
+#if defined(__GNUC__) && (__GNUC__ >= 12)
+#pragma GCC diagnostic pop
+#endif
     
     template <class T>
     std::ostream& operator<<(std::ostream& cout, const Ref<T> & ref)
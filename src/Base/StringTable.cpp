@@ -7,20 +7,57 @@ namespace Finch
         // See if the string is already in the table. We must ensure each string
         // only appears once in the table so that we can reliably compare
         // strings just by index.
-        // TODO(bob): This is O(n). Optimize using a hashtable.
-        for (int i = 0; i < mStrings.Count(); i++)
+        if (mBuckets.Count() > 0)
         {
-            if (mStrings[i] == string) return i;
+            int bucket = FindBucket(string);
+            if (mBuckets[bucket] != NO_STRING) return mBuckets[bucket];
         }
-
+        
         // Not in the table, so add it.
         mStrings.Add(string);
-        return mStrings.Count() - 1;
+        StringId id = mStrings.Count() - 1;
+        
+        if (mStrings.Count() * 100 > mBuckets.Count() * MAX_LOAD_PERCENT)
+        {
+            Rehash(mBuckets.Count() > 0 ? mBuckets.Count() * 2 : MIN_BUCKETS);
+        }
+        else
+        {
+            mBuckets[FindBucket(string)] = id;
+        }
+        
+        return id;
     }
     
     String StringTable::Find(StringId id)
     {
         return mStrings[id];
     }
+    
+    int StringTable::FindBucket(const String & string) const
+    {
+        int mask = mBuckets.Count() - 1;
+        int bucket = static_cast<int>(string.HashCode()) & mask;
+        
+        // Linear probing. The load limit ensures there is always an empty
+        // bucket to stop at.
+        while (mBuckets[bucket] != NO_STRING)
+        {
+            if (mStrings[mBuckets[bucket]] == string) break;
+            bucket = (bucket + 1) & mask;
+        }
+        
+        return bucket;
+    }
+    
+    void StringTable::Rehash(int numBuckets)
+    {
+        mBuckets = Array<StringId>(numBuckets, NO_STRING);
+        
+        for (int i = 0; i < mStrings.Count(); i++)
+        {
+            mBuckets[FindBucket(mStrings[i])] = i;
+        }
+    }
 }
 
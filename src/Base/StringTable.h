@@ -19,7 +19,25 @@ namespace Finch
         String Find(StringId id);
         
     private:
-        Array<String> mStrings;
+        // Gets the bucket where the given string is, or the empty one where
+        // it should be added.
+        int FindBucket(const String & string) const;
+        
+        void Rehash(int numBuckets);
+        
+        // What percentage of the buckets can be in use before rehashing.
+        static const int MAX_LOAD_PERCENT = 75;
+        
+        // The number of buckets when the first string is added. Must be a
+        // power of two.
+        static const int MIN_BUCKETS = 64;
+        
+        Array<String>   mStrings;
+        
+        // Open-addressed hashtable of ids in mStrings, indexed by the string's
+        // hash code. Empty buckets are NO_STRING. The size is always a power
+        // of two.
+        Array<StringId> mBuckets;
     };
 }
 
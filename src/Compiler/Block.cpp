@@ -1,25 +1,74 @@
 #include "Block.h"
+#include "Heap.h"
+#include "OptimizeScratch.h"
 
 #ifdef DEBUG
-#include "Environment.h"
+#include "Interpreter.h"
 #endif
 
 namespace Finch
 {
-    Block::Block(int methodId, const Array<String> & params)
+    Block::Block(int methodId, const Array<String> & params,
+                 const CacheEpochs & epochs)
     :   mMethodId(methodId),
         mParams(params),
+        mEpochs(&epochs),
         mCode(),
         mConstants(),
-        mNumRegisters(0)
+        mConstantBuckets(),
+        mNumRegisters(0),
+        mNumReservedRegisters(0),
+        mNumUpvalues(0),
+        mNumCapturedValues(0),
+        mMarkedCollection(-1)
     {
     }
 
     int Block::AddConstant(const Value & object)
     {
-        // TODO(bob): Unify duplicates.
+        if (mConstantBuckets.Count() > 0)
+        {
+            int bucket = FindConstantBucket(object);
+            if (mConstantBuckets[bucket] != -1) return mConstantBuckets[bucket];
+        }
+        
         mConstants.Add(object);
-        return mConstants.Count() - 1;
+        int index = mConstants.Count() - 1;
+        
+        if (mConstants.Count() * 100 >
+            mConstantBuckets.Count() * MAX_CONSTANT_LOAD_PERCENT)
+        {
+            int numBuckets = (mConstantBuckets.Count() > 0) ?
+                mConstantBuckets.Count() * 2 : MIN_CONSTANT_BUCKETS;
+            
+            mConstantBuckets = Array<int>(numBuckets, -1);
+            for (int i = 0; i < mConstants.Count(); i++)
+            {
+                mConstantBuckets[FindConstantBucket(mConstants[i])] = i;
+            }
+        }
+        else
+        {
+            mConstantBuckets[FindConstantBucket(object)] = index;
+        }
+        
+        return index;
+    }
+    
+    int Block::FindConstantBucket(const Value & value) const
+    {
+        int mask = mConstantBuckets.Count() - 1;
+        int bucket = static_cast<int>(value.HashCode()) & mask;
+        
+        // Linear probing. The load limit ensures there is always an empty
+        // bucket to stop at.
+        while (mConstantBuckets[bucket] != -1)
+        {
+            if (mConstants[mConstantBuckets[bucket]] == value) break;
+            bucket = (bucket + 1) & mask;
+        }
+        
+        return bucket;
     }
     
     int Block::AddBlock(Ref<Block> block)
@@ -28,49 +77,1595 @@ namespace Finch
         return mBlocks.Count() - 1;
     }
     
+    int Block::AddSharedMethods(const SharedMethods & methods)
+    {
+        mSharedMethods.Add(methods);
+        return mSharedMethods.Count() - 1;
+    }
+    
+    void Block::MarkReferences(Heap & heap)
+    {
+        // Every block object made from this block refers to it, so only mark
+        // it for the first one.
+        if (mMarkedCollection == heap.NumCollections()) return;
+        mMarkedCollection = heap.NumCollections();
+        
+        for (int i = 0; i < mConstants.Count(); i++)
+        {
+            heap.Mark(mConstants[i]);
+        }
+        
+        for (int i = 0; i < mMessageCaches.Count(); i++)
+        {
+            mMessageCaches[i].MarkReferences(heap, mEpochs->messages);
+        }
+        
+        for (int i = 0; i < mSharedMethods.Count(); i++)
+        {
+            if (!mSharedMethods[i].table.IsNull())
+            {
+                MarkMethods(heap, *mSharedMethods[i].table);
+            }
+        }
+        
+        // The contained blocks' constants are needed when they are created,
+        // even if there aren't any objects for them yet.
+        for (int i = 0; i < mBlocks.Count(); i++)
+        {
+            mBlocks[i]->MarkReferences(heap);
+        }
+    }
+    
     // Writes an instruction.
     void Block::Write(OpCode op, int a, int b, int c)
     {
-        ASSERT_RANGE(a, 256);
-        ASSERT_RANGE(b, 256);
-        ASSERT_RANGE(c, 256);
+        ASSERT_RANGE(a, MAX_OPERAND);
+        ASSERT_RANGE(b, MAX_OPERAND);
+        ASSERT_RANGE(c, MAX_OPERAND);
         
-        Instruction instruction = (op << 24) |
-                                  ((a & 0xff) << 16) |
-                                  ((b & 0xff) << 8) |
-                                  (c & 0xff);
+        // Each prefix holds the next 8 bits of the operands, starting with the
+        // highest ones.
+        if ((a | b | c) > 0xffff)
+        {
+            WriteInstruction(OP_WIDE, (a >> 16) & 0xff, (b >> 16) & 0xff,
+                             (c >> 16) & 0xff);
+        }
+        
+        if ((a | b | c) > 0xff)
+        {
+            WriteInstruction(OP_WIDE, (a >> 8) & 0xff, (b >> 8) & 0xff,
+                             (c >> 8) & 0xff);
+        }
         
+        WriteInstruction(op, a & 0xff, b & 0xff, c & 0xff);
+    }
+    
+    void Block::WriteInstruction(OpCode op, int a, int b, int c)
+    {
+        Instruction instruction = (op << 24) | (a << 16) | (b << 8) | c;
         mCode.Add(instruction);
     }
 
-    void Block::MarkTailCall()
+    int Block::WriteJump(OpCode op, int a)
+    {
+        WriteJumpInstruction(op, a, 0);
+        return mCode.Count() - 1;
+    }
+    
+    bool Block::PatchJump(int jump)
+    {
+        // The offset is relative to the instruction following the jump.
+        int offset = mCode.Count() - jump - 1;
+        if (offset >= MAX_JUMP) return false;
+        
+        // The high byte goes in the B of the prefix WriteJump() reserved.
+        mCode[jump - 1] = (mCode[jump - 1] & 0xffff00ff) |
+                          (((offset >> 16) & 0xff) << 8);
+        mCode[jump] = (mCode[jump] & 0xffff0000) | (offset & 0xffff);
+        return true;
+    }
+    
+    bool Block::WriteLoop(int target)
+    {
+        // The offset is relative to the instruction following the loop, which
+        // is two past the end: one prefix and the loop itself.
+        int offset = mCode.Count() + 2 - target;
+        if (offset >= MAX_JUMP) return false;
+        
+        WriteJumpInstruction(OP_LOOP, 0xff, offset);
+        return true;
+    }
+    
+    void Block::WriteJumpInstruction(OpCode op, int a, int offset)
+    {
+        ASSERT_RANGE(a, MAX_OPERAND);
+        ASSERT_RANGE(offset, MAX_JUMP);
+        
+        // A jump's B:C is the offset shifted down by 8 bits followed by its
+        // low 8 bits, so the prefix's B holds bits 16-23. The prefix is always
+        // written so that the jump is the same size however far it goes.
+        if (a > 0xffff) WriteInstruction(OP_WIDE, (a >> 16) & 0xff, 0, 0);
+        WriteInstruction(OP_WIDE, (a >> 8) & 0xff, (offset >> 16) & 0xff, 0);
+        WriteInstruction(op, a & 0xff, (offset >> 8) & 0xff, offset & 0xff);
+    }
+    
+    const DecodedInstruction * Block::Decode(const void * const * handlers)
+    {
+        if (mDecoded.Count() > 0) return &mDecoded[0];
+        
+        // Create the inline caches for the message sends and field accesses
+        // up front so that the arrays don't move after we've pointed to them.
+        for (int i = 0; i < mCode.Count(); i++)
+        {
+            OpCode op = DECODE_OP(mCode[i]);
+            if (IsMessageOp(op))
+            {
+                mMessageCaches.Add(MessageCache());
+            }
+            else if ((op == OP_GET_FIELD) || (op == OP_SET_FIELD))
+            {
+                mFieldCaches.Add(FieldCache());
+            }
+        }
+        
+        Array<UnpackedInstruction> code;
+        Array<int> indexes;
+        Unpack(code, indexes);
+        
+        int numCaches = 0;
+        int numFieldCaches = 0;
+        for (int i = 0; i < code.Count(); i++)
+        {
+            DecodedInstruction decoded;
+            decoded.op = code[i].op;
+            decoded.a = code[i].a;
+            decoded.b = code[i].b;
+            decoded.c = code[i].c;
+            decoded.handler = (handlers != NULL) ? handlers[decoded.op] : NULL;
+            decoded.cache = NULL;
+            
+            if (IsMessageOp(decoded.op))
+            {
+                decoded.cache = &mMessageCaches[numCaches++];
+            }
+            else if ((decoded.op == OP_GET_FIELD) || (decoded.op == OP_SET_FIELD))
+            {
+                decoded.fieldCache = &mFieldCaches[numFieldCaches++];
+            }
+            else if (IsJumpOp(decoded.op))
+            {
+                // Offsets are relative to the next instruction.
+                int offset = code[i].target - (i + 1);
+                if (decoded.op == OP_LOOP) offset = -offset;
+                
+                decoded.b = offset >> 8;
+                decoded.c = offset & 0xff;
+            }
+            
+            mDecoded.Add(decoded);
+        }
+        
+        return &mDecoded[0];
+    }
+    
+    void Block::Optimize(OptimizeScratch & scratch)
+    {
+        // Locals that are captured by a closure may be read or written
+        // through an upvalue by any message send, so leave them alone.
+        Array<bool> & captured = scratch.locked;
+        captured.Fill(mNumRegisters, false);
+        
+        Array<UnpackedInstruction> & code = scratch.code;
+        code.Truncate(0);
+        Unpack(code, scratch.indexes);
+        
+        bool optimized = false;
+        bool changed = true;
+        while (changed)
+        {
+            changed = false;
+            
+            for (int i = 0; i < code.Count(); i++)
+            {
+                UnpackedInstruction & instruction = code[i];
+                if (instruction.target == -1) continue;
+                
+                // Jump straight past any jumps to jumps.
+                while ((code[instruction.target].op == OP_JUMP) &&
+                       (instruction.target != i))
+                {
+                    instruction.target = code[instruction.target].target;
+                    changed = true;
+                }
+                
+                // Instead of jumping to the end, just end.
+                if ((instruction.op == OP_JUMP) &&
+                    (code[instruction.target].op == OP_END))
+                {
+                    instruction = code[instruction.target];
+                    changed = true;
+                }
+            }
+            
+            Array<bool> & removed = scratch.removed;
+            removed.Fill(code.Count(), false);
+            Array<bool> & isTarget = scratch.isTarget;
+            isTarget.Fill(code.Count(), false);
+            for (int i = 0; i < code.Count(); i++)
+            {
+                if (code[i].target != -1) isTarget[code[i].target] = true;
+                
+                if (code[i].op == OP_CAPTURE_LOCAL) captured[code[i].a] = true;
+            }
+            
+            for (int i = 0; i < code.Count(); i++)
+            {
+                UnpackedInstruction & instruction = code[i];
+                
+                // The instruction after OP_JUMP_IF_FALSE is the jump to the
+                // code that sends the message normally.
+                if ((i > 0) && (code[i - 1].op == OP_JUMP_IF_FALSE)) continue;
+                
+                int dest = DestRegister(instruction);
+                if ((dest == -1) || captured[dest]) continue;
+                
+                // A move to itself does nothing.
+                if ((instruction.op == OP_MOVE) &&
+                    (instruction.a == instruction.b))
+                {
+                    removed[i] = true;
+                    changed = true;
+                    continue;
+                }
+                
+                // Loading a value that is overwritten before it's read does
+                // nothing either.
+                int budget = MAX_LIVENESS_SEARCH;
+                bool isPure = (instruction.op == OP_CONSTANT) ||
+                              (instruction.op == OP_MOVE) ||
+                              (instruction.op == OP_SELF) ||
+                              (instruction.op == OP_GET_UPVALUE) ||
+                              (instruction.op == OP_GET_CAPTURED);
+                if (isPure && !IsLive(code, removed, dest, i + 1, &budget))
+                {
+                    removed[i] = true;
+                    changed = true;
+                    continue;
+                }
+                
+                // If the result is only moved into another register and then
+                // not used again, write it directly to that register instead.
+                bool canRetarget = isPure || IsMessageOp(instruction.op);
+                if (!canRetarget || (i + 1 >= code.Count())) continue;
+                
+                UnpackedInstruction & next = code[i + 1];
+                budget = MAX_LIVENESS_SEARCH;
+                if ((next.op == OP_MOVE) && (next.a == dest) &&
+                    (next.b != dest) && !isTarget[i + 1] &&
+                    !IsLive(code, removed, dest, i + 2, &budget))
+                {
+                    switch (instruction.op)
+                    {
+                        case OP_SELF:
+                            instruction.a = next.b;
+                            break;
+                        
+                        case OP_CONSTANT:
+                        case OP_MOVE:
+                        case OP_GET_UPVALUE:
+                        case OP_GET_CAPTURED:
+                            instruction.b = next.b;
+                            break;
+                            
+                        default:
+                            instruction.c = next.b;
+                    }
+                    
+                    removed[i + 1] = true;
+                    changed = true;
+                    i++;
+                    continue;
+                }
+                
+                // If a move only feeds the next instruction, have that read
+                // the original register instead.
+                budget = MAX_LIVENESS_SEARCH;
+                if ((instruction.op == OP_MOVE) && !isTarget[i + 1] &&
+                    !IsLive(code, removed, dest, i + 2, &budget) &&
+                    ReplaceRead(next, dest, instruction.a))
+                {
+                    removed[i] = true;
+                    changed = true;
+                    i++;
+                }
+            }
+            
+            if (!changed) break;
+            optimized = true;
+            
+            Compact(code, removed, scratch.indexes);
+        }
+        
+        mNumReservedRegisters = mNumRegisters;
+        if (AllocateRegisters(code, scratch)) optimized = true;
+        if (optimized) Pack(code, scratch.indexes);
+    }
+    
+    void Block::AddFrameStats(FrameStats & stats) const
+    {
+        stats.numBlocks++;
+        stats.reservedRegisters += mNumReservedRegisters;
+        stats.numRegisters += mNumRegisters;
+        
+        if (mNumReservedRegisters > stats.largestReserved)
+        {
+            stats.largestReserved = mNumReservedRegisters;
+        }
+        
+        if (mNumRegisters > stats.largest) stats.largest = mNumRegisters;
+        
+        for (int i = 0; i < mBlocks.Count(); i++)
+        {
+            mBlocks[i]->AddFrameStats(stats);
+        }
+    }
+    
+    void Block::MarkTailCalls()
     {
-        // Must have an instruction.
-        if (mCode.Count() == 0) return;
+        int wideC = 0;
+        for (int i = 0; i < mCode.Count(); i++)
+        {
+            Instruction instruction = mCode[i];
+            OpCode op = DECODE_OP(instruction);
+            int args = (instruction & 0x00ffffff);
+            
+            if (op == OP_WIDE)
+            {
+                wideC = (wideC << 8) | DECODE_C(instruction);
+                continue;
+            }
+            
+            int c = (wideC << 8) | DECODE_C(instruction);
+            wideC = 0;
+            
+            // It's only a tail call if the block returns the message's result.
+            if ((op >= OP_MESSAGE_0) && (op <= OP_MESSAGE_10) &&
+                ReachesEnd(i + 1, c))
+            {
+                int numArgs = op - OP_MESSAGE_0;
+                OpCode tailOp = static_cast<OpCode>(OP_TAIL_MESSAGE_0 + numArgs);
+                mCode[i] = (tailOp << 24) | args;
+            }
+        }
+    }
+    
+    void Block::Unpack(Array<UnpackedInstruction> & code,
+                       Array<int> & indexes) const
+    {
+        // Jump offsets count instructions in mCode, including OP_WIDE
+        // prefixes. Map each instruction to its unpacked index so that the
+        // jumps can be resolved. A prefix maps to the instruction it
+        // prefixes.
+        indexes.Fill(mCode.Count() + 1, 0);
+        int count = 0;
+        for (int i = 0; i < mCode.Count(); i++)
+        {
+            indexes[i] = count;
+            if (DECODE_OP(mCode[i]) != OP_WIDE) count++;
+        }
+        indexes[mCode.Count()] = count;
         
-        Instruction instruction = mCode[-1];
-        OpCode op = DECODE_OP(instruction);
-        int args = (instruction & 0x00ffffff);
+        int wideA = 0;
+        int wideB = 0;
+        int wideC = 0;
+        for (int i = 0; i < mCode.Count(); i++)
+        {
+            Instruction instruction = mCode[i];
+            
+            if (DECODE_OP(instruction) == OP_WIDE)
+            {
+                wideA = (wideA << 8) | DECODE_A(instruction);
+                wideB = (wideB << 8) | DECODE_B(instruction);
+                wideC = (wideC << 8) | DECODE_C(instruction);
+                continue;
+            }
+            
+            UnpackedInstruction unpacked;
+            unpacked.op = DECODE_OP(instruction);
+            unpacked.a = (wideA << 8) | DECODE_A(instruction);
+            unpacked.b = (wideB << 8) | DECODE_B(instruction);
+            unpacked.c = (wideC << 8) | DECODE_C(instruction);
+            unpacked.target = -1;
+            
+            wideA = 0;
+            wideB = 0;
+            wideC = 0;
+            
+            if (IsJumpOp(unpacked.op))
+            {
+                // Offsets are relative to the next instruction.
+                int offset = (unpacked.b << 8) | unpacked.c;
+                if (unpacked.op == OP_LOOP) offset = -offset;
+                
+                unpacked.target = indexes[i + 1 + offset];
+            }
+            
+            code.Add(unpacked);
+        }
+    }
+    
+    void Block::Pack(const Array<UnpackedInstruction> & code,
+                     Array<int> & starts)
+    {
+        // Figure out where each instruction will start, including its
+        // prefixes, so that jump offsets can be calculated. A jump always has
+        // a prefix for the high byte of its offset, so its size only depends
+        // on its A operand.
+        starts.Fill(code.Count() + 1, 0);
+        int start = 0;
+        for (int i = 0; i < code.Count(); i++)
+        {
+            starts[i] = start;
+            
+            int operands = code[i].b | code[i].c;
+            if (IsJumpOp(code[i].op)) operands = 0x100;
+            operands |= code[i].a;
+            
+            if (operands > 0xffff) start += 2;
+            else if (operands > 0xff) start++;
+            start++;
+        }
+        starts[code.Count()] = start;
         
+        mCode.Truncate(0);
+        for (int i = 0; i < code.Count(); i++)
+        {
+            const UnpackedInstruction & instruction = code[i];
+            if (IsJumpOp(instruction.op))
+            {
+                int offset = starts[instruction.target] - starts[i + 1];
+                if (instruction.op == OP_LOOP) offset = -offset;
+                
+                WriteJumpInstruction(instruction.op, instruction.a, offset);
+            }
+            else
+            {
+                Write(instruction.op, instruction.a, instruction.b,
+                      instruction.c);
+            }
+        }
+    }
+    
+    int Block::DestRegister(const UnpackedInstruction & instruction)
+    {
+        int * operand = DestOperand(
+            const_cast<UnpackedInstruction &>(instruction));
+        
+        return (operand != NULL) ? *operand : -1;
+    }
+    
+    int * Block::DestOperand(UnpackedInstruction & instruction)
+    {
+        if (IsMessageOp(instruction.op)) return &instruction.c;
+        
+        switch (instruction.op)
+        {
+            case OP_CONSTANT:
+            case OP_BLOCK:
+            case OP_ARRAY:
+            case OP_MOVE:
+            case OP_GET_UPVALUE:
+            case OP_GET_CAPTURED:
+            case OP_GET_FIELD:
+            case OP_GET_GLOBAL:
+                return &instruction.b;
+                
+            case OP_OBJECT:
+            case OP_SELF:
+                return &instruction.a;
+                
+            default:
+                return NULL;
+        }
+    }
+    
+    int Block::ReadOperands(UnpackedInstruction & instruction,
+                            int * operands[2])
+    {
+        if (IsMessageOp(instruction.op))
+        {
+            operands[0] = &instruction.b;
+            return 1;
+        }
+        
+        switch (instruction.op)
+        {
+            case OP_OBJECT:
+            case OP_MOVE:
+            case OP_JUMP_IF_FALSE:
+            case OP_END:
+            case OP_CAPTURE_LOCAL:
+            case OP_COPY_LOCAL:
+                operands[0] = &instruction.a;
+                return 1;
+                
+            case OP_ARRAY_ELEMENT:
+                operands[0] = &instruction.a;
+                operands[1] = &instruction.b;
+                return 2;
+                
+            case OP_SET_UPVALUE:
+            case OP_SET_FIELD:
+            case OP_SET_GLOBAL:
+            case OP_RETURN:
+                operands[0] = &instruction.b;
+                return 1;
+                
+            case OP_DEF_METHOD:
+            case OP_DEF_FIELD:
+                operands[0] = &instruction.b;
+                operands[1] = &instruction.c;
+                return 2;
+                
+            case OP_DEF_METHODS:
+                operands[0] = &instruction.c;
+                return 1;
+                
+            default:
+                return 0;
+        }
+    }
+    
+    int Block::NumMessageArgs(OpCode op)
+    {
         if ((op >= OP_MESSAGE_0) && (op <= OP_MESSAGE_10))
         {
-            int numArgs = op - OP_MESSAGE_0;
-            OpCode tailOp = static_cast<OpCode>(OP_TAIL_MESSAGE_0 + numArgs);
-            mCode[-1] = (tailOp << 24) | args;
+            return op - OP_MESSAGE_0;
+        }
+        
+        if ((op >= OP_TAIL_MESSAGE_0) && (op <= OP_TAIL_MESSAGE_10))
+        {
+            return op - OP_TAIL_MESSAGE_0;
         }
+        
+        // The operators are all binary.
+        if (IsMessageOp(op)) return 1;
+        
+        return -1;
+    }
+    
+    int Block::Successors(const Array<UnpackedInstruction> & code, int index,
+                          int successors[3])
+    {
+        const UnpackedInstruction & instruction = code[index];
+        int count = 0;
+        
+        switch (instruction.op)
+        {
+            case OP_END:
+            case OP_RETURN:
+                return 0;
+                
+            case OP_JUMP:
+            case OP_LOOP:
+                successors[0] = instruction.target;
+                return 1;
+                
+            case OP_JUMP_IF_FALSE:
+                // Can continue at the next instruction, skip it, or jump.
+                successors[count++] = instruction.target;
+                if (index + 2 < code.Count()) successors[count++] = index + 2;
+                break;
+                
+            case OP_JUMP_IF_REDEFINED:
+                successors[count++] = instruction.target;
+                break;
+                
+            default:
+                // A tail call doesn't come back to this frame.
+                if ((instruction.op >= OP_TAIL_MESSAGE_0) &&
+                    (instruction.op <= OP_TAIL_MESSAGE_10))
+                {
+                    return 0;
+                }
+        }
+        
+        if (index + 1 < code.Count()) successors[count++] = index + 1;
+        return count;
+    }
+    
+    bool Block::ReadsRegister(const UnpackedInstruction & instruction, int reg)
+    {
+        // The receiver and arguments are in consecutive registers.
+        int numArgs = NumMessageArgs(instruction.op);
+        if (numArgs != -1)
+        {
+            return (reg >= instruction.b) && (reg <= instruction.b + numArgs);
+        }
+        
+        int * operands[2];
+        int numOperands = ReadOperands(
+            const_cast<UnpackedInstruction &>(instruction), operands);
+        
+        for (int i = 0; i < numOperands; i++)
+        {
+            if (*operands[i] == reg) return true;
+        }
+        
+        return false;
+    }
+    
+    bool Block::ReplaceRead(UnpackedInstruction & instruction, int from,
+                            int to)
+    {
+        int * operand;
+        int * other = NULL;
+        switch (instruction.op)
+        {
+            case OP_END:
+                operand = &instruction.a;
+                break;
+                
+            case OP_SET_UPVALUE:
+            case OP_SET_FIELD:
+            case OP_SET_GLOBAL:
+            case OP_RETURN:
+                operand = &instruction.b;
+                break;
+                
+            case OP_ARRAY_ELEMENT:
+                operand = &instruction.a;
+                other = &instruction.b;
+                break;
+                
+            case OP_DEF_FIELD:
+                operand = &instruction.b;
+                other = &instruction.c;
+                break;
+                
+            default:
+                return false;
+        }
+        
+        if ((*operand != from) || ((other != NULL) && (*other == from)))
+        {
+            return false;
+        }
+        
+        *operand = to;
+        return true;
+    }
+    
+    bool Block::IsLive(const Array<UnpackedInstruction> & code,
+                       const Array<bool> & removed, int reg, int index,
+                       int * budget)
+    {
+        while (index < code.Count())
+        {
+            if ((*budget)-- <= 0) return true;
+            
+            if (removed[index])
+            {
+                index++;
+                continue;
+            }
+            
+            const UnpackedInstruction & instruction = code[index];
+            if (ReadsRegister(instruction, reg)) return true;
+            if (DestRegister(instruction) == reg) return false;
+            
+            switch (instruction.op)
+            {
+                case OP_END:
+                case OP_RETURN:
+                    return false;
+                    
+                case OP_JUMP:
+                    index = instruction.target;
+                    break;
+                    
+                case OP_JUMP_IF_REDEFINED:
+                    if (IsLive(code, removed, reg, instruction.target, budget))
+                    {
+                        return true;
+                    }
+                    index++;
+                    break;
+                    
+                case OP_JUMP_IF_FALSE:
+                    // Can continue at the next instruction, skip it, or jump.
+                    if (IsLive(code, removed, reg, instruction.target, budget) ||
+                        IsLive(code, removed, reg, index + 2, budget))
+                    {
+                        return true;
+                    }
+                    index++;
+                    break;
+                    
+                case OP_LOOP:
+                    // Don't bother following loops back.
+                    return true;
+                    
+                default:
+                    index++;
+            }
+        }
+        
+        return false;
+    }
+    
+    void Block::Compact(Array<UnpackedInstruction> & code,
+                        const Array<bool> & removed, Array<int> & newIndexes)
+    {
+        newIndexes.Fill(code.Count() + 1, 0);
+        int count = 0;
+        for (int i = 0; i < code.Count(); i++)
+        {
+            newIndexes[i] = count;
+            if (!removed[i]) count++;
+        }
+        newIndexes[code.Count()] = count;
+        
+        for (int i = 0; i < code.Count(); i++)
+        {
+            if (removed[i]) continue;
+            
+            UnpackedInstruction & instruction = code[newIndexes[i]];
+            instruction = code[i];
+            if (instruction.target != -1)
+            {
+                instruction.target = newIndexes[instruction.target];
+            }
+        }
+        
+        code.Truncate(count);
+    }
+    
+    static bool HasRegister(const Array<unsigned int> & sets, int set,
+                            int numWords, int reg)
+    {
+        return (sets[set * numWords + (reg >> 5)] & (1u << (reg & 31))) != 0;
+    }
+    
+    // Gets the index of the lowest bit that is set.
+    static int LowestBit(unsigned int bits)
+    {
+        static const int positions[32] =
+        {
+            0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
+            31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9
+        };
+        
+        return positions[((bits & (~bits + 1)) * 0x077cb531u) >> 27];
+    }
+    
+    // Finds the root of the set that a node belongs to in a union-find forest.
+    // Roots are negative.
+    static int FindSet(Array<int> & sets, int node)
+    {
+        int root = node;
+        while (sets[root] >= 0) root = sets[root];
+        
+        while (sets[node] >= 0)
+        {
+            int next = sets[node];
+            sets[node] = root;
+            node = next;
+        }
+        
+        return root;
+    }
+    
+    static void UnionSets(Array<int> & sets, int a, int b)
+    {
+        a = FindSet(sets, a);
+        b = FindSet(sets, b);
+        if (a != b) sets[a] = b;
+    }
+    
+    // Gets the web that the set containing the given node is, adding a new
+    // web for register `reg` if it doesn't have one yet.
+    static int FindWeb(Array<int> & sets, Array<RegisterWeb> & webs, int node,
+                       int reg)
+    {
+        int root = FindSet(sets, node);
+        if (sets[root] == -1)
+        {
+            RegisterWeb web = { reg, -1, 0, -1, webs.Count(), 0, -1, -1, 0,
+                                -1, -1, -1, -1, -1 };
+            sets[root] = -2 - webs.Count();
+            webs.Add(web);
+        }
+        
+        return -2 - sets[root];
+    }
+    
+    // Finds the root of the group that a web belongs to. Afterwards, the
+    // web's offset is relative to the root.
+    static int FindGroup(Array<RegisterWeb> & webs, int web)
+    {
+        int parent = webs[web].group;
+        if (parent == web) return web;
+        
+        int root = FindGroup(webs, parent);
+        webs[web].offset += webs[parent].offset;
+        webs[web].group = root;
+        return root;
+    }
+    
+    static void AddEdge(Array<WebEdge> & edges, int & list, int web)
+    {
+        WebEdge edge = { web, list };
+        list = edges.Count();
+        edges.Add(edge);
+    }
+    
+   
+    bool Block::AllocateRegisters(Array<UnpackedInstruction> & code,
+                                  OptimizeScratch & scratch)
+    {
+        int numInstructions = code.Count();
+        int numRegisters = mNumRegisters;
+        int numParams = mParams.Count();
+        
+        // Every block needs its parameters and somewhere to put its result.
+        if ((numRegisters <= numParams) || (numRegisters <= 1)) return false;
+        
+        // Find the registers each instruction reads and writes, and where
+        // execution can go after it.
+        Array<RegisterUse> & uses = scratch.uses;
+        uses.Truncate(0);
+        Array<int> & reads = scratch.reads;
+        reads.Truncate(0);
+        Array<bool> & captured = scratch.captured;
+        captured.Fill(numRegisters, false);
+        bool hasCaptures = false;
+        bool hasLoops = false;
+        
+        for (int i = 0; i < numInstructions; i++)
+        {
+            UnpackedInstruction & instruction = code[i];
+            RegisterUse use;
+            
+            int * operands[2];
+            int numOperands = ReadOperands(instruction, operands);
+            int numArgs = NumMessageArgs(instruction.op);
+            int numRead = (numArgs == -1) ? 1 : numArgs + 1;
+            
+            use.firstRead = reads.Count();
+            for (int j = 0; j < numOperands; j++)
+            {
+                for (int k = 0; k < numRead; k++) reads.Add(*operands[j] + k);
+            }
+            use.numReads = reads.Count() - use.firstRead;
+            
+            use.dest = DestRegister(instruction);
+            use.numSuccessors = Successors(code, i, use.successors);
+            uses.Add(use);
+            
+            for (int j = 0; j < use.numSuccessors; j++)
+            {
+                if (use.successors[j] <= i) hasLoops = true;
+            }
+            
+            if (instruction.op == OP_CAPTURE_LOCAL)
+            {
+                captured[instruction.a] = true;
+                hasCaptures = true;
+            }
+        }
+        
+        // Find the registers that may be read before they are overwritten
+        // at the start of each instruction. Loops jump backwards, so keep
+        // going until nothing changes. Without them, one pass backwards sees
+        // every instruction after its successors. Sets of registers are
+        // stored as bits, `numWords` per instruction.
+        int numWords = (numRegisters + 31) / 32;
+        Array<unsigned int> & liveIn = scratch.liveIn;
+        liveIn.Fill(numInstructions * numWords, 0);
+        Array<unsigned int> & live = scratch.live;
+        live.Fill(numWords, 0);
+        bool changed = true;
+        while (changed)
+        {
+            changed = false;
+            for (int i = numInstructions - 1; i >= 0; i--)
+            {
+                const RegisterUse & use = uses[i];
+                
+                for (int w = 0; w < numWords; w++) live[w] = 0;
+                
+                for (int j = 0; j < use.numSuccessors; j++)
+                {
+                    int successor = use.successors[j];
+                    for (int w = 0; w < numWords; w++)
+                    {
+                        live[w] |= liveIn[successor * numWords + w];
+                    }
+                }
+                
+                if (use.dest != -1)
+                {
+                    live[use.dest >> 5] &= ~(1u << (use.dest & 31));
+                }
+                
+                for (int j = 0; j < use.numReads; j++)
+                {
+                    int reg = reads[use.firstRead + j];
+                    live[reg >> 5] |= 1u << (reg & 31);
+                }
+                
+                for (int w = 0; w < numWords; w++)
+                {
+                    if (liveIn[i * numWords + w] != live[w])
+                    {
+                        liveIn[i * numWords + w] = live[w];
+                        changed = true;
+                    }
+                }
+            }
+            
+            if (!hasLoops) break;
+        }
+        
+        // Only the parameters have values when the block starts. If anything
+        // else is read before it's written, leave the block alone.
+        for (int reg = numParams; reg < numRegisters; reg++)
+        {
+            if (HasRegister(liveIn, 0, numWords, reg)) return false;
+        }
+        
+        // If the compiler already used no more registers than are live at
+        // once somewhere, there's nothing to gain.
+        int mostLive = numParams;
+        for (int i = 0; i < numInstructions; i++)
+        {
+            const RegisterUse & use = uses[i];
+            
+            for (int w = 0; w < numWords; w++) live[w] = 0;
+            
+            for (int j = 0; j < use.numSuccessors; j++)
+            {
+                int successor = use.successors[j];
+                for (int w = 0; w < numWords; w++)
+                {
+                    live[w] |= liveIn[successor * numWords + w];
+                }
+            }
+            
+            if (use.dest != -1) live[use.dest >> 5] |= 1u << (use.dest & 31);
+            
+            // Count the registers live before the instruction and the ones
+            // live after it, including its result.
+            int numBefore = 0;
+            int numAfter = 0;
+            for (int w = 0; w < numWords; w++)
+            {
+                unsigned int bits = liveIn[i * numWords + w];
+                for (; bits != 0; bits &= bits - 1) numBefore++;
+                
+                for (bits = live[w]; bits != 0; bits &= bits - 1) numAfter++;
+            }
+            
+            if (numBefore > mostLive) mostLive = numBefore;
+            if (numAfter > mostLive) mostLive = numAfter;
+        }
+        
+        if (mostLive >= numRegisters) return false;
+        
+        // Find the captured registers that may have an open upvalue at the
+        // start of each instruction.
+        Array<unsigned int> & openIn = scratch.openIn;
+        openIn.Truncate(0);
+        if (hasCaptures)
+        {
+            openIn.Fill(numInstructions * numWords, 0);
+            changed = true;
+            while (changed)
+            {
+                changed = false;
+                for (int i = 0; i < numInstructions; i++)
+                {
+                    for (int w = 0; w < numWords; w++)
+                    {
+                        live[w] = openIn[i * numWords + w];
+                    }
+                    
+                    if (code[i].op == OP_CAPTURE_LOCAL)
+                    {
+                        live[code[i].a >> 5] |= 1u << (code[i].a & 31);
+                    }
+                    else if (code[i].op == OP_CLOSE_UPVALUES)
+                    {
+                        for (int reg = code[i].a; reg < numRegisters; reg++)
+                        {
+                            live[reg >> 5] &= ~(1u << (reg & 31));
+                        }
+                    }
+                    
+                    for (int j = 0; j < uses[i].numSuccessors; j++)
+                    {
+                        int successor = uses[i].successors[j];
+                        for (int w = 0; w < numWords; w++)
+                        {
+                            unsigned int & open =
+                                openIn[successor * numWords + w];
+                            if ((open | live[w]) != open)
+                            {
+                                open |= live[w];
+                                changed = true;
+                            }
+                        }
+                    }
+                }
+                
+                if (!hasLoops) break;
+            }
+        }
+        
+        // Split the registers into webs by walking the code and tracking
+        // which write each register's value came from. Node i is the value
+        // instruction i writes and node numInstructions + i is the value
+        // parameter i starts with. Values are unioned where control flow
+        // merges.
+        //
+        // The walk keeps track of the values at each instruction that is
+        // jumped to. `reachable` is false when the previous instruction
+        // doesn't continue to the next one.
+        Array<int> & targets = scratch.targets;
+        targets.Fill(numInstructions, -1);
+        int numTargets = 0;
+        for (int i = 0; i < numInstructions; i++)
+        {
+            for (int j = 0; j < uses[i].numSuccessors; j++)
+            {
+                int successor = uses[i].successors[j];
+                if ((successor != i + 1) && (targets[successor] == -1))
+                {
+                    targets[successor] = numTargets++;
+                }
+            }
+        }
+        
+        Array<int> & states = scratch.states;
+        states.Fill(numTargets * numRegisters, -1);
+        Array<bool> & hasState = scratch.hasState;
+        hasState.Fill(numTargets, false);
+        Array<int> & current = scratch.current;
+        current.Fill(numRegisters, -1);
+        Array<int> & readNodes = scratch.readNodes;
+        readNodes.Fill(reads.Count(), -1);
+        Array<int> & orphans = scratch.orphans;
+        orphans.Truncate(0);
+        Array<int> & sets = scratch.sets;
+        sets.Fill(numInstructions + numParams + reads.Count(), -1);
+        Array<int> & interferences = scratch.interferences;
+        interferences.Truncate(0);
+        Array<int> & orderings = scratch.orderings;
+        orderings.Truncate(0);
+        Array<int> & floors = scratch.floors;
+        floors.Truncate(0);
+        
+        for (int reg = 0; reg < numParams; reg++)
+        {
+            current[reg] = numInstructions + reg;
+        }
+        
+        bool reachable = true;
+        for (int i = 0; i < numInstructions; i++)
+        {
+            const RegisterUse & use = uses[i];
+            
+            if (!reachable)
+            {
+                for (int reg = 0; reg < numRegisters; reg++) current[reg] = -1;
+            }
+            
+            int target = targets[i];
+            if (target != -1)
+            {
+                int * state = &states[target * numRegisters];
+                if (hasState[target])
+                {
+                    for (int reg = 0; reg < numRegisters; reg++)
+                    {
+                        if (state[reg] == -1) continue;
+                        
+                        if (current[reg] == -1) current[reg] = state[reg];
+                        else UnionSets(sets, current[reg], state[reg]);
+                    }
+                }
+                
+                for (int reg = 0; reg < numRegisters; reg++)
+                {
+                    state[reg] = current[reg];
+                }
+                
+                hasState[target] = true;
+            }
+            
+            // A read with no write before it can only be in code that is
+            // never run. Give it a value of its own.
+            for (int j = use.firstRead; j < use.firstRead + use.numReads; j++)
+            {
+                int reg = reads[j];
+                if (current[reg] == -1)
+                {
+                    current[reg] = numInstructions + numParams +
+                                   orphans.Count();
+                    orphans.Add(reg);
+                }
+                
+                readNodes[j] = current[reg];
+            }
+            
+            if (use.dest != -1)
+            {
+                // An operand that is both read and written names the same
+                // register for both.
+                if (code[i].op == OP_OBJECT)
+                {
+                    UnionSets(sets, i, readNodes[use.firstRead]);
+                }
+                
+                // A move's source doesn't interfere with its destination,
+                // since they hold the same value.
+                int source = -1;
+                if (code[i].op == OP_MOVE) source = readNodes[use.firstRead];
+                
+                int numArgs = NumMessageArgs(code[i].op);
+                int receiver = -1;
+                if (numArgs != -1) receiver = readNodes[use.firstRead];
+                
+                for (int w = 0; w < numWords; w++) live[w] = 0;
+                
+                for (int j = 0; j < use.numSuccessors; j++)
+                {
+                    int successor = use.successors[j];
+                    for (int w = 0; w < numWords; w++)
+                    {
+                        live[w] |= liveIn[successor * numWords + w];
+                    }
+                }
+                
+                for (int w = 0; w < numWords; w++)
+                {
+                    for (unsigned int bits = live[w]; bits != 0;
+                         bits &= bits - 1)
+                    {
+                        int reg = (w << 5) + LowestBit(bits);
+                        int node = current[reg];
+                        if ((reg == use.dest) || (node == -1)) continue;
+                        
+                        if (node != source)
+                        {
+                            interferences.Add(i);
+                            interferences.Add(node);
+                        }
+                        
+                        if ((receiver == -1) || (node == receiver)) continue;
+                        
+                        // The callee may have overwritten an argument.
+                        if ((reg > code[i].b) && (reg <= code[i].b + numArgs))
+                        {
+                            return false;
+                        }
+                        
+                        orderings.Add(node);
+                        orderings.Add(receiver);
+                    }
+                }
+                
+                if ((receiver != -1) && hasCaptures)
+                {
+                    for (int reg = numRegisters - 1; reg >= 0; reg--)
+                    {
+                        if (HasRegister(openIn, i, numWords, reg))
+                        {
+                            floors.Add(receiver);
+                            floors.Add(reg);
+                            break;
+                        }
+                    }
+                }
+                
+                current[use.dest] = i;
+            }
+            
+            // Carry the values over to the instructions this jumps to.
+            reachable = false;
+            for (int j = 0; j < use.numSuccessors; j++)
+            {
+                int successor = use.successors[j];
+                if (successor == i + 1)
+                {
+                    reachable = true;
+                    continue;
+                }
+                
+                int * state = &states[targets[successor] * numRegisters];
+                if ((successor > i) && !hasState[targets[successor]])
+                {
+                    for (int reg = 0; reg < numRegisters; reg++)
+                    {
+                        state[reg] = current[reg];
+                    }
+                    
+                    hasState[targets[successor]] = true;
+                    continue;
+                }
+                
+                for (int reg = 0; reg < numRegisters; reg++)
+                {
+                    if (current[reg] == -1) continue;
+                    
+                    if (state[reg] == -1) state[reg] = current[reg];
+                    else UnionSets(sets, state[reg], current[reg]);
+                }
+            }
+        }
+        
+        // Number the webs.
+        Array<RegisterWeb> & webs = scratch.webs;
+        webs.Truncate(0);
+        for (int i = 0; i < numInstructions; i++)
+        {
+            if (uses[i].dest != -1) FindWeb(sets, webs, i, uses[i].dest);
+        }
+        
+        for (int reg = 0; reg < numParams; reg++)
+        {
+            FindWeb(sets, webs, numInstructions + reg, reg);
+        }
+        
+        for (int i = 0; i < orphans.Count(); i++)
+        {
+            FindWeb(sets, webs, numInstructions + numParams + i, orphans[i]);
+        }
+        
+        int numWebs = webs.Count();
+        
+        // The parameters have to stay where the caller puts them. A local
+        // that's captured by a closure has to stay put too, since an upvalue
+        // may refer to it until it's closed. Nothing else can use its
+        // register.
+        for (int web = 0; web < numWebs; web++)
+        {
+            if (captured[webs[web].reg]) webs[web].pin = webs[web].reg;
+        }
+        
+        for (int reg = 0; reg < numParams; reg++)
+        {
+            webs[FindWeb(sets, webs, numInstructions + reg, reg)].pin = reg;
+        }
+        
+        // Two webs interfere if one is written while the other is live.
+        Array<WebEdge> & edges = scratch.edges;
+        edges.Truncate(0);
+        for (int i = 0; i < interferences.Count(); i += 2)
+        {
+            int a = FindWeb(sets, webs, interferences[i], -1);
+            int b = FindWeb(sets, webs, interferences[i + 1], -1);
+            if (a == b) continue;
+            
+            AddEdge(edges, webs[a].interferences, b);
+            AddEdge(edges, webs[b].interferences, a);
+        }
+        
+        // A message's receiver and arguments must be in consecutive
+        // registers, so the webs passed together are grouped. The callee's
+        // frame starts right after the receiver, so anything that is still
+        // needed after the message, including an open upvalue, must be in a
+        // register before the receiver.
+        for (int i = 0; i < numInstructions; i++)
+        {
+            int numArgs = NumMessageArgs(code[i].op);
+            if (numArgs == -1) continue;
+            
+            int first = uses[i].firstRead;
+            int receiver = FindWeb(sets, webs, readNodes[first], -1);
+            for (int arg = 1; arg <= numArgs; arg++)
+            {
+                int web = FindWeb(sets, webs, readNodes[first + arg], -1);
+                int receiverRoot = FindGroup(webs, receiver);
+                int root = FindGroup(webs, web);
+                int offset = arg + webs[receiver].offset - webs[web].offset;
+                
+                if (root != receiverRoot)
+                {
+                    webs[root].group = receiverRoot;
+                    webs[root].offset = offset;
+                }
+                else if (offset != 0)
+                {
+                    return false;
+                }
+            }
+        }
+        
+        for (int i = 0; i < orderings.Count(); i += 2)
+        {
+            int before = FindWeb(sets, webs, orderings[i], -1);
+            int after = FindWeb(sets, webs, orderings[i + 1], -1);
+            if (before == after) return false;
+            
+            AddEdge(edges, webs[after].befores, before);
+            AddEdge(edges, webs[before].afters, after);
+        }
+        
+        for (int i = 0; i < floors.Count(); i += 2)
+        {
+            RegisterWeb & receiver = webs[FindWeb(sets, webs, floors[i], -1)];
+            if (floors[i + 1] > receiver.floor) receiver.floor = floors[i + 1];
+        }
+        
+        // Collect the members of each group. Allocate the groups with pinned
+        // webs first, then the rest in the order the compiler allocated
+        // them, which puts the ones that must come first before the ones
+        // that must come after them.
+        for (int web = numWebs - 1; web >= 0; web--)
+        {
+            int root = FindGroup(webs, web);
+            RegisterWeb & member = webs[web];
+            
+            member.nextMember = webs[root].firstMember;
+            webs[root].firstMember = web;
+            
+            if (member.offset < webs[root].firstOffset)
+            {
+                webs[root].firstOffset = member.offset;
+            }
+            
+            if (member.pin != -1)
+            {
+                int base = member.pin - member.offset;
+                if ((webs[root].base != -1) && (webs[root].base != base))
+                {
+                    return false;
+                }
+                
+                webs[root].base = base;
+            }
+        }
+        
+        Array<int> & roots = scratch.roots;
+        roots.Truncate(0);
+        Array<int> & starts = scratch.starts;
+        starts.Fill(numRegisters, -1);
+        for (int web = numWebs - 1; web >= 0; web--)
+        {
+            RegisterWeb & root = webs[web];
+            if (root.group != web) continue;
+            
+            if (root.base != -1)
+            {
+                roots.Add(web);
+                continue;
+            }
+            
+            int reg = root.reg + root.firstOffset;
+            if (reg < 0) reg = 0;
+            if (reg >= numRegisters) reg = numRegisters - 1;
+            root.nextRoot = starts[reg];
+            starts[reg] = web;
+        }
+        
+        for (int reg = 0; reg < numRegisters; reg++)
+        {
+            for (int web = starts[reg]; web != -1; web = webs[web].nextRoot)
+            {
+                roots.Add(web);
+            }
+        }
+        
+        int limit = numRegisters + numWebs;
+        for (int i = 0; i < roots.Count(); i++)
+        {
+            int root = roots[i];
+            
+            // Find the range of bases that keep every member in order with
+            // the webs that have already been allocated.
+            int low = -webs[root].firstOffset;
+            int high = limit;
+            for (int web = webs[root].firstMember; web != -1;
+                 web = webs[web].nextMember)
+            {
+                int offset = webs[web].offset;
+                if (webs[web].floor - offset > low)
+                {
+                    low = webs[web].floor - offset;
+                }
+                
+                for (int edge = webs[web].befores; edge != -1;
+                     edge = edges[edge].next)
+                {
+                    const RegisterWeb & other = webs[edges[edge].web];
+                    if ((other.allocated != -1) &&
+                        (other.allocated + 1 - offset > low))
+                    {
+                        low = other.allocated + 1 - offset;
+                    }
+                    
+                    // The group's own members are always in the same order.
+                    if ((other.group == root) && (other.offset >= offset))
+                    {
+                        return false;
+                    }
+                }
+                
+                for (int edge = webs[web].afters; edge != -1;
+                     edge = edges[edge].next)
+                {
+                    const RegisterWeb & other = webs[edges[edge].web];
+                    if ((other.allocated != -1) &&
+                        (other.allocated - 1 - offset < high))
+                    {
+                        high = other.allocated - 1 - offset;
+                    }
+                }
+            }
+            
+            bool pinned = (webs[root].base != -1);
+            if (pinned)
+            {
+                if ((webs[root].base < low) || (webs[root].base > high))
+                {
+                    return false;
+                }
+                
+                low = webs[root].base;
+                high = webs[root].base;
+            }
+            
+            // Take the lowest base where no member lands on a register that
+            // an interfering web or a captured local has.
+            int base;
+            for (base = low; base <= high; base++)
+            {
+                bool fits = true;
+                for (int web = webs[root].firstMember;
+                     fits && (web != -1); web = webs[web].nextMember)
+                {
+                    int reg = base + webs[web].offset;
+                    if (!pinned && (reg < numRegisters) && captured[reg])
+                    {
+                        fits = false;
+                    }
+                    
+                    for (int edge = webs[web].interferences;
+                         fits && (edge != -1); edge = edges[edge].next)
+                    {
+                        const RegisterWeb & other = webs[edges[edge].web];
+                        int otherReg = other.allocated;
+                        
+                        // Members of the same group aren't allocated yet.
+                        if (other.group == root)
+                        {
+                            otherReg = base + other.offset;
+                        }
+                        
+                        if (otherReg == reg) fits = false;
+                    }
+                }
+                
+                if (fits) break;
+            }
+            
+            if (base > high) return false;
+            
+            for (int web = webs[root].firstMember; web != -1;
+                 web = webs[web].nextMember)
+            {
+                webs[web].allocated = base + webs[web].offset;
+            }
+        }
+        
+        // Don't bother if it isn't any better.
+        int newNumRegisters = numParams;
+        bool renamed = false;
+        for (int web = 0; web < numWebs; web++)
+        {
+            if (webs[web].allocated >= newNumRegisters)
+            {
+                newNumRegisters = webs[web].allocated + 1;
+            }
+            
+            if (webs[web].allocated != webs[web].reg) renamed = true;
+        }
+        
+        if (!renamed || (newNumRegisters > numRegisters)) return false;
+        
+        // Rewrite the operands, and remove the moves that now copy a register
+        // to itself.
+        Array<bool> & removed = scratch.removed;
+        removed.Fill(numInstructions, false);
+        bool removedAny = false;
+        for (int i = 0; i < numInstructions; i++)
+        {
+            UnpackedInstruction & instruction = code[i];
+            
+            int * operands[2];
+            int numOperands = ReadOperands(instruction, operands);
+            int newReads[2];
+            int numArgs = NumMessageArgs(instruction.op);
+            int numRead = (numArgs == -1) ? 1 : numArgs + 1;
+            for (int j = 0; j < numOperands; j++)
+            {
+                int node = readNodes[uses[i].firstRead + j * numRead];
+                newReads[j] = webs[FindWeb(sets, webs, node, -1)].allocated;
+            }
+            
+            for (int j = 0; j < numOperands; j++) *operands[j] = newReads[j];
+            
+            int * dest = DestOperand(instruction);
+            if (dest != NULL)
+            {
+                *dest = webs[FindWeb(sets, webs, i, -1)].allocated;
+            }
+            
+            if ((instruction.op == OP_MOVE) && (instruction.a == instruction.b))
+            {
+                removed[i] = true;
+                removedAny = true;
+            }
+        }
+        
+        if (removedAny) Compact(code, removed, scratch.indexes);
+        
+        mNumRegisters = newNumRegisters;
+        return true;
+    }
+    
+    bool Block::ReachesEnd(int index, int reg) const
+    {
+        int wideA = 0;
+        int wideB = 0;
+        while (index < mCode.Count())
+        {
+            Instruction instruction = mCode[index];
+            
+            switch (DECODE_OP(instruction))
+            {
+                case OP_JUMP:
+                {
+                    int b = (wideB << 8) | DECODE_B(instruction);
+                    index += 1 + ((b << 8) | DECODE_C(instruction));
+                    wideA = 0;
+                    wideB = 0;
+                    break;
+                }
+                    
+                // A tail call closes the frame's upvalues anyway.
+                case OP_CLOSE_UPVALUES:
+                    index++;
+                    break;
+                    
+                // Skip a prefix and look at the instruction it extends.
+                case OP_WIDE:
+                    wideA = (wideA << 8) | DECODE_A(instruction);
+                    wideB = (wideB << 8) | DECODE_B(instruction);
+                    index++;
+                    break;
+                    
+                case OP_END:
+                    return ((wideA << 8) | DECODE_A(instruction)) == reg;
+                    
+                default:
+                    return false;
+            }
+        }
+        
+        return false;
     }
 
 #ifdef DEBUG
-    void Block::DumpInstruction(Environment & environment, const String & prefix, Instruction instruction)
+    void Block::DumpInstruction(Interpreter & interpreter, const String & prefix,
+                                OpCode op, int a, int b, int c)
     {
         using namespace std;
         
         cout << prefix;
         
-        OpCode op = DECODE_OP(instruction);
-        int a = DECODE_A(instruction);
-        int b = DECODE_B(instruction);
-        int c = DECODE_C(instruction);
         switch (op)
         {
             case OP_CONSTANT:
@@ -105,7 +1700,32 @@ namespace Finch
             case OP_MESSAGE_8:
             case OP_MESSAGE_9:
             case OP_MESSAGE_10:
-                cout << "MESSAGE_" << (op - OP_MESSAGE_0) << "   '" << environment.Strings().Find(a) << "' " << b << " -> " << c;
+                cout << "MESSAGE_" << (op - OP_MESSAGE_0) << "   '" << interpreter.FindString(a) << "' " << b << " -> " << c;
+                break;
+            case OP_TAIL_MESSAGE_0:
+            case OP_TAIL_MESSAGE_1:
+            case OP_TAIL_MESSAGE_2:
+            case OP_TAIL_MESSAGE_3:
+            case OP_TAIL_MESSAGE_4:
+            case OP_TAIL_MESSAGE_5:
+            case OP_TAIL_MESSAGE_6:
+            case OP_TAIL_MESSAGE_7:
+            case OP_TAIL_MESSAGE_8:
+            case OP_TAIL_MESSAGE_9:
+            case OP_TAIL_MESSAGE_10:
+                cout << "TAIL_MESSAGE_" << (op - OP_TAIL_MESSAGE_0) << "   '" << interpreter.FindString(a) << "' " << b << " -> " << c;
+                break;
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+            case OP_EQUAL:
+            case OP_NOT_EQUAL:
+            case OP_LESS:
+            case OP_GREATER:
+            case OP_LESS_EQUAL:
+            case OP_GREATER_EQUAL:
+                cout << "OPERATOR     '" << interpreter.FindString(a) << "' " << b << " -> " << c;
                 break;
             case OP_GET_UPVALUE:
                 cout << "GET_UPVALUE  " << a << " -> " << b;
@@ -113,11 +1733,14 @@ namespace Finch
             case OP_SET_UPVALUE:
                 cout << "SET_UPVALUE  " << a << " -> " << b;
                 break;
+            case OP_GET_CAPTURED:
+                cout << "GET_CAPTURED " << a << " -> " << b;
+                break;
             case OP_GET_FIELD:
-                cout << "GET_FIELD    '" << environment.Strings().Find(a) << "' -> " << b;
+                cout << "GET_FIELD    '" << interpreter.FindString(a) << "' -> " << b;
                 break;
             case OP_SET_FIELD:
-                cout << "SET_FIELD    '" << environment.Strings().Find(a) << "' <- " << b;
+                cout << "SET_FIELD    '" << interpreter.FindString(a) << "' <- " << b;
                 break;
             case OP_GET_GLOBAL:
                 cout << "GET_GLOBAL   " << a << " -> " << b;
@@ -126,10 +1749,28 @@ namespace Finch
                 cout << "SET_GLOBAL   " << a << " <- " << b;
                 break;
             case OP_DEF_METHOD:
-                cout << "DEF_METHOD   '" << environment.Strings().Find(a) << "' " << b << " -> " << c;
+                cout << "DEF_METHOD   '" << interpreter.FindString(a) << "' " << b << " -> " << c;
                 break;
             case OP_DEF_FIELD:
-                cout << "DEF_FIELD    '" << environment.Strings().Find(a) << "' " << b << " -> " << c;
+                cout << "DEF_FIELD    '" << interpreter.FindString(a) << "' " << b << " -> " << c;
+                break;
+            case OP_DEF_METHODS:
+                cout << "DEF_METHODS  " << a << " -> " << c;
+                break;
+            case OP_JUMP:
+                cout << "JUMP         +" << ((b << 8) | c);
+                break;
+            case OP_LOOP:
+                cout << "LOOP         -" << ((b << 8) | c);
+                break;
+            case OP_JUMP_IF_REDEFINED:
+                cout << "JUMP_IF_REDEF +" << ((b << 8) | c);
+                break;
+            case OP_JUMP_IF_FALSE:
+                cout << "JUMP_IF_FALSE " << a << " +" << ((b << 8) | c);
+                break;
+            case OP_CLOSE_UPVALUES:
+                cout << "CLOSE_UPVALS " << a;
                 break;
             case OP_END:
                 cout << "END          " << a;
@@ -143,6 +1784,12 @@ namespace Finch
             case OP_CAPTURE_UPVALUE:
                 cout << "CAP_UPVALUE  " << a;
                 break;
+            case OP_COPY_LOCAL:
+                cout << "COPY_LOCAL   " << a;
+                break;
+            case OP_COPY_CAPTURED:
+                cout << "COPY_CAPTURED " << a;
+                break;
             default:
                 cout << "UNKNOWN OP " << op;
         }
@@ -151,15 +1798,33 @@ namespace Finch
         // Dump the child block too.
         if (op == OP_BLOCK)
         {
-            mBlocks[a]->DebugDump(environment, prefix + "  ");
+            mBlocks[a]->DebugDump(interpreter, prefix + "  ");
         }
     }
     
-    void Block::DebugDump(Environment & environment, const String & prefix)
+    void Block::DebugDump(Interpreter & interpreter, const String & prefix)
     {
+        int wideA = 0;
+        int wideB = 0;
+        int wideC = 0;
         for (int i = 0; i < mCode.Count(); i++)
         {
-            DumpInstruction(environment, prefix, mCode[i]);
+            Instruction instruction = mCode[i];
+            if (DECODE_OP(instruction) == OP_WIDE)
+            {
+                wideA = (wideA << 8) | DECODE_A(instruction);
+                wideB = (wideB << 8) | DECODE_B(instruction);
+                wideC = (wideC << 8) | DECODE_C(instruction);
+                continue;
+            }
+            
+            DumpInstruction(interpreter, prefix, DECODE_OP(instruction),
+                            (wideA << 8) | DECODE_A(instruction),
+                            (wideB << 8) | DECODE_B(instruction),
+                            (wideC << 8) | DECODE_C(instruction));
+            wideA = 0;
+            wideB = 0;
+            wideC = 0;
         }
     }
 #endif
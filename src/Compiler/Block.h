@@ -3,15 +3,19 @@
 #include <iostream>
 
 #include "Array.h"
+#include "Dictionary.h"
 #include "FinchString.h"
 #include "Macros.h"
+#include "MessageCache.h"
 #include "Object.h"
 #include "Ref.h"
 
+// The operands are decoded as ints so that they can be compared with
+// register and constant indexes.
 #define DECODE_OP(inst) (static_cast<OpCode>((inst & 0xff000000) >> 24))
-#define DECODE_A(inst)  ((inst & 0x00ff0000) >> 16)
-#define DECODE_B(inst)  ((inst & 0x0000ff00) >> 8)
-#define DECODE_C(inst)  (inst & 0x000000ff)
+#define DECODE_A(inst)  (static_cast<int>((inst & 0x00ff0000) >> 16))
+#define DECODE_B(inst)  (static_cast<int>((inst & 0x0000ff00) >> 8))
+#define DECODE_C(inst)  (static_cast<int>(inst & 0x000000ff))
 
 namespace Finch
 {
@@ -50,18 +54,47 @@ namespace Finch
         OP_TAIL_MESSAGE_8,
         OP_TAIL_MESSAGE_9,
         OP_TAIL_MESSAGE_10,
+        OP_ADD,           // Same operands as OP_MESSAGE_1. If the receiver
+        OP_SUBTRACT,      // and argument are both numbers and the core
+        OP_MULTIPLY,      // library's operators haven't been redefined,
+        OP_DIVIDE,        // calculates the result directly. Otherwise sends
+        OP_EQUAL,         // the message normally.
+        OP_NOT_EQUAL,
+        OP_LESS,
+        OP_GREATER,
+        OP_LESS_EQUAL,
+        OP_GREATER_EQUAL,
         OP_GET_UPVALUE,   // A = index of upvalue, B = dest reg
         OP_SET_UPVALUE,   // A = index of upvalue, B = value reg
+        OP_GET_CAPTURED,  // A = index of captured value, B = dest reg
         OP_GET_FIELD,     // A = index of field in string table, B = dest reg
         OP_SET_FIELD,     // A = index of field in string table, B = value reg
         OP_GET_GLOBAL,    // A = index of global, B = dest reg
         OP_SET_GLOBAL,    // A = index of global, B = value reg
         OP_DEF_METHOD,    // A = index of method name in string table,
-                          // B = index of method body block,
+                          // B = register with method body block,
                           // C = object method is being defined on
         OP_DEF_FIELD,     // A = index of field name in string table,
                           // B = register with field value,
                           // C = object field is being defined on
+        OP_DEF_METHODS,   // A = index of shared methods,
+                          // C = object methods are being defined on
+        OP_JUMP,          // B:C = number of instructions to skip forward
+                          // (B holds the offset shifted down by 8 bits,
+                          // so with its prefix it can be up to 24 bits)
+        OP_LOOP,          // B:C = number of instructions to jump backward
+        OP_JUMP_IF_REDEFINED, // B:C = number of instructions to skip
+                          // forward if the core library's control flow
+                          // messages have been redefined
+        OP_JUMP_IF_FALSE, // A = condition register, B:C = number of
+                          // instructions to skip forward if the condition
+                          // is false or nil. If the condition is true, also
+                          // skips the following instruction. If it's neither,
+                          // or the core library's control flow messages have
+                          // been redefined, continues at the following
+                          // instruction, which jumps to code that sends the
+                          // message normally.
+        OP_CLOSE_UPVALUES,// A = first register whose upvalues are closed
         OP_END,           // A = register with result to return
         OP_RETURN,        // A = method id to return from,
                           // B = register with value to return
@@ -70,20 +103,107 @@ namespace Finch
         // OP_BLOCK instruction. If we want to minimize the number of ops, we
         // could reuse existing opcodes for these.
         OP_CAPTURE_LOCAL,   // A = register of local
-        OP_CAPTURE_UPVALUE  // A = index of upvalue
+        OP_CAPTURE_UPVALUE, // A = index of upvalue
+        OP_COPY_LOCAL,      // A = register of local
+        OP_COPY_CAPTURED,   // A = index of captured value
+        
+        // Prefix for an instruction with an operand that doesn't fit in 8
+        // bits. A, B and C are the next higher 8 bits of the following
+        // instruction's A, B and C. Up to two can precede an instruction.
+        // These are folded into the operands when the block is decoded, so
+        // the interpreter never executes them.
+        OP_WIDE
     };
+    
+    // Returns true if the instruction sends a message or may fall back to
+    // sending one. These all have the same operands as OP_MESSAGE_n.
+    inline bool IsMessageOp(OpCode op)
+    {
+        return (op >= OP_MESSAGE_0) && (op <= OP_GREATER_EQUAL);
+    }
+    
+    // Returns true if the instruction's B:C operands are a jump offset.
+    inline bool IsJumpOp(OpCode op)
+    {
+        return (op >= OP_JUMP) && (op <= OP_JUMP_IF_FALSE);
+    }
+    
+    // An instruction whose operands have already been unpacked. Before a
+    // block is executed for the first time, its bytecode is translated into
+    // an array of these so that the interpreter loop doesn't have to decode
+    // each instruction every time it executes it. When the interpreter is
+    // built with computed gotos, `handler` is the address of the code in
+    // Fiber::Execute that executes the instruction, so dispatching is a single
+    // indirect jump. Message sends and field accesses also get an inline
+    // cache.
+    struct DecodedInstruction
+    {
+        const void *   handler;
+        OpCode         op;
+        int            a;
+        int            b;
+        int            c;
+        
+        union
+        {
+            MessageCache * cache;      // NULL if not a message send
+            FieldCache *   fieldCache; // NULL if not a field access
+        };
+    };
+    
+    // The methods defined by an object literal or bind expression when none
+    // of them close over any variables. Then each method only needs to be
+    // created once, so the table of them is built the first time the code
+    // runs and shared by every object it defines them on.
+    struct SharedMethods
+    {
+        Array<StringId>      names;
+        Array<int>           blocks; // indexes of the methods' blocks
+        Ref<MethodTable>     table;  // null until the code first runs
+    };
+    
+    // How large the frames of a tree of blocks are, both as the compiler
+    // reserved their registers and after Block::Optimize() allocated them.
+    struct FrameStats
+    {
+        FrameStats()
+        :   numBlocks(0),
+            reservedRegisters(0),
+            numRegisters(0),
+            largestReserved(0),
+            largest(0)
+        {}
         
+        int numBlocks;
+        int reservedRegisters;
+        int numRegisters;
+        int largestReserved;
+        int largest;
+    };
+    
+    class Heap;
+    struct OptimizeScratch;
+    
     // A compiled block. This contains the state that all blocks created from
     // evaluating the same chunk of code share: the compiled bytecode, constant
     // table etc. It does not contain the closure: that's owned by BlockObject.
-    class Block
+    class Block : public RefCounted
     {
     public:
         // Method ID for blocks that are not methods.
         static const int BLOCK_METHOD_ID = -1;
         
-        // Creates a new Block with the given parameters.
-        Block(int methodId, const Array<String> & params);
+        // Operands must be less than this. Ones past 8 bits are written using
+        // OP_WIDE prefixes.
+        static const int MAX_OPERAND = 1 << 24;
+        
+        // Jump offsets must be less than this.
+        static const int MAX_JUMP = 1 << 24;
+        
+        // Creates a new Block with the given parameters. `epochs` are those of
+        // the interpreter the block runs in.
+        Block(int methodId, const Array<String> & params,
+              const CacheEpochs & epochs);
         
         int MethodId() const { return mMethodId; }
         
@@ -93,10 +213,29 @@ namespace Finch
         int  NumRegisters() const { return mNumRegisters; }
         void SetNumRegisters(int numRegisters) { mNumRegisters = numRegisters; }
         
+        // Gets the number of registers the compiler reserved for this block,
+        // before Optimize() allocated them.
+        int  NumReservedRegisters() const { return mNumReservedRegisters; }
+        
+        // Adds the sizes of this block's frame and those of all of the
+        // blocks it contains to the given stats.
+        void AddFrameStats(FrameStats & stats) const;
+        
+        // Gets the number of capture pseudo-ops that follow the OP_BLOCK
+        // instruction that creates this block.
         int  NumUpvalues() const { return mNumUpvalues; }
         void SetNumUpvalues(int numUpvalues) { mNumUpvalues = numUpvalues; }
         
+        // Gets how many of those copy a variable's value into the block
+        // object instead of sharing it through an Upvalue.
+        int  NumCapturedValues() const { return mNumCapturedValues; }
+        void SetNumCapturedValues(int numCapturedValues)
+        {
+            mNumCapturedValues = numCapturedValues;
+        }
+        
         // Adds the given object to the constant pool and returns its index.
+        // If the pool already has the same value, returns its index instead.
         int AddConstant(const Value & object);
         
         // Gets the constant at the given index in the constant pool.
@@ -108,29 +247,196 @@ namespace Finch
         // Gets the child block at the given index in the pool.
         const Ref<Block> GetBlock(int index) const { return mBlocks[index]; }
         
+        // Adds the given set of shared methods and returns its index.
+        int AddSharedMethods(const SharedMethods & methods);
+        
+        SharedMethods & GetSharedMethods(int index)
+        {
+            return mSharedMethods[index];
+        }
+        
+        // Marks the objects this block and the blocks it contains refer to,
+        // such as constants and cached methods, so that the garbage
+        // collector doesn't free them.
+        void MarkReferences(Heap & heap);
+        
         // Gets the bytecode for this block.
         const Array<Instruction> & Code() const { return mCode; }
         
-        // Writes an instruction.
+        // Removes the instructions from the given index on, so that the
+        // compiler can replace code it can't use.
+        void RemoveCode(int start) { mCode.Truncate(start); }
+        
+        // Translates the bytecode into DecodedInstructions if that hasn't
+        // been done yet and returns them. `handlers` is indexed by OpCode and
+        // gives the handler address for each instruction. It may be NULL if
+        // the interpreter dispatches using a switch.
+        const DecodedInstruction * Decode(const void * const * handlers);
+        
+        // Writes an instruction, preceded by OP_WIDE prefixes if any of its
+        // operands don't fit in 8 bits.
         void Write(OpCode op, int a = 0xff, int b = 0xff, int c = 0xff);
         
-        // If the last instruction is a MESSAGE, translates it to a tail call.
-        void MarkTailCall();
+        // Writes a forward jump whose offset will be filled in by a later call
+        // to PatchJump(). Returns the index of the jump instruction. The jump
+        // is preceded by an OP_WIDE prefix that holds the high byte of its
+        // offset.
+        int WriteJump(OpCode op, int a = 0xff);
+        
+        // Makes the jump at the given index jump to the next instruction that
+        // will be written. Returns false and leaves the jump alone if that's
+        // too far away.
+        bool PatchJump(int jump);
+        
+        // Writes an OP_LOOP that jumps back to the instruction at the given
+        // index. Returns false and writes nothing if that's too far away.
+        bool WriteLoop(int target);
+        
+        // Removes instructions whose results are never used, and moves that
+        // can be avoided by having the previous instruction write directly to
+        // the move's destination. Then allocates the registers so that values
+        // that are never needed at the same time share one. Must be called
+        // after the final OP_END is written. Uses `scratch` as working storage.
+        void Optimize(OptimizeScratch & scratch);
+        
+        // Translates each MESSAGE that is followed by the end of the block
+        // returning its result to a tail call. Must be called after the final
+        // OP_END is written.
+        void MarkTailCalls();
         
 #ifdef DEBUG
-        void DumpInstruction(Environment & environment, const String & prefix, Instruction instruction);
-        void DebugDump(Environment & environment, const String & prefix);
+        void DumpInstruction(Interpreter & interpreter, const String & prefix,
+                             OpCode op, int a, int b, int c);
+        void DebugDump(Interpreter & interpreter, const String & prefix);
 #endif
         
     private:
+        friend struct OptimizeScratch;
+        
+        // An instruction with its OP_WIDE prefixes folded into its operands.
+        // Jumps refer to the index of the instruction they jump to instead
+        // of using an offset.
+        struct UnpackedInstruction
+        {
+            OpCode op;
+            int    a;
+            int    b;
+            int    c;
+            int    target; // -1 if not a jump
+        };
+        
+        // Writes a single instruction. Operands must fit in 8 bits.
+        void WriteInstruction(OpCode op, int a, int b, int c);
+        
+        // Writes a jump with the given offset and its OP_WIDE prefixes.
+        void WriteJumpInstruction(OpCode op, int a, int offset);
+        
+        // Gets the instructions in mCode. `indexes` is working storage.
+        void Unpack(Array<UnpackedInstruction> & code,
+                    Array<int> & indexes) const;
+        
+        // Replaces mCode with the given instructions. `starts` is working
+        // storage.
+        void Pack(const Array<UnpackedInstruction> & code, Array<int> & starts);
+        
+        // Gets the register the instruction stores its result in, or -1 if it
+        // doesn't have one.
+        static int DestRegister(const UnpackedInstruction & instruction);
+        
+        // Gets the operand that names the register the instruction stores its
+        // result in, or NULL if it doesn't have one.
+        static int * DestOperand(UnpackedInstruction & instruction);
+        
+        // Gets the operands that name registers the instruction reads and
+        // returns how many there are. A message reads its receiver and
+        // arguments from consecutive registers, so only its B operand is
+        // returned.
+        static int ReadOperands(UnpackedInstruction & instruction,
+                                int * operands[2]);
+        
+        // Gets the number of arguments a message instruction passes, or -1
+        // if the instruction isn't a message.
+        static int NumMessageArgs(OpCode op);
+        
+        // Gets the instructions that execution may continue at after the
+        // given one and returns how many there are.
+        static int Successors(const Array<UnpackedInstruction> & code,
+                              int index, int successors[3]);
+        
+        // Returns true if the instruction reads the given register.
+        static bool ReadsRegister(const UnpackedInstruction & instruction,
+                                  int reg);
+        
+        // If the instruction reads the register `from` and can read `to`
+        // instead without changing its meaning, changes it to and returns
+        // true.
+        static bool ReplaceRead(UnpackedInstruction & instruction, int from,
+                                int to);
+        
+        // Returns true if the value in the given register may be read before
+        // it is overwritten when execution continues at `index`. Instructions
+        // marked in `removed` are skipped. Gives up and returns true after
+        // looking at `budget` instructions.
+        static bool IsLive(const Array<UnpackedInstruction> & code,
+                           const Array<bool> & removed, int reg, int index,
+                           int * budget);
+        
+        // The most instructions IsLive() will look at.
+        static const int MAX_LIVENESS_SEARCH = 100;
+        
+        // Removes the instructions marked in `removed`. Jumps to a removed
+        // instruction go to the one after it instead. `newIndexes` is working
+        // storage.
+        static void Compact(Array<UnpackedInstruction> & code,
+                            const Array<bool> & removed,
+                            Array<int> & newIndexes);
+        
+        // Renumbers the registers so that values that are never live at the
+        // same time can share one, and shrinks the frame to fit. Returns
+        // false and leaves the code alone if it can't do any better than the
+        // compiler did.
+        bool AllocateRegisters(Array<UnpackedInstruction> & code,
+                               OptimizeScratch & scratch);
+        
+        // Returns true if execution continuing at the given instruction only
+        // jumps to the end of the block, which returns the given register.
+        bool ReachesEnd(int index, int reg) const;
+        
+        // Gets the bucket in mConstantBuckets where the given value is, or the
+        // empty one where it should be added.
+        int FindConstantBucket(const Value & value) const;
+        
+        // What percentage of the constant buckets can be in use before
+        // rehashing.
+        static const int MAX_CONSTANT_LOAD_PERCENT = 75;
+        
+        // The number of constant buckets when the first constant is added.
+        // Must be a power of two.
+        static const int MIN_CONSTANT_BUCKETS = 16;
+        
         int                 mMethodId;
         Array<String>       mParams;
+        // The epochs of the interpreter's caches. The message caches' entries
+        // are only marked if they're from the current epoch.
+        const CacheEpochs * mEpochs;
         Array<Instruction>  mCode;
+        Array<DecodedInstruction> mDecoded;
+        Array<MessageCache> mMessageCaches;
+        Array<FieldCache>   mFieldCaches;
         Array<Value>        mConstants;
+        // Open-addressed hashtable of indexes in mConstants, so that
+        // AddConstant() can find duplicates. Empty buckets are -1. The size is
+        // always a power of two.
+        Array<int>          mConstantBuckets;
         // Blocks contained within this one.
         Array<Ref<Block> >  mBlocks;
+        Array<SharedMethods> mSharedMethods;
         int                 mNumRegisters;
+        int                 mNumReservedRegisters;
         int                 mNumUpvalues;
+        int                 mNumCapturedValues;
+        // The collection this was last marked in, or -1 if never.
+        int                 mMarkedCollection;
     };
 }
 
@@ -9,6 +9,7 @@
 #include "NameExpr.h"
 #include "NumberExpr.h"
 #include "ObjectExpr.h"
+#include "OptimizeScratch.h"
 #include "ReturnExpr.h"
 #include "SelfExpr.h"
 #include "SequenceExpr.h"
@@ -24,31 +25,44 @@ namespace Finch
     Ref<Block> Compiler::CompileTopLevel(Interpreter & interpreter, const Expr & expr)
     {
         Array<String> params;
-        Compiler compiler(interpreter, NULL);
+        OptimizeScratch scratch;
+        Compiler compiler(interpreter, NULL, scratch);
         compiler.Compile(Block::BLOCK_METHOD_ID, params, expr);
         
         /*
         // TODO(bob): Testing!
-        compiler.mBlock->DebugDump(environment, "");
+        compiler.mBlock->DebugDump(interpreter, "");
         */
         
         return compiler.mBlock;
     }
         
-    Compiler::Compiler(Interpreter & interpreter, Compiler * parent)
+    Compiler::Compiler(Interpreter & interpreter, Compiler * parent,
+                       OptimizeScratch & scratch)
     :   mInterpreter(interpreter),
         mParent(parent),
+        mScratch(scratch),
         mBlock(),
         mInUseRegisters(0),
         mLocals(),
+        mScopeStart(0),
+        mHighestCapturedLocal(-1),
+        mInlineBlocks((parent == NULL) || parent->mInlineBlocks),
+        mFoldConstants(true),
+        mJumpTooFar(false),
         mObjectLiterals(),
-        mHasReturn(false)
+        mHasReturn(false),
+        mUsesSelf(false)
     {}
 
     void Compiler::Compile(int methodId, const Array<String> & params,
                            const Expr & expr)
     {
-        mBlock = Ref<Block>(new Block(methodId, params));
+        mBlock = Ref<Block>(new Block(methodId, params,
+                                      mInterpreter.GetCacheEpochs()));
+        
+        AssignmentFinder finder(mDefinedNames, mAssignedNames);
+        finder.Find(params, expr);
         
         // Reserve registers for the params. These have to go first because the
         // caller will place them here.
@@ -72,26 +86,27 @@ namespace Finch
         
         expr.Accept(*this, resultRegister);
         
-        // TODO(bob): Not enabled yet because the VM doesn't support it.
-        // Need to figure out how it's going to work with the register window
-        // stuff for passing arguments.
-        /*
-        if (!mHasReturn) mBlock->MarkTailCall();
-        */
-        
         mBlock->Write(OP_END, resultRegister);
+        mBlock->Optimize(mScratch);
+        
+        if (!mHasReturn) mBlock->MarkTailCalls();
         
         // Now that all upvalues for this block are known (and its contained
         // blocks have also been compiled, which due to closure flattening may
         // upvalues to this block), we can store the number of upvalues.
         mBlock->SetNumUpvalues(mUpvalues.Count());
+        
+        int numCopies = 0;
+        for (int i = 0; i < mUpvalues.Count(); i++)
+        {
+            if (mUpvalues[i].IsCopy()) numCopies++;
+        }
+        mBlock->SetNumCapturedValues(numCopies);
     }
     
     void Compiler::Visit(const ArrayExpr & expr, int dest)
     {
         // Create the empty array.
-        // TODO(bob): Only allows arrays up to 255 elements. Should use two
-        // registers for size.
         mBlock->Write(OP_ARRAY, expr.Elements().Count(), dest);
         
         // Write the instructions to add each item.
@@ -123,6 +138,31 @@ namespace Finch
     
     void Compiler::Visit(const MessageExpr & expr, int dest)
     {
+        // Inlined and folded messages jump over code whose size isn't known
+        // until it's been compiled. If it's too big to jump over, throw it
+        // away and send the message normally.
+        int start = mBlock->Code().Count();
+        bool jumpTooFar = mJumpTooFar;
+        mJumpTooFar = false;
+        
+        bool compiled = CompileInlineMessage(expr, dest);
+        
+        Folded folded;
+        if (!compiled && mFoldConstants && FoldConstant(expr, folded))
+        {
+            CompileFolded(expr, folded, dest);
+            compiled = true;
+        }
+        
+        if (mJumpTooFar)
+        {
+            mBlock->RemoveCode(start);
+            compiled = false;
+        }
+        
+        mJumpTooFar = jumpTooFar;
+        if (compiled) return;
+        
         // Load the receiver.
         int receiverReg = ReserveRegister();
         expr.Receiver()->Accept(*this, receiverReg);
@@ -140,11 +180,9 @@ namespace Finch
             }
             
             // Compile the message send.
-            // TODO(bob): Right now, we're only giving 8-bits to the name, which
-            // will run out quickly.
             StringId messageId = mInterpreter.AddString(message.GetName());
-            OpCode op = static_cast<OpCode>(OP_MESSAGE_0 +
-                message.GetArguments().Count());
+            OpCode op = GetMessageOp(message.GetName(),
+                                     message.GetArguments().Count());
             
             mBlock->Write(op, messageId, receiverReg, dest);
             
@@ -161,7 +199,7 @@ namespace Finch
     
     void Compiler::Visit(const NameExpr & expr, int dest)
     {
-        if (mParent == NULL)
+        if (IsTopLevel())
         {
             // Accessing a top-level name, so it's a global.
             int index = mInterpreter.DefineGlobal(expr.Name());
@@ -172,6 +210,7 @@ namespace Finch
             // Accessing a field.
             StringId index = mInterpreter.AddString(expr.Name());
             mBlock->Write(OP_GET_FIELD, index, dest);
+            mUsesSelf = true;
         }
         else
         {
@@ -187,6 +226,11 @@ namespace Finch
                 // Copy the local to the destination register.
                 mBlock->Write(OP_MOVE, index, dest);
             }
+            else if (resolvedUpvalue.IsCopy())
+            {
+                // Load the block's copy of the variable.
+                mBlock->Write(OP_GET_CAPTURED, resolvedUpvalue.Slot(), dest);
+            }
             else if (resolvedUpvalue.IsValid())
             {
                 // Load the upvalue into the destination register.
@@ -254,6 +298,7 @@ namespace Finch
         {
             // Do a normal dynamic lookup on `self`.
             mBlock->Write(OP_SELF, dest);
+            mUsesSelf = true;
         }
     }
     
@@ -262,15 +307,15 @@ namespace Finch
         // Compile each expression.
         for (int i = 0; i < expr.Expressions().Count(); i++)
         {
-            // TODO(bob): Use DISCARD_REGISTER for all but last expr and make
-            // compiler use that to avoid some unnecessary work.
+            // Each one overwrites the previous one's result. Block::Optimize()
+            // removes the loads and moves that are only done for that.
             expr.Expressions()[i]->Accept(*this, dest);
         }
     }
     
     void Compiler::Visit(const SetExpr & expr, int dest)
     {
-        if (mParent == NULL)
+        if (IsTopLevel())
         {
             // Globals behave the same with <- and <--.
             CompileSetGlobal(expr.Name(), *expr.Value(), dest);
@@ -296,6 +341,9 @@ namespace Finch
             }
             else if (resolvedUpvalue.IsValid())
             {
+                ASSERT(!resolvedUpvalue.IsCopy(),
+                       "An assigned variable should not be copied.");
+                
                 // Evaluate the value.
                 expr.Value()->Accept(*this, dest);
                 
@@ -322,8 +370,7 @@ namespace Finch
     
     void Compiler::Visit(const StringExpr & expr, int dest)
     {
-        Value string = mInterpreter.NewString(expr.GetValue());
-        CompileConstant(string, dest);
+        CompileConstant(LiteralString(expr.GetValue()), dest);
     }
     
     void Compiler::Visit(const UndefineExpr & expr, int dest)
@@ -332,7 +379,7 @@ namespace Finch
         // implementation doesn't totally work (for one thing, it doesn't
         // assign anything to dest, and it isn't clear what it *should* assign),
         // but it gets the test to pass.
-        int local = mLocals.IndexOf(expr.Name());
+        int local = FindLocal(expr.Name(), 0);
         if (local != -1)
         {
             mLocals[local] = "";
@@ -341,7 +388,7 @@ namespace Finch
     
     void Compiler::Visit(const VarExpr & expr, int dest)
     {
-        if (mParent == NULL)
+        if (IsTopLevel())
         {
             // We're at the top level, so it's a global.
             CompileSetGlobal(expr.Name(), *expr.Value(), dest);
@@ -353,7 +400,7 @@ namespace Finch
         else
         {
             // Doing <- on an existing name just assigns.
-            int local = mLocals.IndexOf(expr.Name());
+            int local = FindLocal(expr.Name(), mScopeStart);
             if (local == -1) {
                 // Create a new local.
                 local = ReserveRegister();
@@ -366,7 +413,9 @@ namespace Finch
             }
             
             // Evaluate the value and store in the local.
+            mDefiningLocals.Add(local);
             expr.Value()->Accept(*this, local);
+            mDefiningLocals.Truncate(mDefiningLocals.Count() - 1);
             
             // Also copy to the destination register.
             // Handles cases like: foo: bar <- baz
@@ -392,7 +441,7 @@ namespace Finch
         }
         
         // See if the name is defined here.
-        int local = compiler->mLocals.IndexOf(name);
+        int local = compiler->FindLocal(name, 0);
         if (local != -1)
         {
             if (compiler == this)
@@ -402,7 +451,7 @@ namespace Finch
                 *outIndex = local;
             }
             
-            *outUpvalue = Upvalue(true, local);
+            *outUpvalue = Upvalue(true, local, compiler->CanCopyLocal(local));
             return;
         }
         
@@ -423,8 +472,7 @@ namespace Finch
         // to a variable defined outside of our immediately enclosing block,
         // each intervening block will copy that variable into its upvalues so
         // we can walk it down to the block that uses it.
-        upvalue.SetSlot(compiler->mUpvalues.Count());
-        compiler->mUpvalues.Add(upvalue);
+        upvalue.SetSlot(compiler->FindUpvalueSlot(upvalue));
         
         if (compiler == this)
         {
@@ -433,7 +481,7 @@ namespace Finch
             *outResolvedUpvalue = upvalue;
         }
         
-        *outUpvalue = Upvalue(false, upvalue.Slot());
+        *outUpvalue = Upvalue(false, upvalue.Slot(), upvalue.IsCopy());
     }
     
     void Compiler::CompileSetGlobal(const String & name, const Expr & value, int dest)
@@ -452,25 +500,59 @@ namespace Finch
         
         StringId nameId = mInterpreter.AddString(name);
         mBlock->Write(OP_SET_FIELD, nameId, dest);
+        mUsesSelf = true;
     }
 
     void Compiler::CompileNestedBlock(int methodId, const BlockExpr & block, int dest)
     {
-        Compiler compiler(mInterpreter, this);
+        Compiler compiler(mInterpreter, this, mScratch);
         compiler.Compile(methodId, block.Params(), *block.Body());
         
+        // A block that doesn't capture any variables or use `self` is the
+        // same every time it's evaluated, so create its object once and load
+        // that as a constant. Blocks passed to methods like map: often need
+        // nothing else.
+        if ((compiler.mUpvalues.Count() == 0) && !compiler.mUsesSelf)
+        {
+            // It's still listed with the contained blocks, which is what
+            // AddFrameStats() walks.
+            mBlock->AddBlock(compiler.mBlock);
+            CompileConstant(mInterpreter.NewBlock(compiler.mBlock,
+                                                  mInterpreter.Nil()), dest);
+            return;
+        }
+        
+        WriteBlock(compiler, dest);
+    }
+    
+    void Compiler::WriteBlock(const Compiler & compiler, int dest)
+    {
         int index = mBlock->AddBlock(compiler.mBlock);
         
         mBlock->Write(OP_BLOCK, index, dest);
+        
+        // The block is created with this one's `self`.
+        if (compiler.mUsesSelf) mUsesSelf = true;
 
         // Capture the upvalues.
         for (int i = 0; i < compiler.mUpvalues.Count(); i++)
         {
-            Upvalue & upvalue = compiler.mUpvalues[i];
-            if (upvalue.IsLocal())
+            const Upvalue & upvalue = compiler.mUpvalues[i];
+            if (upvalue.IsCopy())
+            {
+                // Copying a variable that won't change.
+                OpCode op = upvalue.IsLocal() ? OP_COPY_LOCAL : OP_COPY_CAPTURED;
+                mBlock->Write(op, upvalue.Index());
+            }
+            else if (upvalue.IsLocal())
             {
                 // Closing over a local.
                 mBlock->Write(OP_CAPTURE_LOCAL, upvalue.Index());
+                
+                if (upvalue.Index() > mHighestCapturedLocal)
+                {
+                    mHighestCapturedLocal = upvalue.Index();
+                }
             }
             else
             {
@@ -482,17 +564,177 @@ namespace Finch
     
     void Compiler::CompileConstant(const Value & constant, int dest)
     {
-        // TODO(bob): Should check for duplicates. Only need one copy of any
-        // given constant.
         int index = mBlock->AddConstant(constant);
         mBlock->Write(OP_CONSTANT, index, dest);
     }
     
+    Value Compiler::LiteralString(const String & value)
+    {
+        if (mParent != NULL) return mParent->LiteralString(value);
+        
+        // The table marks its empty slots with empty keys, so empty strings
+        // aren't shared.
+        if (value.Length() == 0) return mInterpreter.NewString(value);
+        
+        Value string;
+        if (!mStrings.Find(value, &string))
+        {
+            string = mInterpreter.NewString(value);
+            mStrings.Insert(value, string);
+        }
+        
+        return string;
+    }
+    
+    bool Compiler::FoldConstant(const Expr & expr, Folded & result)
+    {
+        const NumberExpr * number = expr.AsNumber();
+        if (number != NULL)
+        {
+            result.value = Value(number->GetValue());
+            return true;
+        }
+        
+        const StringExpr * string = expr.AsString();
+        if (string != NULL)
+        {
+            result.value = Value();
+            result.string = string->GetValue();
+            return true;
+        }
+        
+        const MessageExpr * message = expr.AsMessage();
+        if ((message == NULL) || (message->Messages().Count() != 1)) return false;
+        
+        const MessageSend & send = message->Messages()[0];
+        const Array<Ref<Expr> > & args = send.GetArguments();
+        if (args.Count() > 1) return false;
+        
+        Folded receiver;
+        if (!FoldConstant(*message->Receiver(), receiver)) return false;
+        
+        if (args.Count() == 0)
+        {
+            if (!receiver.value.IsNumber() || (send.GetName() != "neg"))
+            {
+                return false;
+            }
+            
+            result.value = Value(-receiver.value.AsNumber());
+            return true;
+        }
+        
+        Folded arg;
+        if (!FoldConstant(*args[0], arg)) return false;
+        
+        if (receiver.IsString() && arg.IsString())
+        {
+            if (send.GetName() != "+") return false;
+            
+            result.value = Value();
+            result.string = receiver.string + arg.string;
+            return true;
+        }
+        
+        if (!receiver.value.IsNumber() || !arg.value.IsNumber()) return false;
+        
+        // This must calculate the same results as the specialized operator
+        // instructions.
+        double left = receiver.value.AsNumber();
+        double right = arg.value.AsNumber();
+        bool condition;
+        switch (GetMessageOp(send.GetName(), 1))
+        {
+            case OP_ADD:      result.value = Value(left + right); return true;
+            case OP_SUBTRACT: result.value = Value(left - right); return true;
+            case OP_MULTIPLY: result.value = Value(left * right); return true;
+            case OP_DIVIDE:
+                // Dividing by zero is nil. Leave that for runtime.
+                if (right == 0) return false;
+                result.value = Value(left / right);
+                return true;
+                
+            case OP_EQUAL:         condition = left == right; break;
+            case OP_NOT_EQUAL:     condition = left != right; break;
+            case OP_LESS:          condition = left < right;  break;
+            case OP_GREATER:       condition = left > right;  break;
+            case OP_LESS_EQUAL:    condition = left <= right; break;
+            case OP_GREATER_EQUAL: condition = left >= right; break;
+            default:               return false;
+        }
+        
+        result.value = condition ? mInterpreter.True() : mInterpreter.False();
+        return true;
+    }
+    
+    void Compiler::CompileFolded(const MessageExpr & expr, const Folded & value,
+                                 int dest)
+    {
+        int fallbackJump = mBlock->WriteJump(OP_JUMP_IF_REDEFINED);
+        
+        // Literal strings are shared, so share the folded ones too.
+        if (value.IsString())
+        {
+            CompileConstant(LiteralString(value.string), dest);
+        }
+        else
+        {
+            CompileConstant(value.value, dest);
+        }
+        
+        int endJump = mBlock->WriteJump(OP_JUMP);
+        
+        PatchJump(fallbackJump);
+        bool foldConstants = mFoldConstants;
+        mFoldConstants = false;
+        Visit(expr, dest);
+        mFoldConstants = foldConstants;
+        
+        PatchJump(endJump);
+    }
+    
     void Compiler::CompileDefinitions(const DefineExpr & expr, int dest)
     {
-        // Compile each of the definitions.
+        // Compile the methods first to see if any of them close over
+        // variables. If none do, they can be shared.
+        Array<Compiler *> methods;
+        bool isShared = true;
+        
         int count = expr.Definitions().Count();
         for (int i = 0; i < count; i++)
+        {
+            const Definition & definition = expr.Definitions()[i];
+            if (!definition.IsMethod()) continue;
+            
+            BlockExpr & body = static_cast<BlockExpr &>(*definition.GetBody());
+            
+            Compiler * compiler = new Compiler(mInterpreter, this, mScratch);
+            compiler->Compile(sNextMethodId++, body.Params(), *body.Body());
+            methods.Add(compiler);
+            
+            if (compiler->mUpvalues.Count() > 0) isShared = false;
+        }
+        
+        int sharedMethods = -1;
+        if (isShared && (methods.Count() > 0))
+        {
+            SharedMethods shared;
+            int method = 0;
+            for (int i = 0; i < count; i++)
+            {
+                const Definition & definition = expr.Definitions()[i];
+                if (!definition.IsMethod()) continue;
+                
+                shared.names.Add(mInterpreter.AddString(definition.GetName()));
+                shared.blocks.Add(mBlock->AddBlock(methods[method++]->mBlock));
+            }
+            
+            sharedMethods = mBlock->AddSharedMethods(shared);
+        }
+        
+        // Compile each of the definitions.
+        int method = 0;
+        for (int i = 0; i < count; i++)
         {
             const Definition & definition = expr.Definitions()[i];
             StringId name = mInterpreter.AddString(definition.GetName());
@@ -500,14 +742,21 @@ namespace Finch
             int value = ReserveRegister();
 
             if (definition.IsMethod()) {
-                BlockExpr & body = static_cast<BlockExpr &>(
-                    *definition.GetBody());
-                
-                CompileNestedBlock(sNextMethodId++, body, value);
+                if (sharedMethods != -1)
+                {
+                    // Define all of them at the first one.
+                    if (method == 0)
+                    {
+                        mBlock->Write(OP_DEF_METHODS, sharedMethods, 0xff, dest);
+                    }
+                }
+                else
+                {
+                    WriteBlock(*methods[method], value);
+                    mBlock->Write(OP_DEF_METHOD, name, value, dest);
+                }
                 
-                // TODO(bob): Right now, we're only giving 8-bits to the name,
-                // which will run out quickly.
-                mBlock->Write(OP_DEF_METHOD, name, value, dest);
+                method++;
             }
             else
             {
@@ -518,6 +767,670 @@ namespace Finch
             
             ReleaseRegister();
         }
+        
+        for (int i = 0; i < methods.Count(); i++)
+        {
+            delete methods[i];
+        }
+    }
+    
+    bool Compiler::CompileInlineMessage(const MessageExpr & expr, int dest)
+    {
+        // Only a single message can be inlined, not a cascade.
+        if (!mInlineBlocks || (expr.Messages().Count() != 1)) return false;
+        
+        // Inside an object literal, `self` refers to the object and not to
+        // what a block's `self` would be.
+        if (mObjectLiterals.Count() > 0) return false;
+        
+        const MessageSend & message = expr.Messages()[0];
+        const Array<Ref<Expr> > & args = message.GetArguments();
+        String name = message.GetName();
+        
+        if ((name == "if:then:") || (name == "if:then:else:"))
+        {
+            if (!IsEther(*expr.Receiver()) || !AreInlineBlocks(args, 1))
+            {
+                return false;
+            }
+            
+            CompileIf(expr, dest);
+            return true;
+        }
+        
+        if ((name == "and:") || (name == "or:"))
+        {
+            if (!AreInlineBlocks(args, 0)) return false;
+            
+            CompileLogicalOperator(expr, name == "and:", dest);
+            return true;
+        }
+        
+        if ((name == "call") || (name == "call:"))
+        {
+            const BlockExpr * block = expr.Receiver()->AsBlock();
+            if ((block == NULL) || (block->Params().Count() != args.Count()))
+            {
+                return false;
+            }
+            
+            CompileBlockCall(expr, dest);
+            return true;
+        }
+        
+        if (!IsEther(*expr.Receiver())) return false;
+        
+        if (name == "while:do:")
+        {
+            if (!AreInlineBlocks(args, 0)) return false;
+            
+            CompileWhile(*args[0], *args[1]->AsBlock(), dest);
+            return true;
+        }
+        
+        if (name == "loop:")
+        {
+            if (!AreInlineBlocks(args, 0)) return false;
+            
+            NameExpr condition("true");
+            CompileGuardedWhile(expr, condition, *args[0]->AsBlock(), dest);
+            return true;
+        }
+        
+        if (name == "while:and:do:")
+        {
+            if (!AreInlineBlocks(args, 0)) return false;
+            
+            // { a call and: b }
+            Array<Ref<Expr> > noArgs;
+            Ref<Expr> callA = Ref<Expr>(new MessageExpr(args[0], "call", noArgs));
+            
+            Array<Ref<Expr> > andArgs;
+            andArgs.Add(args[1]);
+            Ref<Expr> callAnd = Ref<Expr>(new MessageExpr(callA, "and:", andArgs));
+            
+            BlockExpr condition(Array<String>(), callAnd);
+            CompileGuardedWhile(expr, condition, *args[2]->AsBlock(), dest);
+            return true;
+        }
+        
+        if ((name == "from:to:do:") || (name == "from:to:step:do:"))
+        {
+            const BlockExpr * block = args[args.Count() - 1]->AsBlock();
+            if ((block == NULL) || (block->Params().Count() != 1)) return false;
+            
+            CompileFromTo(expr, dest);
+            return true;
+        }
+        
+        return false;
+    }
+    
+    void Compiler::CompileIf(const MessageExpr & expr, int dest)
+    {
+        const MessageSend & message = expr.Messages()[0];
+        const Array<Ref<Expr> > & args = message.GetArguments();
+        
+        // Lay out the registers like a normal message send so that the
+        // fallback code can send it.
+        int receiverReg = ReserveRegister();
+        for (int i = 0; i < args.Count(); i++) ReserveRegister();
+        
+        int conditionReg = receiverReg + 1;
+        args[0]->Accept(*this, conditionReg);
+        
+        int elseJump = mBlock->WriteJump(OP_JUMP_IF_FALSE, conditionReg);
+        int fallbackJump = mBlock->WriteJump(OP_JUMP);
+        Array<int> endJumps;
+        
+        CompileInlineBlock(*args[1]->AsBlock(), dest);
+        endJumps.Add(mBlock->WriteJump(OP_JUMP));
+        
+        PatchJump(fallbackJump);
+        expr.Receiver()->Accept(*this, receiverReg);
+        CompileFallbackSend(message, receiverReg, 1, dest);
+        endJumps.Add(mBlock->WriteJump(OP_JUMP));
+        
+        PatchJump(elseJump);
+        if (args.Count() > 2)
+        {
+            CompileInlineBlock(*args[2]->AsBlock(), dest);
+        }
+        else
+        {
+            CompileConstant(mInterpreter.Nil(), dest);
+        }
+        
+        for (int i = 0; i < endJumps.Count(); i++)
+        {
+            PatchJump(endJumps[i]);
+        }
+        
+        for (int i = 0; i <= args.Count(); i++) ReleaseRegister();
+    }
+    
+    void Compiler::CompileLogicalOperator(const MessageExpr & expr, bool isAnd,
+                                          int dest)
+    {
+        const MessageSend & message = expr.Messages()[0];
+        const BlockExpr & right = *message.GetArguments()[0]->AsBlock();
+        
+        int receiverReg = ReserveRegister();
+        int rightReg = ReserveRegister();
+        expr.Receiver()->Accept(*this, receiverReg);
+        
+        Array<int> endJumps;
+        Array<int> falseJumps;
+        
+        if (isAnd)
+        {
+            falseJumps.Add(mBlock->WriteJump(OP_JUMP_IF_FALSE, receiverReg));
+            int fallbackJump = mBlock->WriteJump(OP_JUMP);
+            
+            CompileInlineBlock(right, rightReg);
+            CompileTruthiness(rightReg, dest, endJumps, falseJumps);
+            
+            PatchJump(fallbackJump);
+            CompileFallbackSend(message, receiverReg, 0, dest);
+            endJumps.Add(mBlock->WriteJump(OP_JUMP));
+        }
+        else
+        {
+            int rightJump = mBlock->WriteJump(OP_JUMP_IF_FALSE, receiverReg);
+            int fallbackJump = mBlock->WriteJump(OP_JUMP);
+            
+            CompileConstant(mInterpreter.True(), dest);
+            endJumps.Add(mBlock->WriteJump(OP_JUMP));
+            
+            PatchJump(fallbackJump);
+            CompileFallbackSend(message, receiverReg, 0, dest);
+            endJumps.Add(mBlock->WriteJump(OP_JUMP));
+            
+            PatchJump(rightJump);
+            CompileInlineBlock(right, rightReg);
+            CompileTruthiness(rightReg, dest, endJumps, falseJumps);
+        }
+        
+        for (int i = 0; i < falseJumps.Count(); i++)
+        {
+            PatchJump(falseJumps[i]);
+        }
+        
+        CompileConstant(mInterpreter.False(), dest);
+        
+        for (int i = 0; i < endJumps.Count(); i++)
+        {
+            PatchJump(endJumps[i]);
+        }
+        
+        ReleaseRegister();
+        ReleaseRegister();
+    }
+    
+    void Compiler::CompileBlockCall(const MessageExpr & expr, int dest)
+    {
+        const MessageSend & message = expr.Messages()[0];
+        const Array<Ref<Expr> > & args = message.GetArguments();
+        const BlockExpr & block = *expr.Receiver()->AsBlock();
+        
+        // The block's parameters are locals in the scope the body is inlined
+        // into. They're laid out after the receiver like the arguments to a
+        // normal message send so that the fallback code can send it.
+        Scope scope;
+        BeginScope(scope);
+        
+        int receiverReg = DeclareLocal("");
+        for (int i = 0; i < args.Count(); i++)
+        {
+            args[i]->Accept(*this, DeclareLocal(""));
+        }
+        
+        int fallbackJump = mBlock->WriteJump(OP_JUMP_IF_REDEFINED);
+        
+        // Name the parameters now that the arguments have been evaluated.
+        for (int i = 0; i < args.Count(); i++)
+        {
+            mLocals[receiverReg + 1 + i] = block.Params()[i];
+        }
+        
+        CompileInlineBody(block, dest);
+        int endJump = mBlock->WriteJump(OP_JUMP);
+        
+        for (int i = 0; i < args.Count(); i++)
+        {
+            mLocals[receiverReg + 1 + i] = "";
+        }
+        
+        PatchJump(fallbackJump);
+        CompileFallbackBlock(block, receiverReg);
+        CompileFallbackSend(message, receiverReg, args.Count(), dest);
+        
+        PatchJump(endJump);
+        EndScope(scope);
+    }
+    
+    void Compiler::CompileWhile(const Expr & condition, const BlockExpr & body,
+                                int dest)
+    {
+        Scope scope;
+        BeginScope(scope);
+        
+        // Lay out the registers for the two messages the loop can fall back
+        // to: "while:do:" if it's been redefined, and "if:then:" to continue
+        // the loop if the condition isn't a boolean. The block that continues
+        // the loop refers to the condition and body by name.
+        int whileReg = DeclareLocal("");
+        int conditionReg = DeclareLocal("(condition)");
+        DeclareLocal("(body)");
+        int ifReg = DeclareLocal("");
+        int valueReg = DeclareLocal("");
+        int continueReg = DeclareLocal("");
+        
+        int loopStart = mBlock->Code().Count();
+        int redefinedJump = mBlock->WriteJump(OP_JUMP_IF_REDEFINED);
+        
+        const BlockExpr * conditionBlock = condition.AsBlock();
+        if (conditionBlock != NULL)
+        {
+            CompileInlineBlock(*conditionBlock, valueReg);
+        }
+        else
+        {
+            condition.Accept(*this, valueReg);
+        }
+        
+        int exitJump = mBlock->WriteJump(OP_JUMP_IF_FALSE, valueReg);
+        int continueJump = mBlock->WriteJump(OP_JUMP);
+        
+        // The body's result is discarded.
+        CompileInlineBlock(body, continueReg);
+        WriteLoop(loopStart);
+        
+        Array<int> endJumps;
+        
+        // if: (value) then: { (body) call, while: (condition) do: (body) }
+        PatchJump(continueJump);
+        CompileLoopBlocks(condition, body, conditionReg);
+        
+        Array<Ref<Expr> > noArgs;
+        Ref<Expr> bodyName = Ref<Expr>(new NameExpr("(body)"));
+        Ref<Expr> callBody = Ref<Expr>(new MessageExpr(bodyName, "call", noArgs));
+        
+        Array<Ref<Expr> > whileArgs;
+        whileArgs.Add(Ref<Expr>(new NameExpr("(condition)")));
+        whileArgs.Add(bodyName);
+        Ref<Expr> ether = Ref<Expr>(new NameExpr("Ether"));
+        Ref<Expr> callWhile = Ref<Expr>(new MessageExpr(ether, "while:do:", whileArgs));
+        
+        Array<Ref<Expr> > continueExprs;
+        continueExprs.Add(callBody);
+        continueExprs.Add(callWhile);
+        Ref<Expr> continueBody = Ref<Expr>(new SequenceExpr(continueExprs));
+        
+        ether->Accept(*this, ifReg);
+        CompileFallbackBlock(BlockExpr(Array<String>(), continueBody), continueReg);
+        mBlock->Write(OP_MESSAGE_2, mInterpreter.AddString("if:then:"),
+                      ifReg, dest);
+        endJumps.Add(mBlock->WriteJump(OP_JUMP));
+        
+        // while: (condition) do: (body)
+        PatchJump(redefinedJump);
+        CompileLoopBlocks(condition, body, conditionReg);
+        ether->Accept(*this, whileReg);
+        mBlock->Write(OP_MESSAGE_2, mInterpreter.AddString("while:do:"),
+                      whileReg, dest);
+        endJumps.Add(mBlock->WriteJump(OP_JUMP));
+        
+        // Loops evaluate to nil when they finish.
+        PatchJump(exitJump);
+        CompileConstant(mInterpreter.Nil(), dest);
+        
+        for (int i = 0; i < endJumps.Count(); i++)
+        {
+            PatchJump(endJumps[i]);
+        }
+        
+        EndScope(scope);
+    }
+    
+    void Compiler::CompileLoopBlocks(const Expr & condition,
+                                     const BlockExpr & body, int dest)
+    {
+        const BlockExpr * conditionBlock = condition.AsBlock();
+        if (conditionBlock != NULL)
+        {
+            CompileFallbackBlock(*conditionBlock, dest);
+        }
+        else
+        {
+            condition.Accept(*this, dest);
+        }
+        
+        CompileFallbackBlock(body, dest + 1);
+    }
+    
+    void Compiler::CompileGuardedWhile(const MessageExpr & expr,
+                                       const Expr & condition,
+                                       const BlockExpr & body, int dest)
+    {
+        const MessageSend & message = expr.Messages()[0];
+        
+        Scope scope;
+        BeginScope(scope);
+        
+        int receiverReg = DeclareLocal("");
+        for (int i = 0; i < message.GetArguments().Count(); i++)
+        {
+            DeclareLocal("");
+        }
+        
+        int fallbackJump = mBlock->WriteJump(OP_JUMP_IF_REDEFINED);
+        
+        CompileWhile(condition, body, dest);
+        int endJump = mBlock->WriteJump(OP_JUMP);
+        
+        PatchJump(fallbackJump);
+        expr.Receiver()->Accept(*this, receiverReg);
+        CompileFallbackSend(message, receiverReg, 0, dest);
+        
+        PatchJump(endJump);
+        EndScope(scope);
+    }
+    
+    void Compiler::CompileFromTo(const MessageExpr & expr, int dest)
+    {
+        const MessageSend & message = expr.Messages()[0];
+        const Array<Ref<Expr> > & args = message.GetArguments();
+        bool hasStep = args.Count() == 4;
+        
+        // The arguments are evaluated into the registers a normal message send
+        // would use. The start register is also the loop counter.
+        Scope scope;
+        BeginScope(scope);
+        
+        int receiverReg = DeclareLocal("");
+        args[0]->Accept(*this, DeclareLocal("(i)"));
+        args[1]->Accept(*this, DeclareLocal("(end)"));
+        if (hasStep) args[2]->Accept(*this, DeclareLocal("(step)"));
+        DeclareLocal("");
+        
+        int fallbackJump = mBlock->WriteJump(OP_JUMP_IF_REDEFINED);
+        
+        // Build the loop the way the core library defines it:
+        //
+        // (step) <- if: (i) <= (end) then: { 1 } else: { -1 }
+        // while: { (i) <= (end) } do: {
+        //     block call: (i)
+        //     (i) <-- (i) + (step)
+        // }
+        Array<Ref<Expr> > noArgs;
+        Ref<Expr> i = Ref<Expr>(new NameExpr("(i)"));
+        Ref<Expr> end = Ref<Expr>(new NameExpr("(end)"));
+        Ref<Expr> step = Ref<Expr>(new NameExpr("(step)"));
+        
+        Array<Ref<Expr> > endArgs;
+        endArgs.Add(end);
+        Ref<Expr> compare = Ref<Expr>(new MessageExpr(i, "<=", endArgs));
+        
+        Array<Ref<Expr> > iArgs;
+        iArgs.Add(i);
+        Ref<Expr> callBlock = Ref<Expr>(new MessageExpr(args[args.Count() - 1],
+                                                        "call:", iArgs));
+        
+        Array<Ref<Expr> > stepArgs;
+        stepArgs.Add(step);
+        Ref<Expr> increment = Ref<Expr>(new MessageExpr(i, "+", stepArgs));
+        
+        Array<Ref<Expr> > bodyExprs;
+        bodyExprs.Add(callBlock);
+        bodyExprs.Add(Ref<Expr>(new SetExpr("(i)", increment)));
+        
+        BlockExpr condition(Array<String>(), compare);
+        BlockExpr body(Array<String>(), Ref<Expr>(new SequenceExpr(bodyExprs)));
+        
+        Scope loopScope;
+        BeginScope(loopScope);
+        
+        if (!hasStep)
+        {
+            Array<Ref<Expr> > ifArgs;
+            ifArgs.Add(compare);
+            ifArgs.Add(Ref<Expr>(new BlockExpr(Array<String>(),
+                Ref<Expr>(new NumberExpr(1)))));
+            ifArgs.Add(Ref<Expr>(new BlockExpr(Array<String>(),
+                Ref<Expr>(new NumberExpr(-1)))));
+            
+            MessageExpr ifStep(Ref<Expr>(new NameExpr("Ether")),
+                               "if:then:else:", ifArgs);
+            ifStep.Accept(*this, DeclareLocal("(step)"));
+        }
+        
+        CompileWhile(condition, body, dest);
+        EndScope(loopScope);
+        
+        int endJump = mBlock->WriteJump(OP_JUMP);
+        
+        PatchJump(fallbackJump);
+        expr.Receiver()->Accept(*this, receiverReg);
+        CompileFallbackSend(message, receiverReg, args.Count() - 1, dest);
+        
+        PatchJump(endJump);
+        EndScope(scope);
+    }
+    
+    void Compiler::PatchJump(int jump)
+    {
+        if (!mBlock->PatchJump(jump)) mJumpTooFar = true;
+    }
+    
+    void Compiler::WriteLoop(int target)
+    {
+        if (!mBlock->WriteLoop(target)) mJumpTooFar = true;
+    }
+    
+    void Compiler::CompileTruthiness(int reg, int dest, Array<int> & endJumps,
+                                     Array<int> & falseJumps)
+    {
+        falseJumps.Add(mBlock->WriteJump(OP_JUMP_IF_FALSE, reg));
+        int fallbackJump = mBlock->WriteJump(OP_JUMP);
+        
+        CompileConstant(mInterpreter.True(), dest);
+        endJumps.Add(mBlock->WriteJump(OP_JUMP));
+        
+        PatchJump(fallbackJump);
+        StringId messageId = mInterpreter.AddString("true?");
+        mBlock->Write(OP_MESSAGE_0, messageId, reg, dest);
+        endJumps.Add(mBlock->WriteJump(OP_JUMP));
+    }
+    
+    void Compiler::CompileInlineBlock(const BlockExpr & block, int dest)
+    {
+        Scope scope;
+        BeginScope(scope);
+        CompileInlineBody(block, dest);
+        EndScope(scope);
+    }
+    
+    void Compiler::CompileInlineBody(const BlockExpr & block, int dest)
+    {
+        // Each expression in a sequence is evaluated into the destination
+        // register. If that's a variable, the block could overwrite it while
+        // it's still using it, so evaluate into a temporary instead.
+        int bodyReg = dest;
+        if (IsVariableRegister(dest)) bodyReg = DeclareLocal("");
+        
+        block.Body()->Accept(*this, bodyReg);
+        
+        if (bodyReg != dest) mBlock->Write(OP_MOVE, bodyReg, dest);
+    }
+    
+    void Compiler::BeginScope(Scope & scope)
+    {
+        scope.numLocals = mLocals.Count();
+        scope.numRegisters = mInUseRegisters;
+        scope.start = mScopeStart;
+        scope.highestCapturedLocal = mHighestCapturedLocal;
+        
+        // Pad the locals out to the registers currently in use so that new
+        // locals are placed after any temporaries.
+        while (mLocals.Count() < mInUseRegisters) mLocals.Add("");
+        mScopeStart = mLocals.Count();
+        mHighestCapturedLocal = -1;
+    }
+    
+    void Compiler::EndScope(const Scope & scope)
+    {
+        // The scope's registers will be reused after it ends, so any closures
+        // that captured its locals need their own copies of them.
+        if (mHighestCapturedLocal >= mScopeStart)
+        {
+            mBlock->Write(OP_CLOSE_UPVALUES, mScopeStart);
+        }
+        
+        mLocals.Truncate(scope.numLocals);
+        mInUseRegisters = scope.numRegisters;
+        mScopeStart = scope.start;
+        
+        if (scope.highestCapturedLocal > mHighestCapturedLocal)
+        {
+            mHighestCapturedLocal = scope.highestCapturedLocal;
+        }
+    }
+    
+    int Compiler::DeclareLocal(const String & name)
+    {
+        ASSERT(mLocals.Count() == mInUseRegisters,
+               "Cannot declare a local while temporaries are in use.");
+        
+        mLocals.Add(name);
+        return ReserveRegister();
+    }
+    
+    void Compiler::CompileFallbackSend(const MessageSend & message,
+                                       int receiverReg, int firstBlock,
+                                       int dest)
+    {
+        const Array<Ref<Expr> > & args = message.GetArguments();
+        for (int i = firstBlock; i < args.Count(); i++)
+        {
+            CompileFallbackBlock(*args[i]->AsBlock(), receiverReg + 1 + i);
+        }
+        
+        StringId messageId = mInterpreter.AddString(message.GetName());
+        OpCode op = GetMessageOp(message.GetName(), args.Count());
+        mBlock->Write(op, messageId, receiverReg, dest);
+    }
+    
+    void Compiler::CompileFallbackBlock(const BlockExpr & block, int dest)
+    {
+        bool inlineBlocks = mInlineBlocks;
+        mInlineBlocks = false;
+        CompileNestedBlock(Block::BLOCK_METHOD_ID, block, dest);
+        mInlineBlocks = inlineBlocks;
+    }
+    
+    bool Compiler::AreInlineBlocks(const Array<Ref<Expr> > & args, int first)
+    {
+        for (int i = first; i < args.Count(); i++)
+        {
+            const BlockExpr * block = args[i]->AsBlock();
+            if ((block == NULL) || (block->Params().Count() > 0)) return false;
+        }
+        
+        return true;
+    }
+    
+    bool Compiler::IsEther(const Expr & expr)
+    {
+        const NameExpr * name = expr.AsName();
+        if ((name == NULL) || (name->Name() != "Ether")) return false;
+        
+        // Make sure it isn't shadowed by a local variable.
+        for (Compiler * compiler = this; compiler != NULL;
+             compiler = compiler->mParent)
+        {
+            if (compiler->FindLocal(name->Name(), 0) != -1) return false;
+        }
+        
+        return true;
+    }
+    
+    bool Compiler::IsTopLevel() const
+    {
+        // Variables in a block that's inlined into top-level code are still
+        // local to that block.
+        return (mParent == NULL) && (mScopeStart == 0);
+    }
+    
+    int Compiler::FindLocal(const String & name, int start) const
+    {
+        for (int i = mLocals.Count() - 1; i >= start; i--)
+        {
+            if (mLocals[i] == name) return i;
+        }
+        
+        return -1;
+    }
+    
+    bool Compiler::IsVariableRegister(int reg) const
+    {
+        if (reg >= mLocals.Count()) return false;
+        
+        const String & name = mLocals[reg];
+        return (name.Length() > 0) && (name != "(return)");
+    }
+    
+    bool Compiler::CanCopyLocal(int local) const
+    {
+        if (mDefiningLocals.IndexOf(local) != -1) return false;
+        
+        // Locals the compiler declares for itself aren't in the AST, so
+        // they're never found here.
+        const String & name = mLocals[local];
+        return (mDefinedNames.IndexOf(name) != -1) &&
+               (mAssignedNames.IndexOf(name) == -1);
+    }
+    
+    int Compiler::FindUpvalueSlot(const Upvalue & upvalue)
+    {
+        int slot = 0;
+        for (int i = 0; i < mUpvalues.Count(); i++)
+        {
+            const Upvalue & existing = mUpvalues[i];
+            if (existing.IsCopy() != upvalue.IsCopy()) continue;
+            
+            if ((existing.IsLocal() == upvalue.IsLocal()) &&
+                (existing.Index() == upvalue.Index()))
+            {
+                return existing.Slot();
+            }
+            
+            slot++;
+        }
+        
+        Upvalue added = upvalue;
+        added.SetSlot(slot);
+        mUpvalues.Add(added);
+        return slot;
+    }
+    
+    OpCode Compiler::GetMessageOp(const String & name, int numArgs)
+    {
+        if (numArgs == 1)
+        {
+            if (name == "+")  return OP_ADD;
+            if (name == "-")  return OP_SUBTRACT;
+            if (name == "*")  return OP_MULTIPLY;
+            if (name == "/")  return OP_DIVIDE;
+            if (name == "=")  return OP_EQUAL;
+            if (name == "!=") return OP_NOT_EQUAL;
+            if (name == "<")  return OP_LESS;
+            if (name == ">")  return OP_GREATER;
+            if (name == "<=") return OP_LESS_EQUAL;
+            if (name == ">=") return OP_GREATER_EQUAL;
+        }
+        
+        return static_cast<OpCode>(OP_MESSAGE_0 + numArgs);
     }
     
     Compiler * Compiler::GetEnclosingMethod()
@@ -548,5 +1461,99 @@ namespace Finch
     {
         mInUseRegisters--;
     }
+    
+    void Compiler::AssignmentFinder::Find(const Array<String> & params,
+                                          const Expr & expr)
+    {
+        for (int i = 0; i < params.Count(); i++) Define(params[i]);
+        Find(expr);
+    }
+    
+    void Compiler::AssignmentFinder::Define(const String & name)
+    {
+        if (mDefined.IndexOf(name) == -1)
+        {
+            mDefined.Add(name);
+        }
+        else if (mAssigned.IndexOf(name) == -1)
+        {
+            mAssigned.Add(name);
+        }
+    }
+    
+    void Compiler::AssignmentFinder::Find(const DefineExpr & expr)
+    {
+        for (int i = 0; i < expr.Definitions().Count(); i++)
+        {
+            Find(*expr.Definitions()[i].GetBody());
+        }
+    }
+    
+    void Compiler::AssignmentFinder::Visit(const ArrayExpr & expr, int dest)
+    {
+        for (int i = 0; i < expr.Elements().Count(); i++)
+        {
+            Find(*expr.Elements()[i]);
+        }
+    }
+    
+    void Compiler::AssignmentFinder::Visit(const BindExpr & expr, int dest)
+    {
+        Find(*expr.Target());
+        Find(static_cast<const DefineExpr &>(expr));
+    }
+    
+    void Compiler::AssignmentFinder::Visit(const BlockExpr & expr, int dest)
+    {
+        // Blocks that get inlined declare their parameters in this block, so
+        // count them too.
+        for (int i = 0; i < expr.Params().Count(); i++)
+        {
+            Define(expr.Params()[i]);
+        }
+        
+        Find(*expr.Body());
+    }
+    
+    void Compiler::AssignmentFinder::Visit(const MessageExpr & expr, int dest)
+    {
+        Find(*expr.Receiver());
+        
+        for (int i = 0; i < expr.Messages().Count(); i++)
+        {
+            const Array<Ref<Expr> > & args = expr.Messages()[i].GetArguments();
+            for (int j = 0; j < args.Count(); j++) Find(*args[j]);
+        }
+    }
+    
+    void Compiler::AssignmentFinder::Visit(const ObjectExpr & expr, int dest)
+    {
+        Find(*expr.Parent());
+        Find(static_cast<const DefineExpr &>(expr));
+    }
+    
+    void Compiler::AssignmentFinder::Visit(const ReturnExpr & expr, int dest)
+    {
+        Find(*expr.Result());
+    }
+    
+    void Compiler::AssignmentFinder::Visit(const SequenceExpr & expr, int dest)
+    {
+        for (int i = 0; i < expr.Expressions().Count(); i++)
+        {
+            Find(*expr.Expressions()[i]);
+        }
+    }
+    
+    void Compiler::AssignmentFinder::Visit(const SetExpr & expr, int dest)
+    {
+        if (mAssigned.IndexOf(expr.Name()) == -1) mAssigned.Add(expr.Name());
+        Find(*expr.Value());
+    }
+    
+    void Compiler::AssignmentFinder::Visit(const VarExpr & expr, int dest)
+    {
+        Define(expr.Name());
+        Find(*expr.Value());
+    }
 }
-
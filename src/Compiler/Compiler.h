@@ -4,6 +4,7 @@
 
 #include "Array.h"
 #include "Block.h"
+#include "Dictionary.h"
 #include "Expr.h"
 #include "Macros.h"
 #include "IExprCompiler.h"
@@ -14,6 +15,8 @@
 namespace Finch
 {
     class DefineExpr;
+    class MessageSend;
+    struct OptimizeScratch;
     
     class Compiler : private IExprCompiler
     {
@@ -30,13 +33,15 @@ namespace Finch
             Upvalue()
             :   mIsLocal(false),
             mIndex(-1),
-            mSlot(-1)
+            mSlot(-1),
+            mIsCopy(false)
             {}
             
-            Upvalue(bool isLocal, int index)
+            Upvalue(bool isLocal, int index, bool isCopy)
             :   mIsLocal(isLocal),
             mIndex(index),
-            mSlot(-1)
+            mSlot(-1),
+            mIsCopy(isCopy)
             {}
             
             bool IsValid() const { return mIndex != -1; }
@@ -45,10 +50,56 @@ namespace Finch
             void SetSlot(int slot) { mSlot = slot; }
             int Slot() const { return mSlot; }
             
+            // Returns true if the variable is never assigned after the block
+            // is created, so its value is copied into the block object
+            // instead of being shared through an Upvalue. Copied values are
+            // numbered separately from shared ones.
+            bool IsCopy() const { return mIsCopy; }
+            
         private:
             bool mIsLocal;
             int  mIndex;
             int  mSlot;
+            bool mIsCopy;
+        };
+        
+        // Walks a block's body, including the blocks inside it, to find the
+        // names that may be given a new value after they're defined: those
+        // assigned with "<--" or defined more than once.
+        class AssignmentFinder : private IExprCompiler
+        {
+        public:
+            AssignmentFinder(Array<String> & defined, Array<String> & assigned)
+            :   mDefined(defined),
+                mAssigned(assigned)
+            {}
+            
+            void Find(const Array<String> & params, const Expr & expr);
+            
+        private:
+            void Define(const String & name);
+            void Find(const Expr & expr) { expr.Accept(*this, 0); }
+            void Find(const DefineExpr & expr);
+            
+            virtual void Visit(const ArrayExpr & expr, int dest);
+            virtual void Visit(const BindExpr & expr, int dest);
+            virtual void Visit(const BlockExpr & expr, int dest);
+            virtual void Visit(const MessageExpr & expr, int dest);
+            virtual void Visit(const NameExpr & expr, int dest) {}
+            virtual void Visit(const NumberExpr & expr, int dest) {}
+            virtual void Visit(const ObjectExpr & expr, int dest);
+            virtual void Visit(const ReturnExpr & expr, int dest);
+            virtual void Visit(const SequenceExpr & expr, int dest);
+            virtual void Visit(const SelfExpr & expr, int dest) {}
+            virtual void Visit(const SetExpr & expr, int dest);
+            virtual void Visit(const StringExpr & expr, int dest) {}
+            virtual void Visit(const UndefineExpr & expr, int dest) {}
+            virtual void Visit(const VarExpr & expr, int dest);
+            
+            Array<String> & mDefined;
+            Array<String> & mAssigned;
+            
+            NO_COPY(AssignmentFinder);
         };
         
         // Every expression except the last in a sequence discards its result
@@ -56,7 +107,29 @@ namespace Finch
         // instructions if we know the result will be trashed anyway.
         const static int DISCARD_REGISTER = -1;
         
-        Compiler(Interpreter & interpreter, Compiler * parent);
+        // A value that FoldConstant() calculated: a number, a boolean or a
+        // string. Strings are kept as Strings so that no object is created
+        // for one unless it's the result.
+        struct Folded
+        {
+            Value  value;   // the number or boolean, or null for a string
+            String string;
+            
+            bool IsString() const { return value.IsNull(); }
+        };
+        
+        // The state of an enclosing scope, saved while an inlined block's
+        // scope is being compiled.
+        struct Scope
+        {
+            int numLocals;
+            int numRegisters;
+            int start;
+            int highestCapturedLocal;
+        };
+        
+        Compiler(Interpreter & interpreter, Compiler * parent,
+                 OptimizeScratch & scratch);
         
         void Compile(int methodId, const Array<String> & params, const Expr & expr);
 
@@ -83,10 +156,132 @@ namespace Finch
         void CompileSetGlobal(const String & name, const Expr & value, int dest);
         void CompileSetField(const String & name, const Expr & value, int dest);
         void CompileNestedBlock(int methodId, const BlockExpr & block, int dest);
+        
+        // Adds the block compiled by the given child compiler to this one and
+        // writes the instructions to create it and capture its upvalues.
+        void WriteBlock(const Compiler & compiler, int dest);
         void CompileConstant(const Value & constant, int dest);
+        
+        // Gets the object for a string literal or a folded string. Ones with
+        // the same contents in the same top-level expression share an object,
+        // since strings can't be changed.
+        Value LiteralString(const String & value);
+        
+        // Calculates the value of `expr` at compile time if it only sends
+        // arithmetic, comparison and "neg" to number literals and "+" to
+        // string literals. Returns false if it can't.
+        bool FoldConstant(const Expr & expr, Folded & result);
+        
+        // Compiles a message whose result FoldConstant() calculated to load
+        // it directly. Since the messages could be redefined, falls back to
+        // sending them normally if the core library's versions are no longer
+        // in effect.
+        void CompileFolded(const MessageExpr & expr, const Folded & value,
+                           int dest);
         void CompileDefinitions(const DefineExpr & expr, int dest);
+        
+        // Compiles control flow messages like "if:then:" whose arguments are
+        // literal blocks to jumps, with the block bodies inlined. Since the
+        // messages could be redefined, the inlined code falls back to sending
+        // them normally if the core library's versions are no longer in
+        // effect. Returns false if the message can't be inlined.
+        bool CompileInlineMessage(const MessageExpr & expr, int dest);
+        void CompileIf(const MessageExpr & expr, int dest);
+        void CompileLogicalOperator(const MessageExpr & expr, bool isAnd, int dest);
+        void CompileBlockCall(const MessageExpr & expr, int dest);
+        
+        // Compiles a "while:do:" loop to a backward jump. The condition is
+        // either a literal block or an expression that's evaluated on each
+        // iteration.
+        void CompileWhile(const Expr & condition, const BlockExpr & body,
+                          int dest);
+        
+        // Compiles the condition and body of a loop that's being sent normally
+        // into `dest` and the register after it.
+        void CompileLoopBlocks(const Expr & condition, const BlockExpr & body,
+                               int dest);
+        
+        // Compiles a loop message that's implemented in terms of "while:do:"
+        // in the core library. Before the loop is entered, checks that the
+        // message hasn't been redefined.
+        void CompileGuardedWhile(const MessageExpr & expr,
+                                 const Expr & condition,
+                                 const BlockExpr & body, int dest);
+        void CompileFromTo(const MessageExpr & expr, int dest);
+        
+        // Patches the jump at the given index to jump to the next instruction.
+        // If that's too far, sets mJumpTooFar instead.
+        void PatchJump(int jump);
+        
+        // Writes a loop back to the instruction at the given index, or sets
+        // mJumpTooFar if that's too far.
+        void WriteLoop(int target);
+        
+        // Compiles code that converts the value in `reg` to a boolean in
+        // `dest` the same way "true?" does. Adds the jumps that are taken when
+        // the result is false to `falseJumps` and the ones taken after storing
+        // the result to `endJumps`.
+        void CompileTruthiness(int reg, int dest, Array<int> & endJumps,
+                               Array<int> & falseJumps);
+        
+        // Compiles the body of a zero-parameter literal block directly into
+        // this block, in its own scope.
+        void CompileInlineBlock(const BlockExpr & block, int dest);
+        
+        // Compiles a literal block's body in the current scope. If `dest` is a
+        // variable, the body is evaluated into a temporary first.
+        void CompileInlineBody(const BlockExpr & block, int dest);
+        
+        // Begins a new scope for an inlined block, saving the current one in
+        // `scope`. Locals declared in the new scope are placed after any
+        // registers currently in use.
+        void BeginScope(Scope & scope);
+        void EndScope(const Scope & scope);
+        
+        // Declares a new local in the current scope and returns its register.
+        // Locals with empty names can't be referred to by name.
+        int DeclareLocal(const String & name);
+        
+        // Compiles the normal message send that inlined code falls back to.
+        // The receiver and any arguments before `firstBlock` must already be
+        // in their registers. The rest are literal blocks.
+        void CompileFallbackSend(const MessageSend & message, int receiverReg,
+                                 int firstBlock, int dest);
+        
+        // Compiles a literal block without inlining anything inside it, so
+        // that the fallback code stays small.
+        void CompileFallbackBlock(const BlockExpr & block, int dest);
+        
+        // Returns true if the arguments starting at `first` are all literal
+        // blocks with no parameters.
+        static bool AreInlineBlocks(const Array<Ref<Expr> > & args, int first);
+        
+        // Returns true if `expr` refers to the global Ether object.
+        bool IsEther(const Expr & expr);
+        
+        // Returns true if variables declared here are globals.
+        bool IsTopLevel() const;
+        
+        // Finds the register of the innermost local with the given name,
+        // ignoring locals before `start`. Returns -1 if not found.
+        int FindLocal(const String & name, int start) const;
+        
+        // Returns true if the given register holds a named local variable.
+        bool IsVariableRegister(int reg) const;
+        
+        // Returns true if the local in the given register already has the
+        // only value it will ever have, so closures can copy it.
+        bool CanCopyLocal(int local) const;
+        
+        // Gets the slot for a new upvalue in this block, or the slot of an
+        // existing one that captures the same variable.
+        int FindUpvalueSlot(const Upvalue & upvalue);
 
         Compiler * GetEnclosingMethod();
+        
+        // Gets the instruction that sends the given message. Operators on
+        // numbers get their own specialized instructions.
+        static OpCode GetMessageOp(const String & name, int numArgs);
 
         int ReserveRegister();
         void ReleaseRegister();
@@ -97,13 +292,52 @@ namespace Finch
         // The compiler for the block containing the block this one is compiling
         // or NULL if this is compiling a top-level block.
         Compiler * mParent;
+        // Working storage for allocating registers, shared by every compiler
+        // under the same top-level one.
+        OptimizeScratch & mScratch;
         Ref<Block> mBlock;
         int mInUseRegisters;
         
-        // Names of local variables declared in this block.
+        // Names of local variables declared in this block. The index of each
+        // name is its register. Registers that are in use by temporaries when
+        // an inlined block's scope begins are padded with empty names.
         Array<String> mLocals;
+        
+        // Index in mLocals where the innermost scope's locals begin. This is
+        // zero except when compiling an inlined block.
+        int mScopeStart;
+        
+        // The highest register of a local that has been captured by a closure
+        // in the current scope, or -1 if none has been. Inlined scopes use it
+        // to tell if they need to close upvalues before their registers are
+        // reused.
+        int mHighestCapturedLocal;
+        
+        // `false` if messages with literal blocks should always be sent
+        // normally. Used when compiling the fallback code for inlined
+        // messages.
+        bool mInlineBlocks;
+        
+        // `false` while compiling the fallback code for a folded message, so
+        // that its operands are sent normally too.
+        bool mFoldConstants;
+        
+        // `true` if a jump or loop in the inlined or folded message being
+        // compiled couldn't reach its target. The message is then sent normally.
+        bool mJumpTooFar;
+        
         Array<Upvalue> mUpvalues;
         
+        // The names that AssignmentFinder found are defined in this block's
+        // body, and those of them that may change after they're defined.
+        Array<String> mDefinedNames;
+        Array<String> mAssignedNames;
+        
+        // Registers of the locals whose initial values are being compiled.
+        // A block that refers to the variable it's being stored in has to
+        // share it, since the variable doesn't have its value yet.
+        Array<int> mDefiningLocals;
+        
         // Registers containing the currently enclosing object literals. Within
         // an object literal a reference to 'self' inside a field initializer
         // will refer to the enclosing object and not the current dynamically
@@ -115,6 +349,14 @@ namespace Finch
         // that have a non-local return since the return needs to be able to
         // find the method on the stack when unwinding.
         bool mHasReturn;
+        
+        // `true` if this block reads `self` or its fields, or contains a block
+        // that does. Those blocks need the `self` they were created with.
+        bool mUsesSelf;
+        
+        // The objects LiteralString() has created, by contents. Only used by
+        // the top-level compiler.
+        Dictionary<String, Value> mStrings;
 
         NO_COPY(Compiler);
     };
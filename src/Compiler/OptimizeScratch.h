@@ -0,0 +1,86 @@
+#pragma once
+
+#include "Array.h"
+#include "Block.h"
+
+namespace Finch
+{
+    // What AllocateRegisters() needs to know about an instruction.
+    struct RegisterUse
+    {
+        int dest;          // register it writes, or -1
+        int firstRead;     // index of the registers it reads in `reads`
+        int numReads;
+        int numSuccessors;
+        int successors[3];
+    };
+    
+    // A set of writes and reads of one register that are connected by the
+    // values flowing between them. Each web can be allocated a register of
+    // its own.
+    struct RegisterWeb
+    {
+        int reg;           // the register the compiler used
+        int pin;           // the register it must be allocated, or -1
+        int floor;         // the lowest register it may be allocated
+        int allocated;     // the register it was allocated, or -1
+        
+        // Webs passed to the same message are allocated as a group, at
+        // fixed offsets from the group's root.
+        int group;
+        int offset;
+        int nextMember;
+        int firstMember;   // only used by the root
+        int firstOffset;   // lowest offset of any member, only in the root
+        int base;          // where a pinned group's root goes, or -1
+        int nextRoot;      // next root whose group starts at the same register
+        
+        // The first edges in lists of webs that can't share its register,
+        // that must be allocated before it, and that must be allocated after
+        // it.
+        int interferences;
+        int befores;
+        int afters;
+    };
+    
+    // An edge in one of the lists in RegisterWeb.
+    struct WebEdge
+    {
+        int web;
+        int next;
+    };
+    
+    // Working storage for Block::Optimize(). The compiler keeps one for
+    // everything it compiles from a top-level expression, so that optimizing
+    // each block doesn't have to allocate memory, and frees it when it's done.
+    struct OptimizeScratch
+    {
+        Array<Block::UnpackedInstruction> code;
+        Array<int> indexes;         // where each instruction moves to
+        Array<bool> locked;         // registers the peephole pass leaves alone
+        Array<bool> isTarget;
+        Array<bool> removed;
+        
+        // The rest is only used by Block::AllocateRegisters().
+        Array<RegisterUse> uses;
+        Array<int> reads;
+        Array<bool> captured;
+        Array<unsigned int> liveIn;
+        Array<unsigned int> live;
+        Array<unsigned int> openIn;
+        Array<int> targets;
+        Array<int> states;
+        Array<bool> hasState;
+        Array<int> current;
+        Array<int> readNodes;
+        Array<int> orphans;         // registers of values with no write
+        Array<int> sets;
+        Array<int> interferences;   // (node, node) pairs
+        Array<int> orderings;       // (before, after) pairs of nodes
+        Array<int> floors;          // (receiver node, register) pairs
+        Array<RegisterWeb> webs;
+        Array<WebEdge> edges;
+        Array<int> roots;
+        Array<int> starts;
+    };
+}
@@ -18,7 +18,6 @@
 #include "IoPrimitives.h"
 #include "Lexer.h"
 #include "LineNormalizer.h"
-#include "NumberObject.h"
 #include "NumberPrimitives.h"
 #include "ObjectPrimitives.h"
 #include "Primitives.h"
@@ -46,7 +45,12 @@ namespace Finch
     };
     
     Interpreter::Interpreter(IInterpreterHost & host)
-    :   mHost(host)
+    :   mHost(host),
+        mCacheEpochs(),
+        mEmptyShape(mCacheEpochs),
+        mIntrinsicsEpoch(NO_EPOCH),
+        mIntrinsicsIntact(false),
+        mEtherGlobal(-1)
     {
         // Build the global scope.
         
@@ -118,7 +122,8 @@ namespace Finch
         AddPrimitive(mStringPrototype, "index-of:",   StringIndexOf);
         
         // Ether.
-        MakeGlobal("Ether");
+        mEther = MakeGlobal("Ether");
+        mEtherGlobal = FindGlobal("Ether");
         
         // Io.
         Value io = MakeGlobal("Io");
@@ -135,6 +140,7 @@ namespace Finch
          AddPrimitive(primitives, "switch-to-fiber:passing:", PrimitiveSwitchToFiber);
          */
         AddPrimitive(primitives, "callstack-depth",          PrimitiveGetCallstackDepth);
+        AddPrimitive(primitives, "heap-stats",               PrimitiveGetHeapStats);
         
         // The special singleton values.
         mNil = MakeGlobal("nil");
@@ -155,7 +161,9 @@ namespace Finch
         Value fiber = NewFiber(blockObj);
         
         // Run the interpreter.
+        mFibers.Push(fiber);
         Value result = fiber.AsFiber()->GetFiber().Execute();
+        mFibers.Pop();
         
         if (showResult)
         {
@@ -165,6 +173,152 @@ namespace Finch
         }
     }
     
+    bool Interpreter::Compile(ILineReader & reader, FrameStats * stats)
+    {
+        Ref<Expr> expr = Parse(reader);
+        
+        // Bail if we failed to parse.
+        if (expr.IsNull()) return false;
+        
+        Ref<Block> block = Compiler::CompileTopLevel(*this, *expr);
+        if (stats != NULL) block->AddFrameStats(*stats);
+        return true;
+    }
+    
+    void Interpreter::CollectGarbage()
+    {
+        for (int i = 0; i < mGlobals.Count(); i++)
+        {
+            mHeap.Mark(mGlobals[i]);
+        }
+        
+        for (int i = 0; i < mIntrinsics.Count(); i++)
+        {
+            mHeap.Mark(mIntrinsics[i].receiver);
+            mHeap.Mark(mIntrinsics[i].target.method);
+        }
+        
+        for (int i = 0; i < mFibers.Count(); i++)
+        {
+            mHeap.Mark(mFibers[i]);
+        }
+        
+        mLookupCache.MarkReferences(mHeap, mCacheEpochs.messages);
+        
+        // The built-in objects are permanent, so they don't need to be marked.
+        // String literals are kept by the constants of the blocks that use
+        // them.
+        mHeap.Collect();
+    }
+    
+    void Interpreter::LoadCoreLibrary(ILineReader & reader)
+    {
+        ASSERT(mIntrinsics.Count() == 0, "Can only load the core library once.");
+        
+        Interpret(reader, false);
+        SealIntrinsics();
+    }
+    
+    void Interpreter::SealIntrinsics()
+    {
+        // The operators that OP_ADD and friends implement directly on
+        // numbers. Numbers' + - * / and = double-dispatch to the "number:"
+        // versions.
+        AddIntrinsic(mNumberPrototype, "+");
+        AddIntrinsic(mNumberPrototype, "-");
+        AddIntrinsic(mNumberPrototype, "*");
+        AddIntrinsic(mNumberPrototype, "/");
+        AddIntrinsic(mNumberPrototype, "=");
+        AddIntrinsic(mNumberPrototype, "+number:");
+        AddIntrinsic(mNumberPrototype, "-number:");
+        AddIntrinsic(mNumberPrototype, "*number:");
+        AddIntrinsic(mNumberPrototype, "/number:");
+        AddIntrinsic(mNumberPrototype, "=number:");
+        AddIntrinsic(mNumberPrototype, "!=");
+        AddIntrinsic(mNumberPrototype, "<");
+        AddIntrinsic(mNumberPrototype, ">");
+        AddIntrinsic(mNumberPrototype, "<=");
+        AddIntrinsic(mNumberPrototype, ">=");
+        
+        // The other messages that the compiler folds when they are sent to
+        // literals. Adding two strings double-dispatches to "+string:", which
+        // converts the argument with "to-string".
+        AddIntrinsic(mNumberPrototype, "neg");
+        AddIntrinsic(mStringPrototype, "+");
+        AddIntrinsic(mStringPrototype, "+string:");
+        AddIntrinsic(mStringPrototype, "to-string");
+        
+        // The control flow messages that the compiler inlines when they are
+        // passed literal blocks. Conditions are only tested inline if they
+        // are true, false or nil.
+        AddIntrinsic(mEther, "if:then:");
+        AddIntrinsic(mEther, "if:then:else:");
+        AddIntrinsic(mEther, "while:do:");
+        AddIntrinsic(mEther, "while:and:do:");
+        AddIntrinsic(mEther, "loop:");
+        AddIntrinsic(mEther, "from:to:do:");
+        AddIntrinsic(mEther, "from:to:step:do:");
+        AddIntrinsic(mBlockPrototype, "call");
+        AddIntrinsic(mBlockPrototype, "call:");
+        AddIntrinsic(mBlockPrototype, "true?");
+        AddIntrinsic(mTrue, "call");
+        
+        const Value * conditions[] = { &mTrue, &mFalse, &mNil };
+        for (int i = 0; i < 3; i++)
+        {
+            AddIntrinsic(*conditions[i], "if-true:else:");
+            AddIntrinsic(*conditions[i], "true?");
+            AddIntrinsic(*conditions[i], "and:");
+            AddIntrinsic(*conditions[i], "or:");
+        }
+        
+        // Force them to be checked again.
+        mIntrinsicsEpoch = NO_EPOCH;
+    }
+    
+    void Interpreter::AddIntrinsic(const Value & receiver, const char * message)
+    {
+        Intrinsic intrinsic;
+        intrinsic.receiver = receiver;
+        intrinsic.messageId = AddString(message);
+        
+        DynamicObject * start = DynamicObject::FindLookupStart(receiver);
+        if (start != NULL)
+        {
+            start->LookupMessage(intrinsic.messageId, &intrinsic.target);
+        }
+        
+        mIntrinsics.Add(intrinsic);
+    }
+    
+    void Interpreter::ValidateIntrinsics()
+    {
+        mIntrinsicsEpoch = mCacheEpochs.messages;
+        
+        // Nothing can be relied on until the core library has been loaded.
+        mIntrinsicsIntact = (mIntrinsics.Count() > 0) &&
+                            (GetGlobal(mEtherGlobal) == mEther);
+        
+        for (int i = 0; i < mIntrinsics.Count(); i++)
+        {
+            const Intrinsic & intrinsic = mIntrinsics[i];
+            
+            MessageTarget target;
+            DynamicObject * start = DynamicObject::FindLookupStart(intrinsic.receiver);
+            if (start != NULL)
+            {
+                start->LookupMessage(intrinsic.messageId, &target);
+            }
+            
+            if ((target.method != intrinsic.target.method) ||
+                (target.primitive != intrinsic.target.primitive))
+            {
+                mIntrinsicsIntact = false;
+                break;
+            }
+        }
+    }
+    
     void Interpreter::BindMethod(String objectName, String message,
                                  PrimitiveMethod method)
     {
@@ -236,6 +390,9 @@ namespace Finch
     void Interpreter::SetGlobal(int index, const Value & value)
     {
         mGlobals[index] = value;
+        
+        // Force the intrinsics to be checked again.
+        if (index == mEtherGlobal) mIntrinsicsEpoch = NO_EPOCH;
     }
     
     String Interpreter::FindGlobalName(int index)
@@ -249,7 +406,7 @@ namespace Finch
     
     Value Interpreter::NewObject(const Value & parent, String name)
     {
-        return Value(new DynamicObject(parent, name));
+        return mHeap.Add(new (mHeap) DynamicObject(parent, name, &mEmptyShape));
     }
     
     Value Interpreter::NewObject(const Value & parent)
@@ -259,27 +416,28 @@ namespace Finch
     
     Value Interpreter::NewNumber(double value)
     {
-        return Value(new NumberObject(mNumberPrototype, value));
+        return Value(value);
     }
     
     Value Interpreter::NewString(String value)
     {
-        return Value(new StringObject(mStringPrototype, value));
+        return mHeap.Add(new (mHeap) StringObject(mStringPrototype, value));
     }
     
     Value Interpreter::NewArray(int capacity)
     {
-        return Value(new ArrayObject(mArrayPrototype, capacity));
+        return mHeap.Add(new (mHeap) ArrayObject(mArrayPrototype, capacity));
     }
     
     Value Interpreter::NewBlock(Ref<Block> block, const Value & self)
     {
-        return Value(new BlockObject(mBlockPrototype, block, self));
+        return mHeap.Add(new (mHeap) BlockObject(mBlockPrototype, block, self));
     }
     
     Value Interpreter::NewFiber(const Value & block)
     {
-        return Value(new FiberObject(mFiberPrototype, *this, block));
+        return mHeap.Add(
+            new (mHeap) FiberObject(mFiberPrototype, *this, block));
     }
     
     Ref<Expr> Interpreter::Parse(ILineReader & reader)
@@ -295,7 +453,11 @@ namespace Finch
     Value Interpreter::MakeGlobal(const char * name)
     {
         int index = DefineGlobal(String(name));
-        Value global = NewObject(mObject, name);
+        
+        // The built-in objects are used directly by the interpreter even if
+        // their globals are reassigned, so they are never freed.
+        Value global = mHeap.AddPermanent(
+            new (mHeap) DynamicObject(mObject, name, &mEmptyShape));
         SetGlobal(index, global);
         return global;
     }
@@ -1,14 +1,19 @@
 #pragma once
 
 #include "Dictionary.h"
+#include "Heap.h"
 #include "Macros.h"
+#include "MessageCache.h"
 #include "Object.h"
+#include "Shape.h"
+#include "Stack.h"
 #include "StringTable.h"
 
 namespace Finch
 {
     class IInterpreterHost;
     class ILineReader;
+    struct FrameStats;
     //### bob: ideally, this stuff wouldn't be in the public api for Interpreter.
     class Object;
     class Fiber;
@@ -25,6 +30,17 @@ namespace Finch
         // in this interpreter.
         void Interpret(ILineReader & reader, bool showResult);
         
+        // Reads and executes the core library from the given source. Must be
+        // called once, before anything else is interpreted. Afterwards, the
+        // interpreter records what the core library defined the messages
+        // that the compiler specializes to be.
+        void LoadCoreLibrary(ILineReader & reader);
+        
+        // Reads from the given source and compiles it without executing it.
+        // Returns false if it failed to parse. If `stats` isn't NULL, adds
+        // the sizes of the compiled blocks' frames to it.
+        bool Compile(ILineReader & reader, FrameStats * stats = NULL);
+        
         //### bob: exposing the entire host here is a bit dirty.
         IInterpreterHost & GetHost() { return mHost; }
 
@@ -52,6 +68,32 @@ namespace Finch
         
         String FindGlobalName(int index);
         
+        // Finds the method or primitive bound to the given message, starting
+        // at the given object. Returns NULL if the message isn't handled.
+        const MessageTarget * LookupMessage(DynamicObject * start,
+                                            StringId messageId)
+        {
+            return mLookupCache.Lookup(start, messageId, mCacheEpochs.messages);
+        }
+        
+        // Gets the current epochs of this interpreter's caches.
+        const CacheEpochs & GetCacheEpochs() const { return mCacheEpochs; }
+        
+        // Returns true if enough objects have been allocated since the last
+        // garbage collection that it's time for another one.
+        bool ShouldCollectGarbage() const { return mHeap.ShouldCollect(); }
+        
+        // Frees every object that can't be reached from the globals, the
+        // built-in objects or the fibers that are running. Must only be
+        // called when nothing else is holding on to an object: see Heap.
+        void CollectGarbage();
+        
+        // Gets how the heap has allocated memory for objects so far.
+        const AllocationStats & GetAllocationStats() const
+        {
+            return mHeap.GetAllocationStats();
+        }
+        
         // Object constructors.
         Value NewObject(const Value & parent, String name);
         Value NewObject(const Value & parent);
@@ -66,14 +108,55 @@ namespace Finch
         const Value & True()  const { return mTrue; }
         const Value & False() const { return mFalse; }
         
+        // Returns true if every message that the compiler specializes (like
+        // adding two numbers) still resolves to what the core library defined
+        // it as. If not, specialized instructions must fall back to sending
+        // the message.
+        bool IntrinsicsIntact()
+        {
+            if (mIntrinsicsEpoch != mCacheEpochs.messages) ValidateIntrinsics();
+            return mIntrinsicsIntact;
+        }
+        
+        // Gets the object that numbers inherit from. Since numbers are stored
+        // directly in a Value, they don't have a parent of their own.
+        const Value & NumberPrototype() const { return mNumberPrototype; }
+        
     private:
+        // A message whose behavior specialized instructions rely on, and what
+        // it resolved to when sealed.
+        struct Intrinsic
+        {
+            Value         receiver;
+            StringId      messageId;
+            MessageTarget target;
+        };
+        
         Ref<Expr>   Parse(ILineReader & reader);
         
+        // Records what the messages that the compiler specializes resolve to
+        // once the core library has defined them.
+        void SealIntrinsics();
+        void AddIntrinsic(const Value & receiver, const char * message);
+        void ValidateIntrinsics();
+        
         Value MakeGlobal(const char * name);
         void AddPrimitive(const Value & object, String message,
                           PrimitiveMethod primitive);
         
         IInterpreterHost & mHost;
+        
+        // Counts how many times this interpreter's caches have been
+        // invalidated. Declared before the heap so that objects can still
+        // invalidate caches when they're freed.
+        CacheEpochs mCacheEpochs;
+        
+        // The root of the tree of object layouts. Declared before the heap so
+        // that it outlives the objects that use it.
+        Shape mEmptyShape;
+        
+        // Owns all of the objects.
+        Heap mHeap;
 
         StringTable mStrings;
         
@@ -82,12 +165,31 @@ namespace Finch
         // Maps global variable names to their indices. Used by the compiler.
         IdTable<int> mGlobalNames;
         
+        // Caches message lookups for sends that miss their inline cache.
+        LookupCache mLookupCache;
+        
+        Array<Intrinsic> mIntrinsics;
+        
+        // The fibers that are executing. A fiber can run code that starts
+        // another, like loading a file, so there may be more than one.
+        Stack<Value> mFibers;
+        
+        // The lookup epoch when the intrinsics were last validated, and
+        // whether or not they were intact then.
+        CacheEpoch mIntrinsicsEpoch;
+        bool       mIntrinsicsIntact;
+        
+        // Index of the global "Ether". Inlined control flow assumes that it
+        // still refers to mEther.
+        int mEtherGlobal;
+        
         Value mObject;
         Value mArrayPrototype;
         Value mBlockPrototype;
         Value mFiberPrototype;
         Value mNumberPrototype;
         Value mStringPrototype;
+        Value mEther;
         Value mNil;
         Value mTrue;
         Value mFalse;
@@ -5,6 +5,7 @@
 #include "Block.h"
 #include "DynamicObject.h"
 #include "FiberObject.h"
+#include "Heap.h"
 #include "IInterpreterHost.h"
 #include "Interpreter.h"
 #include "Fiber.h"
@@ -45,290 +46,604 @@ namespace Finch
 
     Value Fiber::Execute()
     {
+#ifdef COMPUTED_GOTO
+        // The address of the handler for each instruction, indexed by OpCode.
+        // This must be kept in sync with the OpCode enum.
+        static const void * dispatchTable[] = {
+            &&code_OP_CONSTANT,
+            &&code_OP_BLOCK,
+            &&code_OP_OBJECT,
+            &&code_OP_ARRAY,
+            &&code_OP_ARRAY_ELEMENT,
+            &&code_OP_MOVE,
+            &&code_OP_SELF,
+            &&code_OP_MESSAGE_0,
+            &&code_OP_MESSAGE_1,
+            &&code_OP_MESSAGE_2,
+            &&code_OP_MESSAGE_3,
+            &&code_OP_MESSAGE_4,
+            &&code_OP_MESSAGE_5,
+            &&code_OP_MESSAGE_6,
+            &&code_OP_MESSAGE_7,
+            &&code_OP_MESSAGE_8,
+            &&code_OP_MESSAGE_9,
+            &&code_OP_MESSAGE_10,
+            &&code_OP_TAIL_MESSAGE_0,
+            &&code_OP_TAIL_MESSAGE_1,
+            &&code_OP_TAIL_MESSAGE_2,
+            &&code_OP_TAIL_MESSAGE_3,
+            &&code_OP_TAIL_MESSAGE_4,
+            &&code_OP_TAIL_MESSAGE_5,
+            &&code_OP_TAIL_MESSAGE_6,
+            &&code_OP_TAIL_MESSAGE_7,
+            &&code_OP_TAIL_MESSAGE_8,
+            &&code_OP_TAIL_MESSAGE_9,
+            &&code_OP_TAIL_MESSAGE_10,
+            &&code_OP_ADD,
+            &&code_OP_SUBTRACT,
+            &&code_OP_MULTIPLY,
+            &&code_OP_DIVIDE,
+            &&code_OP_EQUAL,
+            &&code_OP_NOT_EQUAL,
+            &&code_OP_LESS,
+            &&code_OP_GREATER,
+            &&code_OP_LESS_EQUAL,
+            &&code_OP_GREATER_EQUAL,
+            &&code_OP_GET_UPVALUE,
+            &&code_OP_SET_UPVALUE,
+            &&code_OP_GET_CAPTURED,
+            &&code_OP_GET_FIELD,
+            &&code_OP_SET_FIELD,
+            &&code_OP_GET_GLOBAL,
+            &&code_OP_SET_GLOBAL,
+            &&code_OP_DEF_METHOD,
+            &&code_OP_DEF_FIELD,
+            &&code_OP_DEF_METHODS,
+            &&code_OP_JUMP,
+            &&code_OP_LOOP,
+            &&code_OP_JUMP_IF_REDEFINED,
+            &&code_OP_JUMP_IF_FALSE,
+            &&code_OP_CLOSE_UPVALUES,
+            &&code_OP_END,
+            &&code_OP_RETURN,
+            &&code_UNKNOWN, // OP_CAPTURE_LOCAL
+            &&code_UNKNOWN, // OP_CAPTURE_UPVALUE
+            &&code_UNKNOWN, // OP_COPY_LOCAL
+            &&code_UNKNOWN, // OP_COPY_CAPTURED
+            &&code_UNKNOWN  // OP_WIDE
+        };
+
+        // Jumps straight to the handler for the next instruction.
+        #define DISPATCH()                                                  \
+            do                                                              \
+            {                                                               \
+                instruction = &frame->code[frame->ip++];                    \
+                TRACE_INSTRUCTION(*instruction);                            \
+                goto *instruction->handler;                                 \
+            }                                                               \
+            while (false)
+
+        #define INTERPRET       DISPATCH();
+        #define CASE_CODE(name) code_##name
+        #define HANDLERS        dispatchTable
+#else
+        #define DISPATCH()      goto loop
+
+        #define INTERPRET                                                   \
+            loop:                                                           \
+                instruction = &frame->code[frame->ip++];                    \
+                TRACE_INSTRUCTION(*instruction);                            \
+                switch (instruction->op)
+
+        #define CASE_CODE(name) case name
+        #define HANDLERS        NULL
+#endif
+
+        // Sends the message for the current instruction, which must have the
+        // same operands as OP_MESSAGE_n, and continues with the next one. A
+        // non-null result means the message was handled by a primitive that
+        // immediately calculated the result. Otherwise it's a normal method
+        // which will push a new callframe. When that method returns, it will
+        // handle setting the result on the caller.
+        #define SEND_MESSAGE(numArgs)                                       \
+            do                                                              \
+            {                                                               \
+                COLLECT_GARBAGE();                                          \
+                                                                            \
+                Value result = SendMessage(instruction->a, instruction->b,  \
+                                           numArgs, *instruction->cache);   \
+                                                                            \
+                if (!result.IsNull())                                       \
+                {                                                           \
+                    Store(*frame, instruction->c, result);                  \
+                }                                                           \
+                                                                            \
+                /* A primitive may have paused the fiber. */                \
+                if (!mIsRunning) return Value();                            \
+                                                                            \
+                LOAD_FRAME();                                               \
+                DISPATCH();                                                 \
+            }                                                               \
+            while (false)
+        
+        // Executes a binary operator directly if both operands are numbers
+        // and the core library's operators are intact. Otherwise, sends it as
+        // a message. Within `result`, `left` and `right` are the operands.
+        #define NUMBER_OPERATOR(op, result)                                 \
+            CASE_CODE(op):                                                  \
+            {                                                               \
+                const Value & leftValue = mStack[frame->stackStart +        \
+                                                 instruction->b];           \
+                const Value & rightValue = mStack[frame->stackStart +       \
+                                                  instruction->b + 1];      \
+                                                                            \
+                if (leftValue.IsNumber() && rightValue.IsNumber() &&        \
+                    mInterpreter.IntrinsicsIntact())                        \
+                {                                                           \
+                    double left = leftValue.AsNumber();                     \
+                    double right = rightValue.AsNumber();                   \
+                    Store(*frame, instruction->c, result);                  \
+                    DISPATCH();                                             \
+                }                                                           \
+                                                                            \
+                SEND_MESSAGE(1);                                            \
+            }
+        
+        // Collects garbage if enough objects have been allocated since the
+        // last collection. This is only done before sending a message or
+        // looping back, where every value the fiber is using is in its
+        // registers and not in a local variable here that the collector
+        // can't see.
+        #define COLLECT_GARBAGE()                                           \
+            do                                                              \
+            {                                                               \
+                if (mInterpreter.ShouldCollectGarbage())                    \
+                {                                                           \
+                    mInterpreter.CollectGarbage();                          \
+                }                                                           \
+            }                                                               \
+            while (false)
+        
+        // Caches a pointer to the frame on top of the callstack, decoding its
+        // block if this is the first time it's been run. This must be done
+        // after anything that can push or pop a callframe.
+        #define LOAD_FRAME()                                                \
+            do                                                              \
+            {                                                               \
+                frame = &mCallFrames.Peek();                                \
+                if (frame->code == NULL)                                    \
+                {                                                           \
+                    frame->code = frame->Block().Decode(HANDLERS);          \
+                }                                                           \
+            }                                                               \
+            while (false)
+
         mIsRunning = true;
 
+        CallFrame * frame;
+        const DecodedInstruction * instruction;
+
+        LOAD_FRAME();
+
         // Continue processing bytecode until the entire callstack has returned
         // or we pause and switch to another fiber.
-        while (mIsRunning)
+        INTERPRET
         {
-            CallFrame & frame = mCallFrames.Peek();
+            CASE_CODE(OP_CONSTANT):
+                Store(*frame, instruction->b,
+                      frame->Block().GetConstant(instruction->a));
+                DISPATCH();
 
-            // Read and decode the next instruction.
-            Instruction instruction = frame.Block().Code()[frame.ip++];
-            OpCode op = DECODE_OP(instruction);
-            int a = DECODE_A(instruction);
-            int b = DECODE_B(instruction);
-            int c = DECODE_C(instruction);
-
-            TRACE_INSTRUCTION(instruction);
-
-            switch (op)
+            CASE_CODE(OP_OBJECT):
             {
-                case OP_CONSTANT:
-                    Store(frame, b, frame.Block().GetConstant(a));
-                    break;
+                // The parent is already in the register that the child
+                // will be placed into.
+                const Value & parent = Load(*frame, instruction->a);
+                Value object = mInterpreter.NewObject(parent);
+                Store(*frame, instruction->a, object);
+                DISPATCH();
+            }
 
-                case OP_OBJECT:
-                {
-                    // The parent is already in the register that the child
-                    // will be placed into.
-                    const Value & parent = Load(frame, a);
-                    Value object = mInterpreter.NewObject(parent);
-                    Store(frame, a, object);
-                    break;
-                }
+            CASE_CODE(OP_BLOCK):
+            {
+                // Create a new block object from the block.
+                Ref<Block> block = frame->Block().GetBlock(instruction->a);
+                Value blockObj = mInterpreter.NewBlock(block, Self());
+                BlockObject * blockPtr = blockObj.AsBlock();
 
-                case OP_BLOCK:
+                // Capture upvalues.
+                for (int i = 0; i < block->NumUpvalues(); i++)
                 {
-                    // Create a new block object from the block.
-                    Ref<Block> block = frame.Block().GetBlock(a);
-                    Value blockObj = mInterpreter.NewBlock(block, Self());
-                    BlockObject * blockPtr = blockObj.AsBlock();
+                    const DecodedInstruction & capture = frame->code[frame->ip++];
 
-                    // Capture upvalues.
-                    for (int i = 0; i < block->NumUpvalues(); i++)
+                    switch (capture.op)
                     {
-                        Instruction capture = frame.Block().Code()[frame.ip++];
-                        OpCode captureOp = DECODE_OP(capture);
-                        int captureIndex = DECODE_A(capture);
-
-                        switch (captureOp)
-                        {
-                            case OP_CAPTURE_LOCAL:
-                                blockPtr->AddUpvalue(CaptureUpvalue(
-                                    frame.stackStart + captureIndex));
-                                break;
-
-                            case OP_CAPTURE_UPVALUE:
-                                blockPtr->AddUpvalue(frame.Block().GetUpvalue(captureIndex));
-                                break;
-
-                            default:
-                                ASSERT(false, "Unexpected capture pseudo-op.");
-                        }
-                    }
+                        case OP_CAPTURE_LOCAL:
+                            blockPtr->AddUpvalue(CaptureUpvalue(
+                                frame->stackStart + capture.a));
+                            break;
+
+                        case OP_CAPTURE_UPVALUE:
+                            blockPtr->AddUpvalue(frame->Block().GetUpvalue(capture.a));
+                            break;
+
+                        case OP_COPY_LOCAL:
+                            blockPtr->AddCapturedValue(Load(*frame, capture.a));
+                            break;
+
+                        case OP_COPY_CAPTURED:
+                            blockPtr->AddCapturedValue(
+                                frame->Block().GetCapturedValue(capture.a));
+                            break;
 
-                    Store(frame, b, blockObj);
-                    break;
+                        default:
+                            ASSERT(false, "Unexpected capture pseudo-op.");
+                    }
                 }
 
-                case OP_ARRAY:
+                Store(*frame, instruction->b, blockObj);
+                DISPATCH();
+            }
+
+            CASE_CODE(OP_ARRAY):
+            {
+                // Create the empty array with enough capacity. Subsequent
+                // OP_ARRAY_ELEMENT instructions will fill it.
+                Value array = mInterpreter.NewArray(instruction->a);
+                Store(*frame, instruction->b, array);
+                DISPATCH();
+            }
+
+            CASE_CODE(OP_ARRAY_ELEMENT):
+            {
+                // Add the item to the array.
+                const Value & element = Load(*frame, instruction->a);
+                Value array = Load(*frame, instruction->b);
+                array.AsArray()->Elements().Add(element);
+                DISPATCH();
+            }
+
+            CASE_CODE(OP_MOVE):
+                Store(*frame, instruction->b, Load(*frame, instruction->a));
+                DISPATCH();
+
+            CASE_CODE(OP_SELF):
+                Store(*frame, instruction->a, Self());
+                DISPATCH();
+
+            CASE_CODE(OP_MESSAGE_0):
+            CASE_CODE(OP_MESSAGE_1):
+            CASE_CODE(OP_MESSAGE_2):
+            CASE_CODE(OP_MESSAGE_3):
+            CASE_CODE(OP_MESSAGE_4):
+            CASE_CODE(OP_MESSAGE_5):
+            CASE_CODE(OP_MESSAGE_6):
+            CASE_CODE(OP_MESSAGE_7):
+            CASE_CODE(OP_MESSAGE_8):
+            CASE_CODE(OP_MESSAGE_9):
+            CASE_CODE(OP_MESSAGE_10):
+                SEND_MESSAGE(instruction->op - OP_MESSAGE_0);
+
+            CASE_CODE(OP_TAIL_MESSAGE_0):
+            CASE_CODE(OP_TAIL_MESSAGE_1):
+            CASE_CODE(OP_TAIL_MESSAGE_2):
+            CASE_CODE(OP_TAIL_MESSAGE_3):
+            CASE_CODE(OP_TAIL_MESSAGE_4):
+            CASE_CODE(OP_TAIL_MESSAGE_5):
+            CASE_CODE(OP_TAIL_MESSAGE_6):
+            CASE_CODE(OP_TAIL_MESSAGE_7):
+            CASE_CODE(OP_TAIL_MESSAGE_8):
+            CASE_CODE(OP_TAIL_MESSAGE_9):
+            CASE_CODE(OP_TAIL_MESSAGE_10):
+            {
+                COLLECT_GARBAGE();
+                
+                int numArgs = instruction->op - OP_TAIL_MESSAGE_0;
+                int numFrames = mCallFrames.Count();
+
+                Value result = SendMessage(instruction->a, instruction->b,
+                                           numArgs, *instruction->cache);
+
+                if (!result.IsNull())
                 {
-                    // Create the empty array with enough capacity. Subsequent
-                    // OP_ARRAY_ELEMENT instructions will fill it.
-                    Value array = mInterpreter.NewArray(a);
-                    Store(frame, b, array);
-                    break;
+                    // Handled by a primitive, so there's no frame to
+                    // reuse. The following OP_END will return the result.
+                    Store(*frame, instruction->c, result);
                 }
-
-                case OP_ARRAY_ELEMENT:
+                else if (mCallFrames.Count() > numFrames)
                 {
-                    // Add the item to the array.
-                    const Value & element = Load(frame, a);
-                    Value array = Load(frame, b);
-                    array.AsArray()->Elements().Add(element);
-                    break;
+                    TailCall();
                 }
 
-                case OP_MOVE:
-                    //cout << "MOVE     " << a << " -> " << b << endl;
-                    Store(frame, b, Load(frame, a));
-                    break;
-
-                case OP_SELF:
-                    Store(frame, a, Self());
-                    break;
-
-                case OP_MESSAGE_0:
-                case OP_MESSAGE_1:
-                case OP_MESSAGE_2:
-                case OP_MESSAGE_3:
-                case OP_MESSAGE_4:
-                case OP_MESSAGE_5:
-                case OP_MESSAGE_6:
-                case OP_MESSAGE_7:
-                case OP_MESSAGE_8:
-                case OP_MESSAGE_9:
-                case OP_MESSAGE_10:
+                // A primitive may have paused the fiber.
+                if (!mIsRunning) return Value();
+
+                LOAD_FRAME();
+                DISPATCH();
+            }
+
+            NUMBER_OPERATOR(OP_ADD,           Value(left + right))
+            NUMBER_OPERATOR(OP_SUBTRACT,      Value(left - right))
+            NUMBER_OPERATOR(OP_MULTIPLY,      Value(left * right))
+            NUMBER_OPERATOR(OP_DIVIDE,        (right == 0) ? Nil() : Value(left / right))
+            NUMBER_OPERATOR(OP_EQUAL,         CreateBool(left == right))
+            NUMBER_OPERATOR(OP_NOT_EQUAL,     CreateBool(left != right))
+            NUMBER_OPERATOR(OP_LESS,          CreateBool(left < right))
+            NUMBER_OPERATOR(OP_GREATER,       CreateBool(left > right))
+            NUMBER_OPERATOR(OP_LESS_EQUAL,    CreateBool(left <= right))
+            NUMBER_OPERATOR(OP_GREATER_EQUAL, CreateBool(left >= right))
+
+            CASE_CODE(OP_GET_UPVALUE):
+            {
+                Ref<Upvalue> upvalue = frame->Block().GetUpvalue(instruction->a);
+                Store(*frame, instruction->b, upvalue->Get(mStack));
+                DISPATCH();
+            }
+
+            CASE_CODE(OP_SET_UPVALUE):
+            {
+                Ref<Upvalue> upvalue = frame->Block().GetUpvalue(instruction->a);
+                upvalue->Set(mStack, Load(*frame, instruction->b));
+                DISPATCH();
+            }
+
+            CASE_CODE(OP_GET_CAPTURED):
+            {
+                Store(*frame, instruction->b,
+                      frame->Block().GetCapturedValue(instruction->a));
+                DISPATCH();
+            }
+
+            CASE_CODE(OP_GET_FIELD):
+            {
+                // Only dynamic objects have fields.
+                DynamicObject * object = Self().AsDynamic();
+                Value field;
+                if (object != NULL)
                 {
-                    //String name = GetEnvironment().Strings().Find(a);
-                    //cout << "MESSAGE  " << name << " " << b << " -> " << c << endl;
-                    int numArgs = op - OP_MESSAGE_0;
-
-                    Value result = SendMessage(a, b, numArgs);
-
-                    // A non-null result means the message was handled by a
-                    // primitive that immediately calculated the result.
-                    // Otherwise it's a normal method which will push a new
-                    // callframe. When that method returns, it will handle
-                    // setting the result on the caller.
-                    if (!result.IsNull())
-                    {
-                        Store(frame, c, result);
-                    }
-                    break;
+                    field = object->GetField(instruction->a,
+                                             *instruction->fieldCache);
                 }
-
-                case OP_GET_UPVALUE:
+                
+                // TODO(bob): Just make a null Value equivalent to nil.
+                if (!field.IsNull())
                 {
-                    Ref<Upvalue> upvalue = frame.Block().GetUpvalue(a);
-                    Store(frame, b, upvalue->Get(mStack));
-                    break;
+                    Store(*frame, instruction->b, field);
                 }
-
-                case OP_SET_UPVALUE:
+                else
                 {
-                    Ref<Upvalue> upvalue = frame.Block().GetUpvalue(a);
-                    upvalue->Set(mStack, Load(frame, b));
-                    break;
+                    // TODO(bob): Should this be an error instead?
+                    Store(*frame, instruction->b, Nil());
                 }
+                DISPATCH();
+            }
 
-                case OP_GET_FIELD:
+            CASE_CODE(OP_SET_FIELD):
+            {
+                DynamicObject * object = Self().AsDynamic();
+                if (object != NULL)
                 {
-                    Value field = Self().GetField(a);
-                    // TODO(bob): Just make a null Value equivalent to nil.
-                    if (!field.IsNull())
-                    {
-                        Store(frame, b, field);
-                    }
-                    else
-                    {
-                        // TODO(bob): Should this be an error instead?
-                        Store(frame, b, Nil());
-                    }
-                    break;
+                    object->SetField(instruction->a, Load(*frame, instruction->b),
+                                     *instruction->fieldCache);
                 }
+                DISPATCH();
+            }
 
-                case OP_SET_FIELD:
+            CASE_CODE(OP_GET_GLOBAL):
+            {
+                const Value & value = mInterpreter.GetGlobal(instruction->a);
+
+                if (!value.IsNull())
                 {
-                    Self().SetField(a, Load(frame, b));
-                    break;
+                    Store(*frame, instruction->b, value);
                 }
-
-                case OP_GET_GLOBAL:
+                else
                 {
-                    const Value & value = mInterpreter.GetGlobal(a);
+                    String name = mInterpreter.FindGlobalName(instruction->a);
+                    Error(String::Format(
+                                         "Trying to access undefined global '%s'.",
+                                         name.CString()));
+                    Store(*frame, instruction->b, mInterpreter.Nil());
+                }
+                DISPATCH();
+            }
 
-                    if (!value.IsNull())
-                    {
-                        Store(frame, b, value);
-                    }
-                    else
+            CASE_CODE(OP_SET_GLOBAL):
+                mInterpreter.SetGlobal(instruction->a,
+                                       Load(*frame, instruction->b));
+                DISPATCH();
+
+            CASE_CODE(OP_DEF_METHOD):
+            {
+                // Get the object we're attaching the method to.
+                DynamicObject * object = Load(*frame, instruction->c).AsDynamic();
+                // TODO(bob): What should this do if you try to bind a
+                // method to something non-dynamic?
+                ASSERT_NOT_NULL(object);
+
+                object->AddMethod(instruction->a, Load(*frame, instruction->b));
+                DISPATCH();
+            }
+
+            CASE_CODE(OP_DEF_FIELD):
+            {
+                // Get the object we're attaching the field to.
+                DynamicObject * object = Load(*frame, instruction->c).AsDynamic();
+                // TODO(bob): What should this do if you try to bind a
+                // field to something non-dynamic?
+                ASSERT_NOT_NULL(object);
+
+                object->SetField(instruction->a, Load(*frame, instruction->b));
+                DISPATCH();
+            }
+
+            CASE_CODE(OP_DEF_METHODS):
+            {
+                // Get the object we're attaching the methods to.
+                DynamicObject * object = Load(*frame, instruction->c).AsDynamic();
+                ASSERT_NOT_NULL(object);
+
+                SharedMethods & methods =
+                    frame->Block().GetSharedMethods(instruction->a);
+
+                if (methods.table.IsNull())
+                {
+                    // This is the first time this code has run, so create the
+                    // methods. A method is always called with its receiver as
+                    // self, so it doesn't need to capture one.
+                    methods.table = Ref<MethodTable>(new MethodTable());
+                    for (int i = 0; i < methods.names.Count(); i++)
                     {
-                        String name = mInterpreter.FindGlobalName(a);
-                        Error(String::Format(
-                                             "Trying to access undefined global '%s'.",
-                                             name.CString()));
-                        Store(frame, b, mInterpreter.Nil());
+                        Ref<Block> block = frame->Block().GetBlock(methods.blocks[i]);
+                        MessageTarget target;
+                        target.method = mInterpreter.NewBlock(block, Nil());
+                        methods.table->Insert(methods.names[i], target);
                     }
-                    break;
                 }
 
-                case OP_SET_GLOBAL:
-                {
-                    mInterpreter.SetGlobal(a, Load(frame, b));
-                    break;
-                }
+                object->BindMethods(methods.table);
+                DISPATCH();
+            }
 
-                case OP_DEF_METHOD:
-                {
-                    // Get the object we're attaching the method to.
-                    DynamicObject * object = Load(frame, c).AsDynamic();
-                    // TODO(bob): What should this do if you try to bind a
-                    // method to something non-dynamic?
-                    ASSERT_NOT_NULL(object);
-
-                    object->AddMethod(a, Load(frame, b));
-                    break;
-                }
+            CASE_CODE(OP_JUMP):
+                frame->ip += (instruction->b << 8) | instruction->c;
+                DISPATCH();
+
+            CASE_CODE(OP_LOOP):
+                COLLECT_GARBAGE();
+                frame->ip -= (instruction->b << 8) | instruction->c;
+                DISPATCH();
 
-                case OP_DEF_FIELD:
+            CASE_CODE(OP_JUMP_IF_REDEFINED):
+                if (!mInterpreter.IntrinsicsIntact())
                 {
-                    // Get the object we're attaching the field to.
-                    DynamicObject * object = Load(frame, c).AsDynamic();
-                    // TODO(bob): What should this do if you try to bind a
-                    // field to something non-dynamic?
-                    ASSERT_NOT_NULL(object);
-
-                    object->SetField(a, Load(frame, b));
-                    break;
+                    frame->ip += (instruction->b << 8) | instruction->c;
                 }
+                DISPATCH();
 
-                case OP_END:
-                {
-                    const Value & result = Load(frame, a);
-                    PopCallFrame();
+            CASE_CODE(OP_JUMP_IF_FALSE):
+            {
+                const Value & condition = mStack[frame->stackStart +
+                                                 instruction->a];
 
-                    if (mCallFrames.Count() > 0)
+                if (mInterpreter.IntrinsicsIntact())
+                {
+                    if (condition == mInterpreter.True())
                     {
-                        StoreMessageResult(result);
+                        // Skip the jump to the fallback code.
+                        frame->ip++;
+                        DISPATCH();
                     }
-                    else
+
+                    if ((condition == mInterpreter.False()) ||
+                        (condition == mInterpreter.Nil()))
                     {
-                        // The fiber has completely unwound, so return the
-                        // final result value.
-                        TRACE_STACK();
-                        return result;
+                        frame->ip += (instruction->b << 8) | instruction->c;
+                        DISPATCH();
                     }
-                    break;
                 }
 
-                case OP_RETURN:
+                // We don't know what the condition will do, so fall through
+                // to the jump to the code that sends the message normally.
+                DISPATCH();
+            }
+
+            CASE_CODE(OP_CLOSE_UPVALUES):
+                CloseUpvalues(frame->stackStart + instruction->a);
+                DISPATCH();
+
+            CASE_CODE(OP_END):
+            {
+                // Copy the result since popping the frame may clear its
+                // register.
+                Value result = Load(*frame, instruction->a);
+                PopCallFrame();
+
+                if (mCallFrames.Count() > 0)
+                {
+                    StoreMessageResult(result);
+                }
+                else
                 {
-                    int methodId = a;
+                    // The fiber has completely unwound, so return the
+                    // final result value.
+                    TRACE_STACK();
+                    return result;
+                }
 
-                    const Value & result = Load(frame, b);
+                LOAD_FRAME();
+                DISPATCH();
+            }
 
-                    // Find the enclosing method on the callstack.
-                    int methodFrame;
-                    for (methodFrame = 0; methodFrame < mCallFrames.Count(); methodFrame++)
-                    {
-                        if (mCallFrames[methodFrame].Block().MethodId() == methodId)
-                        {
-                            // Found it.
-                            break;
-                        }
-                    }
+            CASE_CODE(OP_RETURN):
+            {
+                int methodId = instruction->a;
 
-                    if (methodFrame == mCallFrames.Count())
-                    {
-                        Error("Cannot return from a block whose enclosing method has already returned.");
-                        // Unwind the whole stack.
-                        methodFrame = mCallFrames.Count() - 1;
-                    }
+                // Copy the result since popping the frames may clear its
+                // register.
+                Value result = Load(*frame, instruction->b);
 
-                    // Unwind until we reach the method.
-                    while (methodFrame >= 0)
+                // Find the enclosing method on the callstack.
+                int methodFrame;
+                for (methodFrame = 0; methodFrame < mCallFrames.Count(); methodFrame++)
+                {
+                    if (mCallFrames[methodFrame].Block().MethodId() == methodId)
                     {
-                        PopCallFrame();
-                        methodFrame--;
+                        // Found it.
+                        break;
                     }
+                }
 
-                    if (mCallFrames.Count() > 0)
-                    {
-                        StoreMessageResult(result);
-                    }
-                    else
-                    {
-                        // If we unwound everything, end the fiber.
-                        TRACE_STACK();
-                        return result;
-                    }
-                    break;
+                if (methodFrame == mCallFrames.Count())
+                {
+                    Error("Cannot return from a block whose enclosing method has already returned.");
+                    // Unwind the whole stack.
+                    methodFrame = mCallFrames.Count() - 1;
+                }
+
+                // Unwind until we reach the method.
+                while (methodFrame >= 0)
+                {
+                    PopCallFrame();
+                    methodFrame--;
+                }
+
+                if (mCallFrames.Count() > 0)
+                {
+                    StoreMessageResult(result);
+                }
+                else
+                {
+                    // If we unwound everything, end the fiber.
+                    TRACE_STACK();
+                    return result;
                 }
 
-                default:
-                    std::cout << op << std::endl;
-                    ASSERT(false, "Unknown opcode.");
+                LOAD_FRAME();
+                DISPATCH();
             }
 
-            TRACE_STACK();
+#ifdef COMPUTED_GOTO
+            code_UNKNOWN:
+#else
+            default:
+#endif
+                std::cout << instruction->op << std::endl;
+                ASSERT(false, "Unknown opcode.");
+                return Value();
         }
 
-        return Value();
+        #undef DISPATCH
+        #undef INTERPRET
+        #undef SEND_MESSAGE
+        #undef NUMBER_OPERATOR
+        #undef CASE_CODE
+        #undef HANDLERS
+        #undef LOAD_FRAME
+        #undef COLLECT_GARBAGE
     }
 
-    Value Fiber::Load(const CallFrame & frame, int reg)
+    const Value & Fiber::Load(const CallFrame & frame, int reg)
     {
         return mStack[frame.stackStart + reg];
     }
@@ -341,6 +656,7 @@ namespace Finch
     void Fiber::PopCallFrame()
     {
         CallFrame & frame = mCallFrames.Peek();
+        int frameStart = frame.stackStart;
         int oldStackSize = frame.stackStart + frame.Block().NumRegisters();
         mCallFrames.Pop();
 
@@ -352,15 +668,10 @@ namespace Finch
             newStackSize = caller.stackStart + caller.Block().NumRegisters();
         }
 
-        // Close any open upvalues that are being popped off
-        // the stack.
-        while (!mOpenUpvalues.IsNull())
-        {
-            if (mOpenUpvalues->Index() < newStackSize) break;
-
-            mOpenUpvalues->Close(mStack);
-            mOpenUpvalues = mOpenUpvalues->Next();
-        }
+        // Close any open upvalues for the popped frame's registers. Note that
+        // this starts at the beginning of the frame and not the end of the
+        // caller's: the callee's parameters overlap the caller's registers.
+        CloseUpvalues(frameStart);
 
         // Clear any discarded registers on the stack. Note that we don't
         // actually truncate the stack here. This is important because we may
@@ -387,26 +698,104 @@ namespace Finch
         }
     }
 
+    void Fiber::TailCall()
+    {
+        CallFrame & callee = mCallFrames[0];
+        CallFrame & caller = mCallFrames[1];
+        
+        int start = caller.stackStart;
+        int numParams = callee.Block().NumParams();
+        
+        // The caller's registers are going away, so close any upvalues that
+        // refer to them. The callee hasn't run yet, so it can't have any.
+        CloseUpvalues(start);
+        
+        // Slide the arguments down to the start of the caller's window. The
+        // callee's window always starts after the caller's, so copying in
+        // order won't overwrite an argument before it's moved.
+        for (int i = 0; i < numParams; i++)
+        {
+            mStack[start + i] = mStack[callee.stackStart + i];
+        }
+        
+        // The rest of the registers the two frames were using are left as
+        // they are. Like a normal call, the callee never reads a register
+        // before writing it, and the collector doesn't care whether what it
+        // finds there is stale.
+        
+        // Reuse the caller's frame for the callee.
+        caller.ip = 0;
+        caller.receiver = callee.receiver;
+        caller.block = callee.block;
+        caller.code = callee.code;
+        mCallFrames.Pop();
+    }
+    
+    void Fiber::CloseUpvalues(int stackIndex)
+    {
+        // The list is sorted from the top of the stack down.
+        while (!mOpenUpvalues.IsNull())
+        {
+            if (mOpenUpvalues->Index() < stackIndex) break;
+            
+            mOpenUpvalues->Close(mStack);
+            mOpenUpvalues = mOpenUpvalues->Next();
+        }
+    }
+    
     void Fiber::StoreMessageResult(const Value & result)
     {
         // Store the result back in the caller's dest register.
         CallFrame & caller = mCallFrames.Peek();
-        Instruction instruction = caller.Block().Code()[caller.ip - 1];
+        const DecodedInstruction & instruction = caller.code[caller.ip - 1];
 
-        ASSERT((DECODE_OP(instruction) >= OP_MESSAGE_0) &&
-               (DECODE_OP(instruction) <= OP_MESSAGE_10),
+        ASSERT(IsMessageOp(instruction.op),
                "Should be returning to a message instruction.");
 
-        int dest = instruction & 0x000000ff; // c
-        Store(caller, dest, result);
+        Store(caller, instruction.c, result);
     }
 
-    Value Fiber::SendMessage(StringId messageId, int receiverReg, int numArgs)
+    Value Fiber::SendMessage(StringId messageId, int receiverReg, int numArgs,
+                             MessageCache & cache)
     {
-        const Value & self = Load(mCallFrames.Peek(), receiverReg);
+        // Copy the receiver out of its register, since calling a method can
+        // grow the stack and move the registers.
+        Value self = Load(mCallFrames.Peek(), receiverReg);
         ArgReader args(mStack, mCallFrames.Peek().stackStart + receiverReg + 1,
                        numArgs);
-        return self.SendMessage(*this, messageId, args);
+        
+        DynamicObject * start = DynamicObject::FindLookupStart(
+            self.IsNumber() ? mInterpreter.NumberPrototype() : self);
+        CacheEpoch epoch = mInterpreter.GetCacheEpochs().messages;
+        const MessageTarget * target = cache.Find(start, epoch);
+        
+        // If this send hasn't cached it, fall back to the interpreter.
+        if ((target == NULL) && (start != NULL))
+        {
+            target = mInterpreter.LookupMessage(start, messageId);
+            if (target != NULL) cache.Add(start, *target, epoch);
+        }
+        
+        if (target != NULL)
+        {
+            if (!target->method.IsNull())
+            {
+                CallBlock(self, target->method, args);
+                return Value();
+            }
+            
+            return target->primitive(*this, self, args);
+        }
+        
+        // If we got here, the object didn't handle the message.
+        String messageName = mInterpreter.FindString(messageId);
+        String error = String::Format("Object '%s' did not handle message '%s'",
+                                      self.AsString().CString(),
+                                      messageName.CString());
+        Error(error);
+        
+        // Unhandled messages just return nil.
+        return Nil();
     }
 
     const Value & Fiber::Self()
@@ -464,6 +853,20 @@ namespace Finch
         return mCallFrames.Count();
     }
 
+    void Fiber::MarkReferences(Heap & heap)
+    {
+        for (int i = 0; i < mStack.Count(); i++)
+        {
+            heap.Mark(mStack[i]);
+        }
+        
+        for (int i = 0; i < mCallFrames.Count(); i++)
+        {
+            heap.Mark(mCallFrames[i].receiver);
+            heap.Mark(mCallFrames[i].block);
+        }
+    }
+
     Ref<Upvalue> Fiber::CaptureUpvalue(int stackIndex)
     {
         // If there are no open upvalues at all, we must need a new one.
@@ -510,14 +913,14 @@ namespace Finch
     }
 
 #ifdef TRACE_INSTRUCTIONS
-    void Fiber::TraceInstruction(Instruction instruction)
+    void Fiber::TraceInstruction(const DecodedInstruction & instruction)
     {
         using namespace std;
 
-        OpCode op = DECODE_OP(instruction);
-        int a = DECODE_A(instruction);
-        int b = DECODE_B(instruction);
-        int c = DECODE_C(instruction);
+        OpCode op = instruction.op;
+        int a = instruction.a;
+        int b = instruction.b;
+        int c = instruction.c;
 
         String opName;
         String action;
@@ -571,7 +974,42 @@ namespace Finch
             case OP_MESSAGE_10:
             {
                 opName = String::Format("MESSAGE_%d", op - OP_MESSAGE_0);
-                String name = GetEnvironment().Strings().Find(a);
+                String name = mInterpreter.FindString(a);
+                action = String::Format("'%s' %d -> %d", name.CString(), b, c);
+                break;
+            }
+
+            case OP_TAIL_MESSAGE_0:
+            case OP_TAIL_MESSAGE_1:
+            case OP_TAIL_MESSAGE_2:
+            case OP_TAIL_MESSAGE_3:
+            case OP_TAIL_MESSAGE_4:
+            case OP_TAIL_MESSAGE_5:
+            case OP_TAIL_MESSAGE_6:
+            case OP_TAIL_MESSAGE_7:
+            case OP_TAIL_MESSAGE_8:
+            case OP_TAIL_MESSAGE_9:
+            case OP_TAIL_MESSAGE_10:
+            {
+                opName = String::Format("TAIL_MESSAGE_%d", op - OP_TAIL_MESSAGE_0);
+                String name = mInterpreter.FindString(a);
+                action = String::Format("'%s' %d -> %d", name.CString(), b, c);
+                break;
+            }
+
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+            case OP_EQUAL:
+            case OP_NOT_EQUAL:
+            case OP_LESS:
+            case OP_GREATER:
+            case OP_LESS_EQUAL:
+            case OP_GREATER_EQUAL:
+            {
+                opName = "OPERATOR";
+                String name = mInterpreter.FindString(a);
                 action = String::Format("'%s' %d -> %d", name.CString(), b, c);
                 break;
             }
@@ -586,10 +1024,15 @@ namespace Finch
                 action = String::Format("u%d <- %d", a, b);
                 break;
 
+            case OP_GET_CAPTURED:
+                opName = "GET_CAPTURED";
+                action = String::Format("c%d -> %d", a, b);
+                break;
+
             case OP_GET_FIELD:
             {
                 opName = "GET_FIELD";
-                String name = GetEnvironment().Strings().Find(a);
+                String name = mInterpreter.FindString(a);
                 action = String::Format("'%s' -> %d", name.CString(), b);
                 break;
             }
@@ -597,7 +1040,7 @@ namespace Finch
             case OP_SET_FIELD:
             {
                 opName = "SET_FIELD";
-                String name = GetEnvironment().Strings().Find(a);
+                String name = mInterpreter.FindString(a);
                 action = String::Format("'%s' <- %d", name.CString(), b);
                 break;
             }
@@ -605,7 +1048,7 @@ namespace Finch
             case OP_GET_GLOBAL:
             {
                 opName = "GET_GLOBAL";
-                String name = GetEnvironment().FindGlobalName(a);
+                String name = mInterpreter.FindGlobalName(a);
                 action = String::Format("%d '%s' -> %d", a, name.CString(), b);
                 break;
             }
@@ -613,7 +1056,7 @@ namespace Finch
             case OP_SET_GLOBAL:
             {
                 opName = "SET_GLOBAL";
-                String name = GetEnvironment().FindGlobalName(a);
+                String name = mInterpreter.FindGlobalName(a);
                 action = String::Format("%d '%s' <- %d", a, name.CString(), b);
                 break;
             }
@@ -621,7 +1064,7 @@ namespace Finch
             case OP_DEF_METHOD:
             {
                 opName = "DEF_METHOD";
-                String name = GetEnvironment().Strings().Find(a);
+                String name = mInterpreter.FindString(a);
                 action = String::Format("'%s' %d -> %d", name.CString(), b, c);
                 break;
             }
@@ -629,11 +1072,41 @@ namespace Finch
             case OP_DEF_FIELD: // a name, b value, c obj
             {
                 opName = "DEF_FIELD";
-                String name = GetEnvironment().Strings().Find(a);
+                String name = mInterpreter.FindString(a);
                 action = String::Format("'%s' %d -> %d", name.CString(), b, c);
                 break;
             }
 
+            case OP_DEF_METHODS: // a methods, c obj
+                opName = "DEF_METHODS";
+                action = String::Format("%d -> %d", a, c);
+                break;
+
+            case OP_JUMP:
+                opName = "JUMP";
+                action = String::Format("+%d", (b << 8) | c);
+                break;
+
+            case OP_LOOP:
+                opName = "LOOP";
+                action = String::Format("-%d", (b << 8) | c);
+                break;
+
+            case OP_JUMP_IF_REDEFINED:
+                opName = "JUMP_IF_REDEF";
+                action = String::Format("+%d", (b << 8) | c);
+                break;
+
+            case OP_JUMP_IF_FALSE:
+                opName = "JUMP_IF_FALSE";
+                action = String::Format("%d +%d", a, (b << 8) | c);
+                break;
+
+            case OP_CLOSE_UPVALUES:
+                opName = "CLOSE_UPVALUES";
+                action = String::Format("%d", a);
+                break;
+
             case OP_END:
                 opName = "END";
                 action = String::Format("^ %d", a);
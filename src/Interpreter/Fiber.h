@@ -9,10 +9,23 @@
 
 //#define TRACE_INSTRUCTIONS
 
+// Define this to have the interpreter loop dispatch each instruction by
+// jumping directly to its handler (computed goto) instead of going through a
+// central switch. It's only used on compilers that support taking the
+// address of a label ("labels as values"); others fall back to the switch.
+// Both dispatch over the same pre-decoded instructions. It's off by default
+// because the switch benchmarked faster with GCC 12.
+//#define THREADED_DISPATCH
+
+#if defined(THREADED_DISPATCH) && defined(__GNUC__)
+#define COMPUTED_GOTO
+#endif
+
 namespace Finch
 {
     class Environment;
     class Expr;
+    class Heap;
     class Interpreter;
     
     // A single bytecode execution thread in the interpreter. A Fiber has a
@@ -47,6 +60,10 @@ namespace Finch
         // Gets the current number of stack frames on the callstack. Used as a
         // diagnostic to ensure that tail call optimization is working.
         int GetCallstackDepth() const;
+        
+        // Marks the values in the fiber's registers and callframes so that
+        // the garbage collector doesn't free them.
+        void MarkReferences(Heap & heap);
     private:
         // A single stack frame on the virtual callstack.
         struct CallFrame
@@ -64,41 +81,60 @@ namespace Finch
             // The block of code being executed by this frame.
             Value block;
             
+            // The decoded instructions for the block. Will be NULL until the
+            // frame is first executed.
+            const DecodedInstruction * code;
+            
             CallFrame()
             :   ip(0),
                 stackStart(0),
                 receiver(),
-                block()
+                block(),
+                code(NULL)
             {}
             
             CallFrame(int stackStart, const Value & receiver, const Value & block)
             :   ip(0),
                 stackStart(stackStart),
                 receiver(receiver),
-                block(block)
+                block(block),
+                code(NULL)
             {}
 
             // Gets the code object for this frame.
             const BlockObject & Block() const { return *(block.AsBlock()); }
         };
         
-        // Loads a register for the given callframe.
-        Value Load(const CallFrame & frame, int reg);
+        // Loads a register for the given callframe. The reference is only
+        // valid until the stack grows.
+        const Value & Load(const CallFrame & frame, int reg);
         
         // Stores a register for the given callframe.
         void Store(const CallFrame & frame, int reg, const Value & value);
 
         void PopCallFrame();
         void StoreMessageResult(const Value & result);
+        
+        // Replaces the callframe below the top one with the top one. Called
+        // after a tail call pushes a new frame, since the caller has nothing
+        // left to do but return the callee's result.
+        void TailCall();
+        
+        // Closes all open upvalues for stack slots at or above the given
+        // index.
+        void CloseUpvalues(int stackIndex);
 
-        Value SendMessage(StringId messageId, int receiverReg, int numArgs);
+        // Sends the message to the receiver in the given register, using and
+        // updating the send's inline cache to find its method.
+        Value SendMessage(StringId messageId, int receiverReg, int numArgs,
+                          MessageCache & cache);
         
         const Value & Self();
         
         Ref<Upvalue> CaptureUpvalue(int stackIndex);
         
 #ifdef TRACE_INSTRUCTIONS
-        void TraceInstruction(Instruction instruction);
+        void TraceInstruction(const DecodedInstruction & instruction);
         void TraceStack();
 #endif
         
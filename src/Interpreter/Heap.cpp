@@ -0,0 +1,165 @@
+#include "Heap.h"
+
+namespace Finch
+{
+    Heap::Heap()
+    :   mObjects(NULL),
+        mNumObjects(0),
+        mNextCollection(MIN_COLLECTION),
+        mNumCollections(0)
+    {
+        for (int i = 0; i < NUM_SIZE_CLASSES; i++)
+        {
+            mFreeCells[i] = NULL;
+            mUnusedCells[i] = NULL;
+            mUnusedEnd[i] = NULL;
+        }
+    }
+    
+    Heap::~Heap()
+    {
+        while (mObjects != NULL)
+        {
+            Object * object = mObjects;
+            mObjects = object->mNextObject;
+            Free(object);
+        }
+        
+        for (int i = 0; i < mPermanentObjects.Count(); i++)
+        {
+            Free(mPermanentObjects[i]);
+        }
+        
+        for (int i = 0; i < mSlabs.Count(); i++)
+        {
+            delete [] mSlabs[i];
+        }
+    }
+    
+    void * Heap::Allocate(size_t size)
+    {
+        mStats.numAllocations++;
+        
+        int sizeClass = SizeClass(size);
+        if (sizeClass == NUM_SIZE_CLASSES)
+        {
+            mStats.numLarge++;
+            return ::operator new(size);
+        }
+        
+        // Reuse the most recently freed cell, since it's likely to still be
+        // in the cache.
+        FreeCell * cell = mFreeCells[sizeClass];
+        if (cell != NULL)
+        {
+            mStats.numReused++;
+            mFreeCells[sizeClass] = cell->next;
+            return cell;
+        }
+        
+        // Otherwise, take the next cell that's never been used.
+        int cellBytes = (sizeClass + 1) * SIZE_CLASS_BYTES;
+        if (mUnusedEnd[sizeClass] - mUnusedCells[sizeClass] < cellBytes)
+        {
+            AddSlab(sizeClass);
+        }
+        
+        void * memory = mUnusedCells[sizeClass];
+        mUnusedCells[sizeClass] += cellBytes;
+        return memory;
+    }
+    
+    Value Heap::AddObject(Object * object, size_t size)
+    {
+        object->mSizeClass = SizeClass(size);
+        object->mNextObject = mObjects;
+        mObjects = object;
+        mNumObjects++;
+        
+        return Value(object);
+    }
+    
+    Value Heap::AddPermanentObject(Object * object, size_t size)
+    {
+        object->mSizeClass = SizeClass(size);
+        object->mIsMarked = true;
+        mPermanentObjects.Add(object);
+        
+        return Value(object);
+    }
+    
+    void Heap::Collect()
+    {
+        // Permanent objects are always marked, so Mark() won't trace them.
+        for (int i = 0; i < mPermanentObjects.Count(); i++)
+        {
+            mPermanentObjects[i]->MarkReferences(*this);
+        }
+        
+        // Mark everything reachable from the roots.
+        while (!mGray.IsEmpty())
+        {
+            mGray.Pop()->MarkReferences(*this);
+        }
+        
+        // Free everything else, and clear the marks for the next collection.
+        Object ** link = &mObjects;
+        while (*link != NULL)
+        {
+            Object * object = *link;
+            if (object->mIsMarked)
+            {
+                object->mIsMarked = false;
+                link = &object->mNextObject;
+            }
+            else
+            {
+                *link = object->mNextObject;
+                Free(object);
+                mNumObjects--;
+            }
+        }
+        
+        // Let the heap grow in proportion to what survived, so that the time
+        // spent collecting stays proportional to the time spent allocating.
+        mNextCollection = mNumObjects * 2;
+        if (mNextCollection < MIN_COLLECTION) mNextCollection = MIN_COLLECTION;
+        
+        mNumCollections++;
+    }
+    
+    int Heap::SizeClass(size_t size)
+    {
+        int sizeClass = static_cast<int>((size - 1) / SIZE_CLASS_BYTES);
+        if (sizeClass >= NUM_SIZE_CLASSES) return NUM_SIZE_CLASSES;
+        
+        return sizeClass;
+    }
+    
+    void Heap::AddSlab(int sizeClass)
+    {
+        char * slab = new char[SLAB_BYTES];
+        mSlabs.Add(slab);
+        mStats.slabBytes += SLAB_BYTES;
+        
+        // Whatever was left of the previous slab is too small for a cell.
+        mUnusedCells[sizeClass] = slab;
+        mUnusedEnd[sizeClass] = slab + SLAB_BYTES;
+    }
+    
+    void Heap::Free(Object * object)
+    {
+        int sizeClass = object->mSizeClass;
+        object->~Object();
+        
+        if (sizeClass == NUM_SIZE_CLASSES)
+        {
+            ::operator delete(object);
+            return;
+        }
+        
+        FreeCell * cell = reinterpret_cast<FreeCell *>(object);
+        cell->next = mFreeCells[sizeClass];
+        mFreeCells[sizeClass] = cell;
+    }
+}
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "Array.h"
+#include "Macros.h"
+#include "Object.h"
+#include "Stack.h"
+
+namespace Finch
+{
+    // Counts of how a heap has allocated memory for objects.
+    struct AllocationStats
+    {
+        AllocationStats()
+        :   numAllocations(0),
+            numReused(0),
+            numLarge(0),
+            slabBytes(0)
+        {}
+        
+        // These are 64 bits so that a long-running interpreter can't overflow
+        // them.
+        uint64_t numAllocations; // Every object allocated.
+        uint64_t numReused;      // Ones that reused a freed object's memory.
+        uint64_t numLarge;       // Ones too big for a size class.
+        uint64_t slabBytes;      // Memory set aside for the size classes.
+    };
+    
+    // Owns every object in an interpreter and frees the ones that can no
+    // longer be reached with a mark-sweep collector. To collect, the
+    // interpreter marks its roots with Mark() and then calls Collect(), which
+    // marks everything they refer to and frees the rest. Objects are never
+    // moved, since values refer to them by address.
+    //
+    // A collection must only happen when every object that the interpreter
+    // still needs can be reached from the roots. In particular, no C++ code
+    // may be holding on to an object that isn't also stored somewhere a root
+    // can reach, so the fibers only collect between instructions.
+    //
+    // Objects are allocated from the heap with `new (heap) SomeObject(...)`.
+    // Small objects are rounded up to a size class, and each class keeps a
+    // list of freed cells that new objects of that size reuse, most recently
+    // freed first. Cells are carved out of larger slabs that are only freed
+    // along with the heap.
+    class Heap
+    {
+    public:
+        Heap();
+
+        // Frees every object.
+        ~Heap();
+
+        // Allocates memory for a new object of the given size. Called by
+        // Object's operator new.
+        void * Allocate(size_t size);
+        
+        // Takes ownership of a newly allocated object and returns a value
+        // referring to it. The object must have been allocated from this heap
+        // and be passed in as its own type, since that's how the heap knows
+        // how big it is.
+        template <class T>
+        Value Add(T * object)
+        {
+            return AddObject(object, sizeof(T));
+        }
+        
+        // Takes ownership of a newly allocated object that lives as long as
+        // the heap, like the built-in prototypes. It is never freed by a
+        // collection, so it doesn't need to be reachable from the roots, and
+        // everything it refers to is kept too. Since it stays marked,
+        // collections never write to it.
+        template <class T>
+        Value AddPermanent(T * object)
+        {
+            return AddPermanentObject(object, sizeof(T));
+        }
+
+        // Returns true if enough objects have been allocated since the last
+        // collection that it's time for another one.
+        bool ShouldCollect() const { return mNumObjects >= mNextCollection; }
+
+        // Marks the given object as reachable, along with everything it
+        // refers to once Collect() is called.
+        void Mark(const Value & value)
+        {
+            if (value.IsObject()) Mark(value.AsObject());
+        }
+
+        void Mark(Object * object)
+        {
+            if (object->mIsMarked) return;
+
+            object->mIsMarked = true;
+            mGray.Push(object);
+        }
+
+        // Marks everything reachable from the objects marked so far, then
+        // frees every object that isn't marked.
+        void Collect();
+
+        // Gets the number of collections that have finished. Things that are
+        // shared by many objects, like the blocks that block objects refer
+        // to, use it to only mark what they refer to once per collection.
+        int NumCollections() const { return mNumCollections; }
+
+        // Gets the number of objects that a collection may free, including
+        // those that are unreachable but haven't been freed yet. Permanent
+        // objects aren't counted.
+        int NumObjects() const { return mNumObjects; }
+        
+        const AllocationStats & GetAllocationStats() const { return mStats; }
+
+    private:
+        // A freed cell in a size class's list.
+        struct FreeCell
+        {
+            FreeCell * next;
+        };
+        
+        // The fewest allocated objects that will trigger a collection.
+        static const int MIN_COLLECTION = 1 << 16;
+        
+        // Sizes of objects are rounded up to a multiple of this. Objects
+        // bigger than the largest class are allocated with new.
+        static const int SIZE_CLASS_BYTES = 8;
+        static const int NUM_SIZE_CLASSES = 32;
+        
+        // How much memory is set aside at a time for a size class.
+        static const int SLAB_BYTES = 16 * 1024;
+        
+        // Gets the size class for objects of the given size. Returns
+        // NUM_SIZE_CLASSES if they are too big for one.
+        static int SizeClass(size_t size);
+        
+        Value AddObject(Object * object, size_t size);
+        Value AddPermanentObject(Object * object, size_t size);
+        
+        // Sets aside a new slab for the given size class.
+        void AddSlab(int sizeClass);
+        
+        // Destroys the object and lets its memory be reused.
+        void Free(Object * object);
+
+        // Every object, most recently allocated first, linked through their
+        // mNextObject fields.
+        Object * mObjects;
+        int      mNumObjects;
+
+        // The objects that are never freed until the heap is.
+        Array<Object *> mPermanentObjects;
+        
+        // The number of objects that triggers the next collection.
+        int      mNextCollection;
+        int      mNumCollections;
+
+        // Objects that have been marked but whose references haven't been
+        // marked yet.
+        Stack<Object *> mGray;
+        
+        // The freed cells for each size class.
+        FreeCell *   mFreeCells[NUM_SIZE_CLASSES];
+        
+        // The part of each size class's latest slab that hasn't been handed
+        // out yet.
+        char *       mUnusedCells[NUM_SIZE_CLASSES];
+        char *       mUnusedEnd[NUM_SIZE_CLASSES];
+        
+        // Every slab, so that they can be freed with the heap.
+        Array<char*> mSlabs;
+        
+        AllocationStats mStats;
+
+        NO_COPY(Heap);
+    };
+}
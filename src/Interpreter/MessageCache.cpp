@@ -0,0 +1,92 @@
+#include "MessageCache.h"
+#include "DynamicObject.h"
+#include "Heap.h"
+
+namespace Finch
+{
+    void MessageCache::Add(const DynamicObject * start,
+                           const MessageTarget & target, CacheEpoch epoch)
+    {
+        if (mEpoch != epoch) Reset(epoch);
+        
+        if (mIsMegamorphic) return;
+        
+        if (mCount < MAX_ENTRIES)
+        {
+            mEntries[mCount].start = start;
+            mEntries[mCount].target = target;
+            mCount++;
+        }
+        else
+        {
+            // Too many kinds of receivers, so stop caching at this site.
+            Reset(epoch);
+            mIsMegamorphic = true;
+        }
+    }
+    
+    void MarkMethods(Heap & heap, const MethodTable & methods)
+    {
+        for (int i = 0; i < methods.NumItemSlots(); i++)
+        {
+            const MessageTarget * target = methods.ValueAt(i);
+            if (target != NULL) heap.Mark(target->method);
+        }
+    }
+    
+    void MessageCache::MarkReferences(Heap & heap, CacheEpoch epoch)
+    {
+        // Entries from an earlier epoch will never be used again.
+        if (mEpoch != epoch) return;
+        
+        for (int i = 0; i < mCount; i++)
+        {
+            heap.Mark(mEntries[i].target.method);
+        }
+    }
+    
+    void MessageCache::Reset(CacheEpoch epoch)
+    {
+        mEpoch = epoch;
+        mCount = 0;
+        mIsMegamorphic = false;
+    }
+    
+    const MessageTarget * LookupCache::Lookup(DynamicObject * start,
+                                              StringId messageId,
+                                              CacheEpoch epoch)
+    {
+        unsigned long hash = (reinterpret_cast<unsigned long>(start) >> 4) ^
+                             (static_cast<unsigned long>(messageId) * 2654435761ul);
+        Entry & entry = mEntries[hash & (SIZE - 1)];
+        
+        if ((entry.epoch == epoch) &&
+            (entry.messageId == messageId) &&
+            (entry.start == start))
+        {
+            return &entry.target;
+        }
+        
+        MessageTarget target;
+        if (!start->LookupMessage(messageId, &target)) return NULL;
+        
+        // Replace whatever was in the slot.
+        entry.epoch = epoch;
+        entry.messageId = messageId;
+        entry.start = start;
+        entry.target = target;
+        
+        return &entry.target;
+    }
+    
+    void LookupCache::MarkReferences(Heap & heap, CacheEpoch epoch)
+    {
+        for (int i = 0; i < SIZE; i++)
+        {
+            if (mEntries[i].epoch == epoch)
+            {
+                heap.Mark(mEntries[i].target.method);
+            }
+        }
+    }
+}
@@ -0,0 +1,257 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "Dictionary.h"
+#include "Macros.h"
+#include "Object.h"
+#include "Ref.h"
+
+namespace Finch
+{
+    class DynamicObject;
+    class Heap;
+    class Shape;
+    
+    // Counts how many times a kind of cache has been invalidated. It's 64
+    // bits so that it never wraps around to an epoch that is still cached.
+    // Epochs start at 1, so NO_EPOCH never matches the current one.
+    typedef uint64_t CacheEpoch;
+    const CacheEpoch NO_EPOCH = 0;
+    
+    // The current epochs of an interpreter's caches. Each interpreter has its
+    // own, so that changing an object in one doesn't flush the caches of
+    // another. Objects reach them through their shape.
+    struct CacheEpochs
+    {
+        CacheEpochs()
+        :   messages(1),
+            fields(1)
+        {}
+        
+        // Discards every cached message lookup.
+        void InvalidateMessages() { messages++; }
+        
+        // Discards every cached inherited field.
+        void InvalidateFields() { fields++; }
+        
+        CacheEpoch messages;
+        CacheEpoch fields;
+    };
+    
+    // What a message resolves to when it's sent to some object: either a
+    // method (a block object) or a primitive.
+    struct MessageTarget
+    {
+        MessageTarget()
+        :   method(),
+            primitive(NULL)
+        {}
+        
+        Value           method;
+        PrimitiveMethod primitive;
+    };
+    
+    // The methods and primitives an object handles directly, keyed by message.
+    // Objects created from the same code share a table until one of them
+    // changes its methods.
+    class MethodTable : public IdTable<MessageTarget>, public RefCounted
+    {
+    };
+    
+    // Marks the methods in the given table so that the garbage collector
+    // doesn't free them.
+    void MarkMethods(Heap & heap, const MethodTable & methods);
+    
+    // An inline cache for a single message send instruction. Remembers what
+    // the message resolved to for the last few different kinds of receivers,
+    // where a kind of receiver is identified by the object that method lookup
+    // starts at (see DynamicObject::FindLookupStart()). If a send site sees
+    // more kinds of receivers than fit, it is considered megamorphic and stops
+    // caching.
+    //
+    // All of an interpreter's caches are flushed at once by
+    // CacheEpochs::InvalidateMessages(), which must be called whenever an
+    // object that a cached lookup walked through changes its methods. The
+    // current epoch is passed in.
+    class MessageCache
+    {
+    public:
+        MessageCache()
+        :   mEpoch(NO_EPOCH),
+            mCount(0),
+            mIsMegamorphic(false)
+        {}
+        
+        // Looks for a cached target for receivers whose lookup starts at the
+        // given object. Returns NULL if not found.
+        const MessageTarget * Find(const DynamicObject * start,
+                                   CacheEpoch epoch)
+        {
+            if (mEpoch != epoch) Reset(epoch);
+            
+            for (int i = 0; i < mCount; i++)
+            {
+                if (mEntries[i].start == start) return &mEntries[i].target;
+            }
+            
+            return NULL;
+        }
+        
+        // Caches the given target for receivers whose lookup starts at the
+        // given object.
+        void Add(const DynamicObject * start, const MessageTarget & target,
+                 CacheEpoch epoch);
+        
+        // Gets whether or not this site has seen too many different receivers
+        // to cache.
+        bool IsMegamorphic() const { return mIsMegamorphic; }
+        
+        // Marks the methods cached for the current epoch.
+        void MarkReferences(Heap & heap, CacheEpoch epoch);
+        
+    private:
+        static const int MAX_ENTRIES = 4;
+        
+        struct Entry
+        {
+            Entry()
+            :   start(NULL),
+                target()
+            {}
+            
+            const DynamicObject * start;
+            MessageTarget         target;
+        };
+        
+        void Reset(CacheEpoch epoch);
+        
+        CacheEpoch mEpoch; // the epoch when the entries were cached
+        int        mCount; // number of entries used
+        bool       mIsMegamorphic;
+        Entry      mEntries[MAX_ENTRIES];
+    };
+    
+    // An inline cache for a single field access instruction. Remembers the
+    // shape of the last object the field was found on and the field's slot,
+    // so that a hit is a single pointer comparison. For a field write that
+    // added a new field, it remembers the shape the object moved to instead.
+    //
+    // If the field was found on an object further up the receiver's parent
+    // chain, that's only cached for that receiver and only until a field is
+    // added to one of the objects that were walked through to find it. Those
+    // call CacheEpochs::InvalidateFields(), which discards every such entry
+    // in the interpreter at once. The current epoch is passed in.
+    class FieldCache
+    {
+    public:
+        FieldCache()
+        :   mShape(NULL),
+            mNewShape(NULL),
+            mSlot(-1),
+            mEpoch(NO_EPOCH),
+            mReceiver(NULL),
+            mHolder(NULL)
+        {}
+        
+        // The shape of the object the field was found on, or of the receiver
+        // before a new field was added to it.
+        const Shape * GetShape() const { return mShape; }
+        
+        // The shape of the receiver after a new field was added to it, or
+        // NULL if the field already existed.
+        Shape * NewShape() const { return mNewShape; }
+        
+        int Slot() const { return mSlot; }
+        
+        // Gets the object in the given receiver's parent chain that the field
+        // was found on, or NULL if it was found on the receiver itself or the
+        // cache doesn't apply to this receiver.
+        DynamicObject * FindHolder(const DynamicObject * receiver,
+                                   CacheEpoch epoch) const
+        {
+            if ((mReceiver == receiver) && (mEpoch == epoch)) return mHolder;
+            return NULL;
+        }
+        
+        // Gets whether the field was found on the receiver itself.
+        bool IsOwn() const { return mHolder == NULL; }
+        
+        // Caches a field found in the receiver's own fields.
+        void SetOwn(const Shape * shape, int slot)
+        {
+            mShape = shape;
+            mNewShape = NULL;
+            mSlot = slot;
+            mReceiver = NULL;
+            mHolder = NULL;
+        }
+        
+        // Caches a new field being added to the receiver.
+        void SetAdded(const Shape * shape, Shape * newShape)
+        {
+            SetOwn(shape, -1);
+            mNewShape = newShape;
+        }
+        
+        // Caches a field found on an object in the receiver's parent chain.
+        void SetInherited(const DynamicObject * receiver,
+                          DynamicObject * holder, const Shape * holderShape,
+                          int slot, CacheEpoch epoch)
+        {
+            mShape = holderShape;
+            mNewShape = NULL;
+            mSlot = slot;
+            mEpoch = epoch;
+            mReceiver = receiver;
+            mHolder = holder;
+        }
+        
+    private:
+        const Shape *         mShape;
+        Shape *               mNewShape;
+        int                   mSlot;
+        
+        CacheEpoch            mEpoch;    // the epoch when mHolder was cached
+        const DynamicObject * mReceiver; // NULL if the field is the receiver's
+        DynamicObject *       mHolder;   // NULL if the field is the receiver's
+    };
+    
+    // An interpreter-wide cache of message lookups, keyed on the message and
+    // the object that lookup starts at. This backs up the inline caches: it's
+    // used when a send site misses or has gone megamorphic. It's invalidated
+    // along with the inline caches by CacheEpochs::InvalidateMessages().
+    class LookupCache
+    {
+    public:
+        // Finds the method or primitive bound to the given message, starting
+        // at the given object, using the cache if possible. Returns NULL if
+        // the message isn't handled.
+        const MessageTarget * Lookup(DynamicObject * start, StringId messageId,
+                                     CacheEpoch epoch);
+        
+        // Marks the methods cached for the current epoch.
+        void MarkReferences(Heap & heap, CacheEpoch epoch);
+        
+    private:
+        // Must be a power of two.
+        static const int SIZE = 1024;
+        
+        struct Entry
+        {
+            Entry()
+            :   epoch(NO_EPOCH),
+                messageId(NO_STRING),
+                start(NULL),
+                target()
+            {}
+            
+            CacheEpoch            epoch;
+            StringId              messageId;
+            const DynamicObject * start;
+            MessageTarget         target;
+        };
+        
+        Entry mEntries[SIZE];
+    };
+}
@@ -2,6 +2,7 @@
 
 #include <iostream>
 
+#include "Heap.h"
 #include "Macros.h"
 #include "Object.h"
 #include "Ref.h"
@@ -30,6 +31,16 @@ namespace Finch
         
         virtual ArrayObject * AsArray() { return this; }
         
+        virtual void MarkReferences(Heap & heap)
+        {
+            Object::MarkReferences(heap);
+            
+            for (int i = 0; i < mElements.Count(); i++)
+            {
+                heap.Mark(mElements[i]);
+            }
+        }
+        
         virtual String AsString() const
         {
             String text = "#[";
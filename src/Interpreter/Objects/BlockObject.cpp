@@ -1,8 +1,8 @@
 #include "BlockObject.h"
+#include "Heap.h"
 
 namespace Finch
 {
-    
     const Value & BlockObject::GetConstant(int index) const
     {
         return mBlock->GetConstant(index);
@@ -28,4 +28,22 @@ namespace Finch
     {
         return mUpvalues[index];
     }
+    
+    void BlockObject::MarkReferences(Heap & heap)
+    {
+        Object::MarkReferences(heap);
+        heap.Mark(mSelf);
+        
+        for (int i = 0; i < mUpvalues.Count(); i++)
+        {
+            mUpvalues[i]->MarkReferences(heap);
+        }
+        
+        for (int i = 0; i < mCapturedValues.Count(); i++)
+        {
+            heap.Mark(mCapturedValues[i]);
+        }
+        
+        mBlock->MarkReferences(heap);
+    }
 }
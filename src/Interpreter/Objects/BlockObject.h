@@ -25,7 +25,8 @@ namespace Finch
         :   Object(parent),
             mBlock(block),
             mSelf(self),
-            mUpvalues(block->NumUpvalues())
+            mUpvalues(block->NumUpvalues() - block->NumCapturedValues()),
+            mCapturedValues(block->NumCapturedValues())
         {}
         
         bool IsMethod() const { return !mSelf.IsNull(); }
@@ -41,14 +42,40 @@ namespace Finch
         const Value & GetConstant(int index) const;
         const Ref<Block> GetBlock(int index) const;
         
+        SharedMethods & GetSharedMethods(int index) const
+        {
+            return mBlock->GetSharedMethods(index);
+        }
+        
         // Gets the compiled bytecode for the block.
         const Array<Instruction> & Code() const;
         
+        // Decodes the block's bytecode if needed and returns the decoded
+        // instructions.
+        const DecodedInstruction * Decode(const void * const * handlers) const
+        {
+            return mBlock->Decode(handlers);
+        }
+        
         void AddUpvalue(Ref<Upvalue> upvalue);
         Ref<Upvalue> GetUpvalue(int index) const;
         
+        // Variables that are never assigned after the block is created are
+        // copied into it instead of being shared through an Upvalue.
+        void AddCapturedValue(const Value & value)
+        {
+            mCapturedValues.Add(value);
+        }
+        
+        const Value & GetCapturedValue(int index) const
+        {
+            return mCapturedValues[index];
+        }
+        
         virtual BlockObject * AsBlock() { return this; }
         
+        virtual void MarkReferences(Heap & heap);
+        
         virtual void Trace(ostream & stream) const
         {
             stream << "block";
@@ -58,6 +85,7 @@ namespace Finch
         Ref<Block>              mBlock;
         Value                   mSelf;
         Array<Ref<Upvalue> >    mUpvalues;
+        Array<Value>            mCapturedValues;
     };
 }
 
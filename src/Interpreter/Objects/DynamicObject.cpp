@@ -1,36 +1,83 @@
 #include "DynamicObject.h"
 #include "BlockObject.h"
 #include "Fiber.h"
+#include "Heap.h"
 
 namespace Finch
 {
     using std::ostream;
     
+    DynamicObject::~DynamicObject()
+    {
+        // Another object may get allocated at the same address, so make sure
+        // nothing cached still refers to this one.
+        if (mIsInLookupCache) mShape->Epochs().InvalidateMessages();
+        if (mIsInFieldCache) mShape->Epochs().InvalidateFields();
+        
+        delete [] mSlots;
+    }
+    
     void DynamicObject::Trace(ostream & stream) const
     {
         stream << mName;
     }
     
-    Value DynamicObject::FindMethod(StringId messageId)
+    void DynamicObject::MarkReferences(Heap & heap)
     {
-        Value method;
-        if (mMethods.Find(messageId, &method))
+        Object::MarkReferences(heap);
+        
+        for (int i = 0; i < mNumSlots; i++)
         {
-            return method;
+            heap.Mark(mSlots[i]);
         }
         
-        return Value();
+        if (HasMethods()) MarkMethods(heap, *mMethods);
     }
     
-    PrimitiveMethod DynamicObject::FindPrimitive(StringId messageId)
+    DynamicObject * DynamicObject::FindLookupStart(const Value & receiver)
     {
-        PrimitiveMethod primitive;
-        if (mPrimitives.Find(messageId, &primitive))
+        const Value * object = &receiver;
+        while (true)
         {
-            return primitive;
+            DynamicObject * dynamic = object->AsDynamic();
+            if ((dynamic != NULL) && dynamic->HasMethods()) return dynamic;
+            
+            // If we're at the root of the inheritance chain, then stop.
+            if (object->Parent().IsNull()) return NULL;
+            object = &object->Parent();
+        }
+    }
+    
+    bool DynamicObject::LookupMessage(StringId messageId, MessageTarget * target)
+    {
+        DynamicObject * object = this;
+        const Value * parent = &Parent();
+        while (true)
+        {
+            // Only dynamic objects have methods.
+            if (object != NULL)
+            {
+                object->mIsInLookupCache = true;
+                
+                // See if the object has a method or primitive bound to that
+                // name.
+                if (!object->mMethods.IsNull())
+                {
+                    const MessageTarget * found = object->mMethods->Find(messageId);
+                    if (found != NULL)
+                    {
+                        *target = *found;
+                        return true;
+                    }
+                }
+            }
+            
+            // If we're at the root of the inheritance chain, then stop.
+            if (parent->IsNull()) return false;
+            
+            object = parent->AsDynamic();
+            parent = &parent->Parent();
         }
-        
-        return NULL;
     }
     
     Value DynamicObject::GetField(StringId name)
@@ -39,11 +86,63 @@ namespace Finch
         DynamicObject * object = this;
         while (true)
         {
-            Value field;
-            if (object->mFields.Find(name, &field))
+            int slot = object->mShape->FindSlot(name);
+            if (slot != -1) return object->mSlots[slot];
+            
+            // If we're at the root of the inheritance chain, then stop.
+            if (object->Parent().IsNull()) break;
+            
+            // Only dynamic objects have fields, so stop if we aren't at one.
+            object = object->Parent().AsDynamic();
+            if (object == NULL) break;
+        }
+        
+        // If we get here, it wasn't found.
+        return Value();
+    }
+    
+    Value DynamicObject::GetField(StringId name, FieldCache & cache)
+    {
+        if (cache.IsOwn())
+        {
+            if (mShape == cache.GetShape()) return mSlots[cache.Slot()];
+        }
+        else
+        {
+            DynamicObject * holder = cache.FindHolder(this,
+                                                      mShape->Epochs().fields);
+            if ((holder != NULL) && (holder->mShape == cache.GetShape()))
+            {
+                return holder->mSlots[cache.Slot()];
+            }
+        }
+        
+        // Walk up the parent chain until it loops back on itself at Object.
+        DynamicObject * object = this;
+        while (true)
+        {
+            int slot = object->mShape->FindSlot(name);
+            if (slot != -1)
             {
-                // Found it.
-                return field;
+                if (object == this)
+                {
+                    cache.SetOwn(mShape, slot);
+                }
+                else
+                {
+                    // Adding the field to any of the objects we walked through
+                    // would hide this one.
+                    for (DynamicObject * walked = this; walked != object;
+                         walked = walked->Parent().AsDynamic())
+                    {
+                        walked->mIsInFieldCache = true;
+                    }
+                    
+                    cache.SetInherited(this, object, object->mShape, slot,
+                                       mShape->Epochs().fields);
+                }
+                
+                return object->mSlots[slot];
             }
             
             // If we're at the root of the inheritance chain, then stop.
@@ -60,16 +159,116 @@ namespace Finch
     
     void DynamicObject::SetField(StringId name, const Value & value)
     {
-        mFields.Insert(name, value);
+        int slot = mShape->FindSlot(name);
+        if (slot != -1)
+        {
+            mSlots[slot] = value;
+            return;
+        }
+        
+        AddField(mShape->AddField(name), value);
     }
+    
+    void DynamicObject::SetField(StringId name, const Value & value,
+                                 FieldCache & cache)
+    {
+        if (cache.IsOwn() && (mShape == cache.GetShape()))
+        {
+            if (cache.NewShape() == NULL)
+            {
+                mSlots[cache.Slot()] = value;
+            }
+            else
+            {
+                AddField(cache.NewShape(), value);
+            }
+            
+            return;
+        }
+        
+        int slot = mShape->FindSlot(name);
+        if (slot != -1)
+        {
+            cache.SetOwn(mShape, slot);
+            mSlots[slot] = value;
+            return;
+        }
         
+        Shape * shape = mShape->AddField(name);
+        cache.SetAdded(mShape, shape);
+        AddField(shape, value);
+    }
+    
+    void DynamicObject::AddField(Shape * shape, const Value & value)
+    {
+        int slot = mShape->NumFields();
+        
+        if (slot == mNumSlots)
+        {
+            // Most objects have only a few fields, so start small.
+            int numSlots = (mNumSlots == 0) ? 4 : mNumSlots * 2;
+            Value * slots = new Value[numSlots];
+            for (int i = 0; i < slot; i++) slots[i] = mSlots[i];
+            
+            delete [] mSlots;
+            mSlots = slots;
+            mNumSlots = numSlots;
+        }
+        
+        mShape = shape;
+        mSlots[slot] = value;
+        
+        // The new field may hide one that a cache found further up the
+        // parent chain.
+        if (mIsInFieldCache) mShape->Epochs().InvalidateFields();
+    }
+    
     void DynamicObject::AddMethod(StringId messageId, const Value & method)
     {
-        mMethods.Insert(messageId, method);
+        MessageTarget target;
+        target.method = method;
+        
+        EnsureOwnMethods();
+        mMethods->Insert(messageId, target);
+        if (mIsInLookupCache) mShape->Epochs().InvalidateMessages();
+    }
+    
+    void DynamicObject::BindMethods(const Ref<MethodTable> & methods)
+    {
+        if (mMethods.IsNull())
+        {
+            mMethods = methods;
+        }
+        else
+        {
+            EnsureOwnMethods();
+            mMethods->AddAll(*methods);
+        }
+        
+        if (mIsInLookupCache) mShape->Epochs().InvalidateMessages();
+    }
+    
+    void DynamicObject::EnsureOwnMethods()
+    {
+        if (mMethods.IsNull())
+        {
+            mMethods = Ref<MethodTable>(new MethodTable());
+        }
+        else if (!mMethods.IsUnique())
+        {
+            Ref<MethodTable> methods(new MethodTable());
+            methods->AddAll(*mMethods);
+            mMethods = methods;
+        }
     }
 
     void DynamicObject::AddPrimitive(StringId messageId, PrimitiveMethod method)
     {
-        mPrimitives.Insert(messageId, method);
+        MessageTarget target;
+        target.primitive = method;
+        
+        EnsureOwnMethods();
+        mMethods->Insert(messageId, target);
+        if (mIsInLookupCache) mShape->Epochs().InvalidateMessages();
     }
 }
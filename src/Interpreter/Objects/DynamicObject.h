@@ -5,8 +5,10 @@
 #include "Dictionary.h"
 #include "Expr.h"
 #include "Macros.h"
+#include "MessageCache.h"
 #include "Object.h"
 #include "Ref.h"
+#include "Shape.h"
 #include "FinchString.h"
 
 namespace Finch
@@ -20,39 +22,101 @@ namespace Finch
     class DynamicObject : public Object
     {
     public:
-        DynamicObject(const Value & parent, String name)
+        // Creates an object without any fields. `emptyShape` is the
+        // interpreter's shape for objects with no fields.
+        DynamicObject(const Value & parent, String name, Shape * emptyShape)
         :   Object(parent),
-            mName(name)
+            mName(name),
+            mShape(emptyShape),
+            mSlots(NULL),
+            mNumSlots(0),
+            mIsInLookupCache(false),
+            mIsInFieldCache(false)
         {
         }
         
-        DynamicObject(const Value & parent)
+        DynamicObject(const Value & parent, Shape * emptyShape)
         :   Object(parent),
-            mName("object")
+            mName("object"),
+            mShape(emptyShape),
+            mSlots(NULL),
+            mNumSlots(0),
+            mIsInLookupCache(false),
+            mIsInFieldCache(false)
         {
         }
         
+        virtual ~DynamicObject();
+        
         virtual void Trace(ostream & stream) const;
+        virtual void MarkReferences(Heap & heap);
         
         virtual String AsString() const     { return mName; }
         virtual DynamicObject * AsDynamic() { return this; }
         
-        Value FindMethod(StringId messageId);
-        PrimitiveMethod FindPrimitive(StringId messageId);
+        // Gets the object where looking up a message sent to the given
+        // receiver starts: the first object in its parent chain that has any
+        // methods or primitives. Returns NULL if there isn't one.
+        static DynamicObject * FindLookupStart(const Value & receiver);
+        
+        // Walks the parent chain starting at this object looking for the
+        // method or primitive bound to the given message. Returns false if
+        // not found. Every object it walks through is flagged so that
+        // changing its methods later invalidates the cached lookups.
+        bool LookupMessage(StringId messageId, MessageTarget * target);
 
         Value GetField(StringId name);
         void SetField(StringId name, const Value & value);
+        
+        // Versions of GetField() and SetField() for field access instructions
+        // that use and update the instruction's inline cache.
+        Value GetField(StringId name, FieldCache & cache);
+        void SetField(StringId name, const Value & value, FieldCache & cache);
 
         void AddMethod(StringId messageId, const Value & method);
+        
+        // Adds all of the methods in the given table. If this object doesn't
+        // have any methods yet, it shares the table until a method is added
+        // to it.
+        void BindMethods(const Ref<MethodTable> & methods);
         void AddPrimitive(StringId messageId, PrimitiveMethod method);
         
     private:
         void InitializeScope();
         
+        // Makes sure this object has its own method table that isn't shared
+        // with any other object.
+        void EnsureOwnMethods();
+        
+        // Moves this object to the given shape, which adds one new field, and
+        // stores the field's value.
+        void AddField(Shape * shape, const Value & value);
+        
+        // The method table is only created when the first method or
+        // primitive is added.
+        bool HasMethods() const { return !mMethods.IsNull(); }
+        
         String                      mName; //### bob: hack temp
-        IdTable<Value>              mFields;
-        IdTable<Value>              mMethods;
-        IdTable<PrimitiveMethod>    mPrimitives;
+        
+        // The layout of this object's fields and their values, indexed by
+        // slot. mNumSlots is the capacity of mSlots, which may be more than
+        // the number of fields.
+        Shape *                     mShape;
+        Value *                     mSlots;
+        int                         mNumSlots;
+        
+        // The methods and primitives this object handles, in a single table
+        // so that looking up a message takes one probe. Objects created by
+        // the same code may share a method table, so it is copied before a
+        // method is added to it. Null if there are no methods.
+        Ref<MethodTable>            mMethods;
+        
+        // True if a cached message lookup has walked through this object.
+        bool                        mIsInLookupCache;
+        
+        // True if a field cached by a FieldCache was found by walking through
+        // this object without finding it here.
+        bool                        mIsInFieldCache;
     };    
 }
 
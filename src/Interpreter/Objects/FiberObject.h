@@ -24,6 +24,12 @@ namespace Finch
         
         Fiber & GetFiber() { return mFiber; }
         
+        virtual void MarkReferences(Heap & heap)
+        {
+            Object::MarkReferences(heap);
+            mFiber.MarkReferences(heap);
+        }
+        
         virtual void Trace(ostream & stream) const
         {
             stream << "fiber";
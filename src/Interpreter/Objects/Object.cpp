@@ -1,24 +1,25 @@
+#include <sstream>
+
 #include "Object.h"
 #include "ArrayObject.h"
 #include "BlockObject.h"
 #include "DynamicObject.h"
 #include "FiberObject.h"
+#include "Heap.h"
 #include "Interpreter.h"
-#include "NumberObject.h"
 #include "Fiber.h"
 #include "StringObject.h"
 
 namespace Finch
 {
     using std::ostream;
+    using std::stringstream;
     
-    Value::Value(const Value & other)
-    :   mObj(other.mObj)
+    const Value & Value::Parent() const
     {
-        if (mObj != NULL) mObj->mRefCount++;
+        ASSERT(IsObject(), "Only objects have parents.");
+        return AsObject()->Parent();
     }
-    
-    const Value & Value::Parent() const { return mObj->Parent(); }
 
     void Value::Trace(ostream & cout) const
     {
@@ -26,24 +27,16 @@ namespace Finch
         {
             cout << "(nil)";
         }
-        else
+        else if (IsNumber())
         {
-            mObj->Trace(cout);
+            cout << mNumber;
         }
-    }
-
-    Value & Value::operator =(const Value & other)
-    {
-        if (&other != this)
+        else
         {
-            Clear();
-            mObj = other.mObj;
-            if (mObj != NULL) mObj->mRefCount++;
+            AsObject()->Trace(cout);
         }
-        
-        return *this;
     }
-    
+
     Value Value::GetField(int name) const
     {
         // Only dynamic objects have fields.
@@ -62,68 +55,48 @@ namespace Finch
         dynamic->SetField(name, value);
     }
 
-    Value Value::SendMessage(Fiber & fiber, StringId messageId, const ArgReader & args) const
+    String Value::AsString() const
     {
-        const Value * receiver = this;
-        
-        // Walk the parent chain looking for a method that matches the message.
-        while (true)
+        if (IsNumber())
         {
-            // Only dynamic objects have methods.
-            DynamicObject * dynamic = receiver->AsDynamic();
-            if (dynamic != NULL)
-            {
-                // See if the object has a method bound to that name.
-                Value method = dynamic->FindMethod(messageId);
-                if (!method.IsNull())
-                {
-                    fiber.CallBlock(*this, method, args);
-                    return Value();
-                }
-                
-                // See if the object has a primitive bound to that name.
-                PrimitiveMethod primitive = dynamic->FindPrimitive(messageId);
-                if (primitive != NULL)
-                {
-                    return primitive(fiber, *this, args);
-                }
-            }
-            
-            // If we're at the root of the inheritance chain, then stop.
-            if (receiver->Parent().IsNull()) break;
-            receiver = &receiver->Parent();
+            stringstream result;
+            result << mNumber;
+            return String(result.str().c_str());
         }
         
-        // If we got here, the object didn't handle the message.
-        String messageName = fiber.GetInterpreter().FindString(messageId);
-        String error = String::Format("Object '%s' did not handle message '%s'",
-                                      AsString().CString(), messageName.CString());
-        fiber.Error(error);
-        
-        // Unhandled messages just return nil.
-        return fiber.Nil();
+        if (IsObject()) return AsObject()->AsString();
+        return "";
     }
-
-    void Value::Clear()
+    
+    ArrayObject * Value::AsArray() const
     {
-        if (mObj != NULL)
-        {
-            mObj->mRefCount--;
-            if (mObj->mRefCount == 0)
-            {
-                delete mObj;
-            }
-            
-            mObj = NULL;
-        }
+        return IsObject() ? AsObject()->AsArray() : NULL;
+    }
+    
+    BlockObject * Value::AsBlock() const
+    {
+        return IsObject() ? AsObject()->AsBlock() : NULL;
+    }
+    
+    DynamicObject * Value::AsDynamic() const
+    {
+        return IsObject() ? AsObject()->AsDynamic() : NULL;
+    }
+    
+    FiberObject * Value::AsFiber() const
+    {
+        return IsObject() ? AsObject()->AsFiber() : NULL;
+    }
+    
+    void * Object::operator new(size_t size, Heap & heap)
+    {
+        return heap.Allocate(size);
+    }
+    
+    void Object::MarkReferences(Heap & heap)
+    {
+        heap.Mark(mParent);
     }
-        
-    double Value::AsNumber() const { return mObj->AsNumber(); }
-    String Value::AsString() const { return mObj->AsString(); }
-    ArrayObject * Value::AsArray() const { return mObj->AsArray(); }
-    BlockObject * Value::AsBlock() const { return mObj->AsBlock(); }
-    DynamicObject * Value::AsDynamic() const { return mObj->AsDynamic(); }
-    FiberObject * Value::AsFiber() const { return mObj->AsFiber(); }
     
     ostream & operator<<(ostream & cout, const Value & value)
     {
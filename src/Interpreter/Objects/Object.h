@@ -1,6 +1,7 @@
 #pragma once
 
 #include <iostream>
+#include <stdint.h>
 
 #include "Array.h"
 #include "ArgReader.h"
@@ -23,59 +24,87 @@ namespace Finch
     class Environment;
     class Fiber;
     class FiberObject;
+    class Heap;
     class Interpreter;
     class Object;
 
     typedef Value (*PrimitiveMethod)(Fiber & fiber, const Value & self,
                                      const ArgReader & args);
 
+    // A single value in Finch. Numbers are stored directly in the value as a
+    // double. Everything else is a pointer to an Object owned by the
+    // interpreter's Heap, so copying a value is just copying its bits.
+    //
+    // This uses NaN-boxing. A double whose exponent bits are all set is a NaN,
+    // and the hardware only ever produces one bit pattern for those. That
+    // leaves the rest of the NaN space free to encode other things. A quiet
+    // NaN with the sign bit set holds an object pointer in its low 48 bits.
+    // One without the sign bit is the null (empty) value.
     class Value
     {
+        friend class Heap;
+        
     public:
         // Constructs a new null value.
         Value()
-        :   mObj(NULL)
+        :   mBits(NULL_BITS)
         {}
         
         explicit Value(Object * obj)
-        :   mObj(obj)
+        :   mBits((obj != NULL) ? (OBJECT_BITS | reinterpret_cast<uintptr_t>(obj))
+                                : NULL_BITS)
+        {}
+        
+        // Constructs a number.
+        explicit Value(double number)
+        :   mNumber(number)
         {
-            // Don't increment refcount because Object's constructor initializes
-            // it to 1.
+            // Collapse NaNs to a single bit pattern so that one can't be
+            // mistaken for a boxed value.
+            if (number != number) mBits = NAN_BITS;
         }
         
-        // Copies a value. If the copied value is a reference type, both values
-        // will point to the same object.
-        Value(const Value & other);
-        
-        ~Value() { Clear(); }
-        
         Value GetField(int name) const;
         void SetField(int name, const Value & value) const;
         
-        Value SendMessage(Fiber & fiber, StringId messageId, const ArgReader & args) const;
-
-        // Compares two values.
+        // Compares two values. Numbers are compared by value and objects by
+        // identity.
         bool operator ==(const Value & other) const
         {
-            return mObj == other.mObj;
+            return mBits == other.mBits;
         }
         
         // Compares two values.
         bool operator !=(const Value & other) const
         {
-            return mObj != other.mObj;
+            return mBits != other.mBits;
         }
         
-        Value & operator =(const Value & other);
+        // Gets a hash of the value, for tables keyed by values. Equal values
+        // have the same hash.
+        unsigned int HashCode() const
+        {
+            // Mix the high bits into the low ones, since those are the same
+            // for most numbers and pointers.
+            uint64_t hash = (mBits ^ (mBits >> 32)) * 0x9e3779b97f4a7c15ULL;
+            return static_cast<unsigned int>(hash >> 32);
+        }
         
         // Gets whether or not this value is nil.
-        bool IsNull() const { return mObj == NULL; }
+        bool IsNull() const { return mBits == NULL_BITS; }
         
-        // Clears the reference. If this was the last reference to the referred
-        // object, it will be deallocated.
-        void Clear();
+        // Gets whether or not this value is a number.
+        bool IsNumber() const { return (mBits & QNAN) != QNAN; }
         
+        // Gets whether or not this value refers to an object.
+        bool IsObject() const { return (mBits & OBJECT_BITS) == OBJECT_BITS; }
+        
+        // Clears the reference. The object it referred to is freed by the
+        // next garbage collection if nothing else refers to it.
+        void Clear() { mBits = NULL_BITS; }
+        
+        // Gets the parent of the object this refers to. Must not be called on a
+        // number: their parent is the interpreter's Numbers object.
         const Value & Parent() const;
         
         void Trace(ostream & cout) const;
@@ -88,18 +117,39 @@ namespace Finch
         FiberObject *   AsFiber() const;
         
     private:
-        Object * mObj;
+        static const uint64_t SIGN_BIT    = 0x8000000000000000ULL;
+        static const uint64_t QNAN        = 0x7ffc000000000000ULL;
+        static const uint64_t OBJECT_BITS = SIGN_BIT | QNAN;
+        static const uint64_t NULL_BITS   = QNAN | 1;
+        static const uint64_t NAN_BITS    = 0x7ff8000000000000ULL;
+        
+        Object * AsObject() const
+        {
+            return reinterpret_cast<Object *>(
+                static_cast<uintptr_t>(mBits & ~OBJECT_BITS));
+        }
+        
+        union
+        {
+            uint64_t mBits;
+            double   mNumber;
+        };
     };
     
     ostream & operator<<(ostream & cout, const Value & value);
 
     // Base class for an object in Finch. All values in Finch inherit from this.
+    // Objects are created by the Interpreter, which hands them to its Heap to
+    // be freed once they can't be reached.
     class Object
     {
-        friend class Value;
+        friend class Heap;
         
     public:
         virtual ~Object() {}
+        
+        // Objects are always allocated from a heap. See Heap.
+        static void * operator new(size_t size, Heap & heap);
 
         virtual double          AsNumber() const { return 0; }
         virtual String          AsString() const { return ""; }
@@ -111,13 +161,39 @@ namespace Finch
         const Value & Parent() const { return mParent; }
 
         virtual void Trace(ostream & stream) const = 0;
+        
+        // Marks the values this object refers to so that the garbage
+        // collector doesn't free them. Subclasses that hold values must
+        // override this and call the base implementation.
+        virtual void MarkReferences(Heap & heap);
 
     protected:
-        Object(const Value & parent) : mParent(parent), mRefCount(1) {}
+        Object(const Value & parent)
+        :   mParent(parent),
+            mNextObject(NULL),
+            mIsMarked(false),
+            mSizeClass(0)
+        {}
 
     private:
-        Value mParent;
-        int   mRefCount;
+        Value    mParent;
+        
+        // The next object in the heap's list of all objects.
+        Object * mNextObject;
+        
+        // Whether the current garbage collection has found that this object
+        // can be reached.
+        bool     mIsMarked;
+        
+        // The size class of the heap cell holding the object.
+        unsigned char mSizeClass;
     };
+    
+    inline double Value::AsNumber() const
+    {
+        if (IsNumber()) return mNumber;
+        if (IsObject()) return AsObject()->AsNumber();
+        return 0;
+    }
 }
 
@@ -0,0 +1,45 @@
+#include "Shape.h"
+
+namespace Finch
+{
+    Shape::Shape(const Shape * parent, StringId name)
+    :   mParent(parent),
+        mName(name),
+        mNumFields(parent->mNumFields + 1),
+        mEpochs(parent->mEpochs)
+    {
+    }
+    
+    Shape::~Shape()
+    {
+        for (int i = 0; i < mChildren.Count(); i++)
+        {
+            delete mChildren[i];
+        }
+    }
+    
+    int Shape::FindSlot(StringId name) const
+    {
+        // Objects rarely have more than a handful of fields, so a linear
+        // search back through the added fields is fast enough.
+        for (const Shape * shape = this; shape->mParent != NULL;
+             shape = shape->mParent)
+        {
+            if (shape->mName == name) return shape->mNumFields - 1;
+        }
+        
+        return -1;
+    }
+    
+    Shape * Shape::AddField(StringId name)
+    {
+        for (int i = 0; i < mChildren.Count(); i++)
+        {
+            if (mChildren[i]->mName == name) return mChildren[i];
+        }
+        
+        Shape * child = new Shape(this, name);
+        mChildren.Add(child);
+        return child;
+    }
+}
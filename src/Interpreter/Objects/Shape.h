@@ -0,0 +1,67 @@
+#pragma once
+
+#include "Array.h"
+#include "Macros.h"
+
+namespace Finch
+{
+    struct CacheEpochs;
+    
+    // Describes the layout of a DynamicObject's fields: which slot each field
+    // is stored in. Objects that have had the same fields added in the same
+    // order share a shape, so an object only needs to store a pointer to its
+    // shape and an array of field values.
+    //
+    // Shapes form a tree rooted at the empty shape, which the interpreter
+    // owns. Adding a field to an object moves it to a child of its current
+    // shape, which is created the first time that field is added to an object
+    // with that shape. A shape only stores the field it adds to its parent, so
+    // the tree takes memory in proportion to the number of shapes. Shapes are
+    // freed along with the empty shape. Every shape in the tree refers to the
+    // interpreter's cache epochs, so that objects can invalidate its caches.
+    class Shape
+    {
+    public:
+        // Creates the shape of objects with no fields.
+        explicit Shape(CacheEpochs & epochs)
+        :   mParent(NULL),
+            mName(-1),
+            mNumFields(0),
+            mEpochs(&epochs)
+        {}
+        
+        // Frees the shapes created from this one.
+        ~Shape();
+        
+        // Gets the number of fields objects with this shape have.
+        int NumFields() const { return mNumFields; }
+        
+        // Gets the epochs of the caches in the interpreter that owns this
+        // shape.
+        CacheEpochs & Epochs() const { return *mEpochs; }
+        
+        // Gets the slot where the field with the given name is stored, or -1
+        // if objects with this shape don't have the field.
+        int FindSlot(StringId name) const;
+        
+        // Gets the shape of an object with this shape after the given field
+        // is added to it. The new field is stored in slot NumFields().
+        Shape * AddField(StringId name);
+        
+    private:
+        Shape(const Shape * parent, StringId name);
+        
+        // The shape this one adds a field to, or NULL for the empty shape.
+        const Shape *   mParent;
+        
+        // The name of the added field. It's stored in the last slot.
+        StringId        mName;
+        int             mNumFields;
+        CacheEpochs *   mEpochs;
+        
+        // The shapes created by adding a field to this one.
+        Array<Shape *>  mChildren;
+        
+        NO_COPY(Shape);
+    };
+}
@@ -85,5 +85,18 @@ namespace Finch
     {
         return fiber.CreateNumber(fiber.GetCallstackDepth());
     }
+    
+    PRIMITIVE(PrimitiveGetHeapStats)
+    {
+        const AllocationStats & stats =
+            fiber.GetInterpreter().GetAllocationStats();
+        
+        return fiber.CreateString(String::Format(
+            "%llu allocations, %llu reused, %llu large, %lluK in slabs",
+            static_cast<unsigned long long>(stats.numAllocations),
+            static_cast<unsigned long long>(stats.numReused),
+            static_cast<unsigned long long>(stats.numLarge),
+            static_cast<unsigned long long>(stats.slabBytes / 1024)));
+    }
 }
 
@@ -18,5 +18,6 @@ namespace Finch
     PRIMITIVE(PrimitiveSwitchToFiber);
      */
     PRIMITIVE(PrimitiveGetCallstackDepth);
+    PRIMITIVE(PrimitiveGetHeapStats);
 }
 
@@ -1,7 +1,6 @@
 #include <math.h>
 
 #include "NumberPrimitives.h"
-#include "NumberObject.h"
 #include "Fiber.h"
 
 namespace Finch
@@ -4,6 +4,7 @@
 #include "ObjectPrimitives.h"
 #include "DynamicObject.h"
 #include "Fiber.h"
+#include "Interpreter.h"
 #include "Object.h"
 
 namespace Finch
@@ -21,6 +22,8 @@ namespace Finch
     
     PRIMITIVE(ObjectGetParent)
     {
+        if (self.IsNumber()) return fiber.GetInterpreter().NumberPrototype();
+        
         Value parent = self.Parent();
         
         // If we don't have a parent, we're at Object, so just return Object
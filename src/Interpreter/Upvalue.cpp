@@ -1,4 +1,5 @@
 #include "Upvalue.h"
+#include "Heap.h"
 
 namespace Finch
 {
@@ -44,5 +45,10 @@ namespace Finch
     {
         return mStackIndex != -1;
     }
+    
+    void Upvalue::MarkReferences(Heap & heap)
+    {
+        if (!IsOpen()) heap.Mark(mValue);
+    }
 }
 
@@ -13,7 +13,9 @@ namespace Finch
     // TODO(bob): If we get rid of Ref<T> and use pointers and a more direct
     // value representation, this can be much simpler and we can get rid of
     // the weird passing in the stack thing.
-    class Upvalue
+    class Heap;
+    
+    class Upvalue : public RefCounted
     {
     public:
         // Default constructor so we can use it in Array<T>.
@@ -30,6 +32,10 @@ namespace Finch
         void Close(Array<Value> & stack);        
         int Index() const;        
         bool IsOpen() const;
+        
+        // Marks the captured value if the upvalue has been closed. An open
+        // one's value is on the fiber's stack, which is marked with it.
+        void MarkReferences(Heap & heap);
 
         Ref<Upvalue> Next() const { return mNext; }
         void SetNext(Ref<Upvalue> upvalue) { mNext = upvalue; }
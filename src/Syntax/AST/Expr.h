@@ -18,11 +18,16 @@ namespace Finch
 {
     using std::ostream;
     
+    class BlockExpr;
     class IExprCompiler;
     class IExprVisitor;
+    class MessageExpr;
+    class NameExpr;
+    class NumberExpr;
     class Object;
+    class StringExpr;
         
-    class Expr
+    class Expr : public RefCounted
     {
     public:
         // Determines if a name is a variable name or a field name. Field names
@@ -36,6 +41,13 @@ namespace Finch
         
         virtual ~Expr() {}
         
+        // Dynamic casts. Returns NULL if the expression isn't that type.
+        virtual const BlockExpr *   AsBlock()   const { return NULL; }
+        virtual const MessageExpr * AsMessage() const { return NULL; }
+        virtual const NameExpr *    AsName()    const { return NULL; }
+        virtual const NumberExpr *  AsNumber()  const { return NULL; }
+        virtual const StringExpr *  AsString()  const { return NULL; }
+        
         // The visitor pattern.
         virtual void Accept(IExprCompiler & compiler, int dest) const = 0;
         
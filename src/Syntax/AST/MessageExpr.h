@@ -68,6 +68,8 @@ namespace Finch
         Ref<Expr>                  Receiver() const { return mReceiver; }
         const Array<MessageSend> & Messages() const { return mMessages; }
         
+        virtual const MessageExpr * AsMessage() const { return this; }
+        
         void AddSend(String name, const Array<Ref<Expr> > & args)
         {
             mMessages.Add(MessageSend(name, args));
@@ -20,6 +20,8 @@ namespace Finch
         
         String Name() const { return mName; }
         
+        virtual const NameExpr * AsName() const { return this; }
+        
         virtual void Trace(ostream & stream) const
         {
             stream << mName;
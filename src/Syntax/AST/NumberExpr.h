@@ -21,6 +21,8 @@ namespace Finch
         
         double GetValue() const { return mValue; }
         
+        virtual const NumberExpr * AsNumber() const { return this; }
+        
         virtual void Trace(ostream & stream) const
         {
             stream << mValue;
@@ -21,6 +21,8 @@ namespace Finch
         
         String GetValue() const { return mValue; }
         
+        virtual const StringExpr * AsString() const { return this; }
+        
         virtual void Trace(ostream & stream) const
         {
             stream << '\"' << mValue << '\"';
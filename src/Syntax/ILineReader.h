@@ -4,6 +4,7 @@
 
 #include "Macros.h"
 #include "FinchString.h"
+#include "Ref.h"
 
 namespace Finch
 {
@@ -11,7 +12,7 @@ namespace Finch
     // source. Used to abstract where the Lexer gets its Finch source code from
     // so that we can use it both for the Repl and for parsing entire source
     // files.
-    class ILineReader
+    class ILineReader : public RefCounted
     {
     public:
         virtual ~ILineReader() {}
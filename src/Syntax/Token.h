@@ -47,7 +47,7 @@ namespace Finch
     
     // A single meaningful Token of source code. Generated by the Lexer, and
     // consumed by the Parser.
-    class Token
+    class Token : public RefCounted
     {
     public:
         Token(TokenType type)
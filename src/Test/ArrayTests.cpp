@@ -9,6 +9,7 @@ namespace Finch
         TestSubscript();
         TestRemoveAt();
         TestTruncate();
+        TestFill();
     }
     
     void ArrayTests::TestCtor()
@@ -96,5 +97,30 @@ namespace Finch
         array.Truncate(0);
         EXPECT_EQUAL(0, array.Count());
     }
+    
+    void ArrayTests::TestFill()
+    {
+        Array<char> array;
+        array.Fill(3, 'a');
+        
+        EXPECT_EQUAL(3, array.Count());
+        EXPECT_EQUAL('a', array[0]);
+        EXPECT_EQUAL('a', array[2]);
+        
+        // Growing.
+        array.Fill(40, 'b');
+        EXPECT_EQUAL(40, array.Count());
+        EXPECT_EQUAL('b', array[0]);
+        EXPECT_EQUAL('b', array[39]);
+        
+        // Shrinking keeps the storage.
+        int capacity = array.Capacity();
+        array.Fill(2, 'c');
+        EXPECT_EQUAL(2, array.Count());
+        EXPECT_EQUAL('c', array[1]);
+        EXPECT_EQUAL(capacity, array.Capacity());
+        
+        array.Fill(0, 'd');
+        EXPECT_EQUAL(0, array.Count());
+    }
 }
-
@@ -14,6 +14,7 @@ namespace Finch
         static void TestSubscript();
         static void TestRemoveAt();
         static void TestTruncate();
+        static void TestFill();
     };
 }
 
@@ -0,0 +1,200 @@
+#include "HeapTests.h"
+#include "Heap.h"
+
+namespace Finch
+{
+    // An object that refers to one other value and counts how many objects
+    // of its kind have been freed.
+    class LinkObject : public Object
+    {
+    public:
+        LinkObject() : Object(Value()) {}
+        
+        virtual ~LinkObject() { sNumFreed++; }
+        
+        virtual void Trace(ostream & stream) const { stream << "link"; }
+        
+        virtual void MarkReferences(Heap & heap)
+        {
+            Object::MarkReferences(heap);
+            heap.Mark(link);
+        }
+        
+        Value link;
+        
+        static int sNumFreed;
+    };
+    
+    int LinkObject::sNumFreed = 0;
+    
+    // An object too big for any of the heap's size classes.
+    class BigObject : public LinkObject
+    {
+    public:
+        char padding[1024];
+    };
+    
+    void HeapTests::Run()
+    {
+        TestCollectUnreachable();
+        TestKeepReachable();
+        TestPermanent();
+        TestReuseFreed();
+        TestLargeObjects();
+        TestFreeAll();
+    }
+    
+    void HeapTests::TestCollectUnreachable()
+    {
+        LinkObject::sNumFreed = 0;
+        
+        Heap heap;
+        EXPECT(!heap.ShouldCollect());
+        
+        // a and b refer to each other but nothing refers to them
+        LinkObject * a = new (heap) LinkObject();
+        LinkObject * b = new (heap) LinkObject();
+        Value aValue = heap.Add(a);
+        Value bValue = heap.Add(b);
+        a->link = bValue;
+        b->link = aValue;
+        
+        Value root = heap.Add(new (heap) LinkObject());
+        EXPECT_EQUAL(3, heap.NumObjects());
+        
+        heap.Mark(root);
+        heap.Collect();
+        
+        EXPECT_EQUAL(2, LinkObject::sNumFreed);
+        EXPECT_EQUAL(1, heap.NumObjects());
+        EXPECT_EQUAL(1, heap.NumCollections());
+    }
+    
+    void HeapTests::TestKeepReachable()
+    {
+        LinkObject::sNumFreed = 0;
+        
+        Heap heap;
+        
+        // root -> middle -> leaf -> middle
+        LinkObject * root = new (heap) LinkObject();
+        LinkObject * middle = new (heap) LinkObject();
+        LinkObject * leaf = new (heap) LinkObject();
+        Value rootValue = heap.Add(root);
+        root->link = heap.Add(middle);
+        middle->link = heap.Add(leaf);
+        leaf->link = root->link;
+        
+        heap.Mark(rootValue);
+        heap.Collect();
+        
+        EXPECT_EQUAL(0, LinkObject::sNumFreed);
+        EXPECT_EQUAL(3, heap.NumObjects());
+        
+        // the marks are cleared afterwards, so unless they are marked again,
+        // the next collection frees them
+        root->link.Clear();
+        heap.Mark(rootValue);
+        heap.Collect();
+        
+        EXPECT_EQUAL(2, LinkObject::sNumFreed);
+        EXPECT_EQUAL(1, heap.NumObjects());
+        
+        heap.Collect();
+        
+        EXPECT_EQUAL(3, LinkObject::sNumFreed);
+        EXPECT_EQUAL(0, heap.NumObjects());
+        EXPECT_EQUAL(3, heap.NumCollections());
+    }
+    
+    void HeapTests::TestPermanent()
+    {
+        LinkObject::sNumFreed = 0;
+        
+        Heap heap;
+        
+        // a permanent object keeps what it refers to without being marked
+        LinkObject * permanent = new (heap) LinkObject();
+        heap.AddPermanent(permanent);
+        permanent->link = heap.Add(new (heap) LinkObject());
+        heap.Add(new (heap) LinkObject());
+        EXPECT_EQUAL(2, heap.NumObjects());
+        
+        heap.Collect();
+        
+        EXPECT_EQUAL(1, LinkObject::sNumFreed);
+        EXPECT_EQUAL(1, heap.NumObjects());
+        
+        permanent->link.Clear();
+        heap.Collect();
+        
+        EXPECT_EQUAL(2, LinkObject::sNumFreed);
+        EXPECT_EQUAL(0, heap.NumObjects());
+    }
+    
+    void HeapTests::TestReuseFreed()
+    {
+        Heap heap;
+        
+        LinkObject * a = new (heap) LinkObject();
+        heap.Add(a);
+        heap.Collect();
+        
+        // the next object of the same size gets the freed memory
+        LinkObject * b = new (heap) LinkObject();
+        heap.Add(b);
+        EXPECT(static_cast<void *>(a) == static_cast<void *>(b));
+        
+        // but not while it's still in use
+        LinkObject * c = new (heap) LinkObject();
+        heap.Add(c);
+        EXPECT(b != c);
+        
+        const AllocationStats & stats = heap.GetAllocationStats();
+        EXPECT_EQUAL(3u, stats.numAllocations);
+        EXPECT_EQUAL(1u, stats.numReused);
+        EXPECT_EQUAL(0u, stats.numLarge);
+        EXPECT(stats.slabBytes > 0);
+    }
+    
+    void HeapTests::TestLargeObjects()
+    {
+        LinkObject::sNumFreed = 0;
+        
+        Heap heap;
+        
+        BigObject * big = new (heap) BigObject();
+        Value bigValue = heap.Add(big);
+        big->link = heap.Add(new (heap) LinkObject());
+        heap.Add(new (heap) BigObject());
+        
+        EXPECT_EQUAL(3u, heap.GetAllocationStats().numAllocations);
+        EXPECT_EQUAL(2u, heap.GetAllocationStats().numLarge);
+        
+        heap.Mark(bigValue);
+        heap.Collect();
+        
+        EXPECT_EQUAL(1, LinkObject::sNumFreed);
+        EXPECT_EQUAL(2, heap.NumObjects());
+    }
+    
+    void HeapTests::TestFreeAll()
+    {
+        LinkObject::sNumFreed = 0;
+        
+        {
+            Heap heap;
+            for (int i = 0; i < 10; i++)
+            {
+                LinkObject * object = new (heap) LinkObject();
+                heap.Add(object);
+                object->link = heap.Add(new (heap) LinkObject());
+            }
+            
+            heap.AddPermanent(new (heap) LinkObject());
+        }
+        
+        EXPECT_EQUAL(21, LinkObject::sNumFreed);
+    }
+}
+
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "Test.h"
+
+namespace Finch
+{
+    class HeapTests : public Test
+    {
+    public:
+        static void Run();
+        
+    private:
+        static void TestCollectUnreachable();
+        static void TestKeepReachable();
+        static void TestPermanent();
+        static void TestReuseFreed();
+        static void TestLargeObjects();
+        static void TestFreeAll();
+    };
+}
+
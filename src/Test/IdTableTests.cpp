@@ -0,0 +1,266 @@
+#include <ctime>
+
+#include "IdTableTests.h"
+#include "Dictionary.h"
+
+namespace Finch
+{
+    void IdTableTests::Run()
+    {
+        TestInsertFind();
+        TestReplace();
+        TestRemove();
+        TestTombstones();
+        TestAddAll();
+        TestClear();
+        TestFindKeyForValue();
+        TestValueAt();
+        TestMemorySize();
+        MeasureLookups();
+    }
+    
+    void IdTableTests::TestInsertFind()
+    {
+        IdTable<int> table;
+        int value = 0;
+        
+        EXPECT_EQUAL(0, table.Count());
+        EXPECT(!table.Find(3, &value));
+        
+        // enough items to go past the inline ones and grow the hashtable a
+        // few times
+        for (int i = 0; i < 100; i++)
+        {
+            table.Insert(i * 3, i);
+            EXPECT_EQUAL(i + 1, table.Count());
+            
+            for (int j = 0; j <= i; j++)
+            {
+                EXPECT(table.Find(j * 3, &value));
+                EXPECT_EQUAL(j, value);
+            }
+            
+            EXPECT(!table.Find(i * 3 + 1, &value));
+        }
+        
+        // inserting an existing key replaces its value
+        table.Insert(6, 123);
+        EXPECT_EQUAL(100, table.Count());
+        EXPECT_EQUAL(123, *table.Find(6));
+        EXPECT(table.Find(7) == NULL);
+    }
+    
+    void IdTableTests::TestReplace()
+    {
+        IdTable<int> table;
+        
+        EXPECT(!table.Replace(1, 2));
+        EXPECT_EQUAL(0, table.Count());
+        
+        table.Insert(1, 2);
+        EXPECT(table.Replace(1, 3));
+        EXPECT_EQUAL(3, *table.Find(1));
+        
+        for (int i = 2; i < 20; i++) table.Insert(i, i);
+        EXPECT(table.Replace(1, 4));
+        EXPECT_EQUAL(4, *table.Find(1));
+        EXPECT(!table.Replace(20, 4));
+        EXPECT_EQUAL(19, table.Count());
+    }
+    
+    void IdTableTests::TestRemove()
+    {
+        // inline
+        {
+            IdTable<int> table;
+            table.Insert(1, 10);
+            table.Insert(2, 20);
+            table.Insert(3, 30);
+            
+            EXPECT(table.Remove(1));
+            EXPECT(!table.Remove(1));
+            EXPECT_EQUAL(2, table.Count());
+            EXPECT(table.Find(1) == NULL);
+            EXPECT_EQUAL(20, *table.Find(2));
+            EXPECT_EQUAL(30, *table.Find(3));
+        }
+        
+        // keys that all collide in the hashtable form a single probe chain.
+        // removing one from the middle must not cut off the ones after it.
+        {
+            IdTable<int> table;
+            for (int i = 0; i < 6; i++) table.Insert(1 + i * 64, i);
+            
+            EXPECT(table.Remove(1 + 2 * 64));
+            EXPECT_EQUAL(5, table.Count());
+            EXPECT(table.Find(1 + 2 * 64) == NULL);
+            
+            for (int i = 0; i < 6; i++)
+            {
+                if (i == 2) continue;
+                EXPECT_EQUAL(i, *table.Find(1 + i * 64));
+            }
+            
+            // the removed slot can be used again
+            table.Insert(1 + 2 * 64, 7);
+            EXPECT_EQUAL(7, *table.Find(1 + 2 * 64));
+            EXPECT_EQUAL(5, *table.Find(1 + 5 * 64));
+            EXPECT_EQUAL(6, table.Count());
+        }
+    }
+    
+    void IdTableTests::TestTombstones()
+    {
+        IdTable<int> table;
+        for (int i = 0; i < 10; i++) table.Insert(i, i);
+        
+        // churning through many different keys leaves tombstones behind, but
+        // once the table has room for them it shouldn't keep growing
+        int size = 0;
+        for (int i = 10; i < 10000; i++)
+        {
+            table.Insert(i, i);
+            EXPECT(table.Remove(i - 5));
+            
+            if (i == 100) size = table.MemorySize();
+        }
+        
+        EXPECT_EQUAL(10, table.Count());
+        EXPECT_EQUAL(size, table.MemorySize());
+        
+        for (int i = 0; i < 5; i++) EXPECT_EQUAL(i, *table.Find(i));
+        for (int i = 9995; i < 10000; i++) EXPECT_EQUAL(i, *table.Find(i));
+        EXPECT(table.Find(5000) == NULL);
+    }
+    
+    void IdTableTests::TestAddAll()
+    {
+        IdTable<int> small;
+        small.Insert(1, 1);
+        small.Insert(2, 2);
+        
+        IdTable<int> big;
+        for (int i = 0; i < 20; i++) big.Insert(i + 100, i);
+        big.Remove(105);
+        
+        IdTable<int> table;
+        table.AddAll(small);
+        table.AddAll(big);
+        
+        EXPECT_EQUAL(21, table.Count());
+        EXPECT_EQUAL(2, *table.Find(2));
+        EXPECT_EQUAL(19, *table.Find(119));
+        EXPECT(table.Find(105) == NULL);
+    }
+    
+    void IdTableTests::TestClear()
+    {
+        IdTable<int> table;
+        for (int i = 0; i < 20; i++) table.Insert(i, i);
+        
+        table.Clear();
+        EXPECT_EQUAL(0, table.Count());
+        EXPECT(table.Find(3) == NULL);
+        EXPECT_EQUAL(static_cast<int>(sizeof(IdTable<int>)),
+                     table.MemorySize());
+        
+        // still usable afterwards
+        table.Insert(3, 4);
+        EXPECT_EQUAL(4, *table.Find(3));
+    }
+    
+    void IdTableTests::TestFindKeyForValue()
+    {
+        IdTable<int> table;
+        
+        // an empty table has no keys, even for a default-constructed value
+        EXPECT_EQUAL(NO_STRING, table.FindKeyForValue(0));
+        
+        table.Insert(7, 0);
+        EXPECT_EQUAL(7, table.FindKeyForValue(0));
+        
+        for (int i = 1; i < 20; i++) table.Insert(i + 10, i);
+        EXPECT_EQUAL(7, table.FindKeyForValue(0));
+        EXPECT_EQUAL(15, table.FindKeyForValue(5));
+        EXPECT_EQUAL(NO_STRING, table.FindKeyForValue(50));
+    }
+    
+    void IdTableTests::TestValueAt()
+    {
+        IdTable<int> table;
+        EXPECT_EQUAL(0, table.NumItemSlots());
+        
+        // both while the items are inline and once they're in the hashtable,
+        // the slots hold every item exactly once
+        for (int i = 0; i < 20; i++)
+        {
+            table.Insert(i * 2, i);
+            if (i % 3 == 0) table.Remove(i * 2);
+            
+            int sum = 0;
+            int count = 0;
+            for (int slot = 0; slot < table.NumItemSlots(); slot++)
+            {
+                const int * value = table.ValueAt(slot);
+                if (value == NULL) continue;
+                
+                sum += *value;
+                count++;
+            }
+            
+            int expectedSum = 0;
+            for (int j = 0; j <= i; j++)
+            {
+                if (j % 3 != 0) expectedSum += j;
+            }
+            
+            EXPECT_EQUAL(table.Count(), count);
+            EXPECT_EQUAL(expectedSum, sum);
+        }
+    }
+    
+    void IdTableTests::TestMemorySize()
+    {
+        // small tables don't allocate anything
+        IdTable<int> table;
+        for (int i = 0; i < 4; i++) table.Insert(i, i);
+        EXPECT_EQUAL(static_cast<int>(sizeof(IdTable<int>)),
+                     table.MemorySize());
+        
+        table.Insert(4, 4);
+        EXPECT(table.MemorySize() > static_cast<int>(sizeof(IdTable<int>)));
+    }
+    
+    // Not a test, but reports how long a lookup takes and how much memory a
+    // table uses at a few different sizes.
+    void IdTableTests::MeasureLookups()
+    {
+        const int numLookups = 1 << 22;
+        const int sizes[] = { 1, 4, 8, 64, 1024 };
+        const int numSizes = sizeof(sizes) / sizeof(sizes[0]);
+        
+        cout << "IdTable lookups:" << endl;
+        for (int i = 0; i < numSizes; i++)
+        {
+            IdTable<int> table;
+            for (int key = 0; key < sizes[i]; key++) table.Insert(key * 7, key);
+            
+            // half of the lookups miss
+            int found = 0;
+            clock_t start = clock();
+            for (int j = 0; j < numLookups; j++)
+            {
+                if (table.Find((j % (sizes[i] * 2)) * 7) != NULL) found++;
+            }
+            clock_t end = clock();
+            
+            EXPECT_EQUAL(numLookups / 2, found);
+            
+            double ns = 1000000000.0 * (end - start) / CLOCKS_PER_SEC /
+                        numLookups;
+            cout << "  " << sizes[i] << " items: " << ns << " ns/lookup, " <<
+                table.MemorySize() << " bytes" << endl;
+        }
+    }
+}
+
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "Test.h"
+
+namespace Finch
+{
+    class IdTableTests : public Test
+    {
+    public:
+        static void Run();
+        
+    private:
+        static void TestInsertFind();
+        static void TestReplace();
+        static void TestRemove();
+        static void TestTombstones();
+        static void TestAddAll();
+        static void TestClear();
+        static void TestFindKeyForValue();
+        static void TestValueAt();
+        static void TestMemorySize();
+        static void MeasureLookups();
+    };
+}
+
@@ -3,7 +3,7 @@
 
 namespace Finch
 {
-    class DestructorTester
+    class DestructorTester : public RefCounted
     {
     public:
         DestructorTester()
@@ -22,14 +22,24 @@ namespace Finch
 
     bool DestructorTester::sDestructed = 0;
     
+    class IntHolder : public RefCounted
+    {
+    public:
+        IntHolder(int value)
+        :   value(value)
+        {}
+        
+        int value;
+    };
+    
     void RefTests::Run()
     {
         // dereferencing
         {
-            Ref<int> r(new int(1234));
+            Ref<IntHolder> r(new IntHolder(1234));
             
             // get the value back out
-            EXPECT_EQUAL(1234, *r);
+            EXPECT_EQUAL(1234, r->value);
         }
         
         // nested reference
@@ -77,10 +87,38 @@ namespace Finch
         }
         
         {
-            Ref<int> a(new int(123));
-            Ref<int> b = a;
+            Ref<IntHolder> a(new IntHolder(123));
+            Ref<IntHolder> b = a;
+            
+            b = Ref<IntHolder>();
+        }
+        
+        // assigning to itself
+        {
+            Ref<DestructorTester> r1(new DestructorTester());
+            Ref<DestructorTester> & r2 = r1;
+            
+            r1 = r2;
+            
+            EXPECT_EQUAL(false, DestructorTester::Destructed());
+            
+            r1.Clear();
+            
+            EXPECT_EQUAL(true, DestructorTester::Destructed());
+        }
+        
+        // uniqueness
+        {
+            Ref<IntHolder> r1(new IntHolder(1));
+            EXPECT_EQUAL(true, r1.IsUnique());
+            
+            {
+                Ref<IntHolder> r2 = r1;
+                EXPECT_EQUAL(false, r1.IsUnique());
+                EXPECT_EQUAL(false, r2.IsUnique());
+            }
             
-            b = Ref<int>();
+            EXPECT_EQUAL(true, r1.IsUnique());
         }
     }
 }
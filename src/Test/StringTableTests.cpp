@@ -0,0 +1,51 @@
+#include "StringTableTests.h"
+#include "StringTable.h"
+
+namespace Finch
+{
+    void StringTableTests::Run()
+    {
+        TestAdd();
+        TestMany();
+    }
+    
+    void StringTableTests::TestAdd()
+    {
+        StringTable table;
+        
+        StringId a = table.Add("a");
+        StringId b = table.Add("b");
+        StringId empty = table.Add("");
+        
+        EXPECT(a != b);
+        EXPECT(a != empty);
+        
+        // adding the same string again gives the same id
+        EXPECT_EQUAL(a, table.Add("a"));
+        EXPECT_EQUAL(b, table.Add(String("b")));
+        EXPECT_EQUAL(empty, table.Add(""));
+        
+        EXPECT_EQUAL(String("a"), table.Find(a));
+        EXPECT_EQUAL(String("b"), table.Find(b));
+        EXPECT_EQUAL(String(""), table.Find(empty));
+    }
+    
+    void StringTableTests::TestMany()
+    {
+        StringTable table;
+        
+        // enough to rehash a few times
+        for (int i = 0; i < 1000; i++)
+        {
+            EXPECT_EQUAL(i, table.Add(String::Format("s%d", i)));
+        }
+        
+        for (int i = 0; i < 1000; i++)
+        {
+            String string = String::Format("s%d", i);
+            EXPECT_EQUAL(i, table.Add(string));
+            EXPECT_EQUAL(string, table.Find(i));
+        }
+    }
+}
+
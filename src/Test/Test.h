@@ -2,7 +2,7 @@
 
 #include <iostream>
 
-#include "String.h"
+#include "FinchString.h"
 
 #define EXPECT(condition) \
 _Expect(__FILE__, __LINE__, #condition, condition)
@@ -1,10 +1,13 @@
 #include <iostream>
 
 #include "ArrayTests.h"
+#include "HeapTests.h"
+#include "IdTableTests.h"
 #include "LexerTests.h"
 #include "QueueTests.h"
 #include "RefTests.h"
 #include "StackTests.h"
+#include "StringTableTests.h"
 #include "StringTests.h"
 #include "TokenTests.h"
 
@@ -14,10 +17,13 @@ int main (int argc, char * const argv[])
     using namespace Finch;
     
     ArrayTests::Run();
+    HeapTests::Run();
+    IdTableTests::Run();
     LexerTests::Run();
     QueueTests::Run();
     RefTests::Run();
     StackTests::Run();
+    StringTableTests::Run();
     StringTests::Run();
     TokenTests::Run();
     
@@ -3,6 +3,7 @@
 #include <stdlib.h> // realpath
 #include <sys/param.h> // PATH_MAX
 
+#include "Block.h"
 #include "FileLineReader.h"
 #include "FinchString.h"
 #include "Interpreter.h"
@@ -19,6 +20,8 @@ using std::endl;
 Ref<ILineReader> OpenFile(String filePath);
 bool InterpretFile(Interpreter & interpreter, String filePath);
 PRIMITIVE(LoadFile);
+PRIMITIVE(CompileFile);
+PRIMITIVE(FrameStatsFile);
 
 //### bob: should move this stuff into a "standalone" class
 Ref<ILineReader> OpenFile(String filePath)
@@ -53,6 +56,34 @@ PRIMITIVE(LoadFile)
     return fiber.Nil();
 }
 
+// Compiles the given file without running it. Used to benchmark the compiler.
+PRIMITIVE(CompileFile)
+{
+    String filePath = args[0].AsString();
+    Ref<ILineReader> reader = OpenFile(filePath);
+    if (reader.IsNull()) return fiber.CreateBool(false);
+    
+    return fiber.CreateBool(fiber.GetInterpreter().Compile(*reader));
+}
+
+// Compiles the given file without running it and describes how many registers
+// its blocks' frames use, both as the compiler reserved them and after they
+// were allocated.
+PRIMITIVE(FrameStatsFile)
+{
+    String filePath = args[0].AsString();
+    Ref<ILineReader> reader = OpenFile(filePath);
+    if (reader.IsNull()) return fiber.Nil();
+    
+    FrameStats stats;
+    if (!fiber.GetInterpreter().Compile(*reader, &stats)) return fiber.Nil();
+    
+    return fiber.CreateString(String::Format(
+        "%d blocks, %d -> %d registers, largest frame %d -> %d",
+        stats.numBlocks, stats.reservedRegisters, stats.numRegisters,
+        stats.largestReserved, stats.largest));
+}
+
 int main (int argc, char * const argv[])
 {    
     StandaloneInterpreterHost host;
@@ -60,6 +91,8 @@ int main (int argc, char * const argv[])
 
     // Set up the standalone-provided behavior.
     interpreter.BindMethod("Ether", "load:", LoadFile);
+    interpreter.BindMethod("Ether", "compile:", CompileFile);
+    interpreter.BindMethod("Ether", "frame-stats:", FrameStatsFile);
 
     // Figure out the absolute path to the core library, relative to the
     // executable. Assumes a directory layout like:
@@ -73,12 +106,15 @@ int main (int argc, char * const argv[])
     realpath(coreLibPath, fullPath);
 
     // Load the core library.
-    if (!InterpretFile(interpreter, fullPath))
+    Ref<ILineReader> coreLib = OpenFile(fullPath);
+    if (coreLib.IsNull())
     {
         cout << "Could not load core library." << endl;
         return 2;
     }
     
+    interpreter.LoadCoreLibrary(*coreLib);
+    
     if (argc == 1)
     {
         // With no arguments (arg zero is app), run in interactive mode.